@@ -0,0 +1,542 @@
+#ifndef BRICKEDVOLUME_H
+#define BRICKEDVOLUME_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+#include "volume.h"
+
+using namespace std;
+
+/**
+ * Byte oriented LZ77 codec for brick payloads. A stream is a list of
+ * sequences: a token whose high and low nibble hold the literal count and the
+ * match length minus 4, the literals, and a 2 byte little endian offset back
+ * into the output. Counts of 15 continue in bytes that are added up until one
+ * is below 255. The last sequence only has literals. Runs of one value are
+ * matches at offset 1, so air costs a few bytes per brick
+ */
+namespace brickcodec {
+
+const int MIN_MATCH = 4;
+const int HASH_BITS = 14;
+const size_t MAX_OFFSET = 65535;
+
+inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+inline void writeCount(vector<uint8_t> &out, size_t count) {
+    for(; count >= 255; count -= 255) {
+        out.push_back(255);
+    }
+    out.push_back((uint8_t)count);
+}
+
+inline void writeSequence(vector<uint8_t> &out, const uint8_t *literals, size_t literalCount, size_t offset, size_t matchLength) {
+    size_t match = matchLength ? matchLength - MIN_MATCH : 0;
+    out.push_back((uint8_t)(min(literalCount, (size_t)15) << 4 | min(match, (size_t)15)));
+    if(literalCount >= 15) {
+        writeCount(out, literalCount - 15);
+    }
+    out.insert(out.end(), literals, literals + literalCount);
+    if(matchLength) {
+        out.push_back((uint8_t)offset);
+        out.push_back((uint8_t)(offset >> 8));
+        if(match >= 15) {
+            writeCount(out, match - 15);
+        }
+    }
+}
+
+inline void compress(const uint8_t *in, size_t n, vector<uint8_t> &out) {
+    out.clear();
+    vector<size_t> table((size_t)1 << HASH_BITS, SIZE_MAX);
+    size_t anchor = 0, i = 0;
+    while(i + MIN_MATCH <= n) {
+        uint32_t sequence = read32(in + i);
+        size_t h = (sequence * 2654435761u) >> (32 - HASH_BITS);
+        size_t candidate = table[h];
+        table[h] = i;
+        if(candidate == SIZE_MAX || i - candidate > MAX_OFFSET || read32(in + candidate) != sequence) {
+            i++;
+            continue;
+        }
+        size_t length = MIN_MATCH;
+        while(i + length < n && in[candidate + length] == in[i + length]) {
+            length++;
+        }
+        writeSequence(out, in + anchor, i - anchor, i - candidate, length);
+        i += length;
+        anchor = i;
+    }
+    writeSequence(out, in + anchor, n - anchor, 0, 0);
+}
+
+inline bool readCount(const uint8_t *&p, const uint8_t *end, size_t &count) {
+    uint8_t b;
+    do {
+        if(p >= end) {
+            return false;
+        }
+        b = *p++;
+        count += b;
+    } while(b == 255);
+    return true;
+}
+
+// Decode exactly n bytes into out, false when the stream is damaged
+inline bool decompress(const uint8_t *in, size_t size, uint8_t *out, size_t n) {
+    const uint8_t *p = in, *end = in + size;
+    size_t o = 0;
+    while(p < end) {
+        uint8_t token = *p++;
+        size_t literals = token >> 4;
+        if(literals == 15 && !readCount(p, end, literals)) {
+            return false;
+        }
+        if(literals > (size_t)(end - p) || literals > n - o) {
+            return false;
+        }
+        memcpy(out + o, p, literals);
+        p += literals;
+        o += literals;
+        if(p == end) {
+            break;
+        }
+        if(end - p < 2) {
+            return false;
+        }
+        size_t offset = p[0] | (size_t)p[1] << 8;
+        p += 2;
+        size_t length = token & 15;
+        if(length == 15 && !readCount(p, end, length)) {
+            return false;
+        }
+        length += MIN_MATCH;
+        if(offset == 0 || offset > o || length > n - o) {
+            return false;
+        }
+        // Matches may overlap the bytes they produce
+        for(size_t i = 0; i < length; i++, o++) {
+            out[o] = out[o - offset];
+        }
+    }
+    return o == n;
+}
+
+// Group the bytes of multi byte voxels by their position in the voxel, the
+// high bytes of sparse data are mostly equal and compress far better
+inline void shuffle(const uint8_t *in, size_t n, size_t width, uint8_t *out) {
+    size_t count = n / width;
+    for(size_t i = 0; i < count; i++) {
+        for(size_t b = 0; b < width; b++) {
+            out[b * count + i] = in[i * width + b];
+        }
+    }
+}
+
+inline void unshuffle(const uint8_t *in, size_t n, size_t width, uint8_t *out) {
+    size_t count = n / width;
+    for(size_t i = 0; i < count; i++) {
+        for(size_t b = 0; b < width; b++) {
+            out[i * width + b] = in[b * count + i];
+        }
+    }
+}
+
+}
+
+/**
+ * Volume stored as bricks of BRICK^3 voxels, each compressed on its own. A
+ * directory in front of the payloads holds where every brick is and the
+ * value range of its voxels plus a one voxel halo around them, so the bricks
+ * that can not hold the surface at a level are found without reading them.
+ * Every cell touching a voxel of a brick lies inside the halo, and bricks on
+ * the faces of the volume include the border that the volume is closed with
+ * (the low end of the range). Files are little endian:
+ *
+ *     "MCBRICK1", int32 x y z, int32 brick size, int32 VoxelType,
+ *     float low high, uint64 brick count,
+ *     per brick: uint64 offset, uint32 bytes, uint32 encoding, float min max,
+ *     payloads
+ *
+ * Bricks are in scan order, x fastest, and so are the voxels of a brick
+ */
+class BrickedVolume {
+public:
+    static const int BRICK = 32;
+
+    // How a brick payload is stored
+    enum Encoding {
+        Stored,
+        Compressed,
+        // All voxels are equal, the payload is the one voxel
+        Constant
+    };
+
+    struct Brick {
+        uint64_t offset;
+        uint32_t bytes;
+        uint32_t encoding;
+        float min, max;
+    };
+
+private:
+    static const size_t HEADER_BYTES = 8 + 5 * 4 + 2 * 4 + 8;
+    static const size_t ENTRY_BYTES = 8 + 4 + 4 + 2 * 4;
+
+    string path;
+    int dims[3] = { 0, 0, 0 };
+    int brick = BRICK;
+    int counts[3] = { 0, 0, 0 };
+    VoxelType voxelType = Uint8;
+    float low = 0.0f, high = 255.0f;
+    vector<Brick> directory;
+
+public:
+    // Read the header and the brick directory of the file at path, errors go
+    // to log
+    bool open(const string &file, ostream &log = cout) {
+        path = file;
+        directory.clear();
+        if(!littleEndianHost()) {
+            log << "Error: bricked volumes are only read on little endian machines" << endl;
+            return false;
+        }
+        FILE *fp = fopen(path.c_str(), "rb");
+        if(!fp) {
+            log << "Error: opening " << path << " failed" << endl;
+            return false;
+        }
+        uint8_t header[HEADER_BYTES];
+        bool ok = fread(header, 1, HEADER_BYTES, fp) == HEADER_BYTES && memcmp(header, "MCBRICK1", 8) == 0;
+        int32_t type = 0;
+        uint64_t count = 0;
+        if(ok) {
+            memcpy(dims, header + 8, 12);
+            memcpy(&brick, header + 20, 4);
+            memcpy(&type, header + 24, 4);
+            memcpy(&low, header + 28, 4);
+            memcpy(&high, header + 32, 4);
+            memcpy(&count, header + 36, 8);
+            ok = type >= Uint8 && type <= Float32 && brick > 0 && dims[0] > 0 && dims[1] > 0 && dims[2] > 0;
+        }
+        if(ok) {
+            voxelType = (VoxelType)type;
+            for(int i = 0; i < 3; i++) {
+                counts[i] = (dims[i] + brick - 1) / brick;
+            }
+            ok = count == (uint64_t)counts[0] * counts[1] * counts[2];
+        }
+        if(ok) {
+            vector<uint8_t> entries(count * ENTRY_BYTES);
+            ok = fread(entries.data(), 1, entries.size(), fp) == entries.size();
+            directory.resize(ok ? count : 0);
+            for(size_t i = 0; i < directory.size(); i++) {
+                const uint8_t *e = &entries[i * ENTRY_BYTES];
+                Brick &b = directory[i];
+                memcpy(&b.offset, e, 8);
+                memcpy(&b.bytes, e + 8, 4);
+                memcpy(&b.encoding, e + 12, 4);
+                memcpy(&b.min, e + 16, 4);
+                memcpy(&b.max, e + 20, 4);
+            }
+        }
+        fclose(fp);
+        if(!ok) {
+            log << "Error: " << path << " is not a bricked volume" << endl;
+        }
+        return ok;
+    }
+
+    const int *dimension() const {
+        return dims;
+    }
+
+    VoxelType type() const {
+        return voxelType;
+    }
+
+    // Voxel values that map to 0 and 1
+    float rangeLow() const {
+        return low;
+    }
+
+    float rangeHigh() const {
+        return high;
+    }
+
+    const vector<Brick> &bricks() const {
+        return directory;
+    }
+
+    // Whether brick i can hold the surface at a level in [levelLow, levelHigh],
+    // levels in [0, 1]
+    bool needed(size_t i, float levelLow, float levelHigh) const {
+        float lo = low + levelLow * (high - low);
+        float hi = low + levelHigh * (high - low);
+        return directory[i].min < hi && directory[i].max >= lo;
+    }
+
+    // Decode the volume into voxels, only decompressing the bricks needed for
+    // levels in [levelLow, levelHigh]. The voxels of the others are set to the
+    // smallest value around them, which is on the same side of every such
+    // level as the voxels were, so surfaces extracted from the voxels
+    // themselves do not change. Returns the number of bricks read through
+    // decoded
+    bool read(vector<uint8_t> &voxels, float levelLow = 0.0f, float levelHigh = 1.0f, size_t *decoded = nullptr) {
+        switch(voxelType) {
+            case Uint8: return read<uint8_t>(voxels, levelLow, levelHigh, decoded);
+            case Uint16: return read<uint16_t>(voxels, levelLow, levelHigh, decoded);
+            case Int16: return read<int16_t>(voxels, levelLow, levelHigh, decoded);
+            default: return read<float>(voxels, levelLow, levelHigh, decoded);
+        }
+    }
+
+    // Whether bricks of brickSize voxels per side fit the 32 bit payload size
+    // of the directory for a volume of the given dimension and type
+    static bool brickFits(const int dimension[3], int brickSize, VoxelType type) {
+        uint64_t bytes = voxelBytes(type);
+        for(int i = 0; i < 3; i++) {
+            bytes *= (uint64_t)min(brickSize, dimension[i]);
+        }
+        return brickSize >= 2 && bytes <= numeric_limits<uint32_t>::max();
+    }
+
+    // Write the voxels of a volume with dimension x, y, z and values [low, high]
+    // as a bricked volume to path
+    static bool write(const string &file, const VolumeSource &volume, const int dimension[3], float rangeLow, float rangeHigh, int brickSize = BRICK) {
+        switch(volume.type()) {
+            case Uint8: return write<uint8_t>(file, volume, dimension, rangeLow, rangeHigh, brickSize);
+            case Uint16: return write<uint16_t>(file, volume, dimension, rangeLow, rangeHigh, brickSize);
+            case Int16: return write<int16_t>(file, volume, dimension, rangeLow, rangeHigh, brickSize);
+            default: return write<float>(file, volume, dimension, rangeLow, rangeHigh, brickSize);
+        }
+    }
+
+private:
+    static bool littleEndianHost() {
+        uint16_t probe = 1;
+        return *(uint8_t*)&probe == 1;
+    }
+
+    // Voxel range [first, last) of brick b along an axis
+    void extent(int axis, int b, int &first, int &last) const {
+        first = b * brick;
+        last = min(first + brick, dims[axis]);
+    }
+
+    template <typename T>
+    bool read(vector<uint8_t> &voxels, float levelLow, float levelHigh, size_t *decoded) {
+        FILE *fp = fopen(path.c_str(), "rb");
+        if(!fp) {
+            cout << "Error: opening " << path << " failed" << endl;
+            return false;
+        }
+        size_t width = sizeof(T);
+        voxels.resize((size_t)dims[0] * dims[1] * dims[2] * width);
+        T *out = (T*)voxels.data();
+        vector<uint8_t> payload, plain, shuffled;
+        size_t count = 0;
+        bool ok = true;
+        for(int bz = 0; bz < counts[2] && ok; bz++) {
+            for(int by = 0; by < counts[1] && ok; by++) {
+                for(int bx = 0; bx < counts[0] && ok; bx++) {
+                    size_t i = ((size_t)bz * counts[1] + by) * counts[0] + bx;
+                    const Brick &b = directory[i];
+                    int x0, x1, y0, y1, z0, z1;
+                    extent(0, bx, x0, x1);
+                    extent(1, by, y0, y1);
+                    extent(2, bz, z0, z1);
+                    size_t rowLength = x1 - x0;
+                    size_t bytes = rowLength * (y1 - y0) * (z1 - z0) * width;
+
+                    // The border can lie outside the values of the type. A
+                    // constant brick with an even halo holds that value, so
+                    // it is filled without reading it
+                    T fillValue = (T)max(b.min, (float)numeric_limits<T>::lowest());
+                    const T *brickVoxels = nullptr;
+                    bool even = b.encoding == Constant && b.min == b.max;
+                    if(needed(i, levelLow, levelHigh) && !even) {
+                        payload.resize(b.bytes);
+                        ok = seekFile(fp, b.offset) && fread(payload.data(), 1, b.bytes, fp) == b.bytes;
+                        if(ok && b.encoding == Constant) {
+                            ok = b.bytes == width;
+                            memcpy(&fillValue, payload.data(), width);
+                        } else if(ok && b.encoding == Stored) {
+                            ok = b.bytes == bytes;
+                            brickVoxels = (const T*)payload.data();
+                        } else if(ok) {
+                            plain.resize(bytes);
+                            shuffled.resize(bytes);
+                            ok = brickcodec::decompress(payload.data(), payload.size(), shuffled.data(), bytes);
+                            brickcodec::unshuffle(shuffled.data(), bytes, width, plain.data());
+                            brickVoxels = (const T*)plain.data();
+                        }
+                        count += b.encoding != Constant;
+                    }
+                    if(!ok) {
+                        break;
+                    }
+                    for(int z = z0; z < z1; z++) {
+                        for(int y = y0; y < y1; y++) {
+                            T *row = out + ((size_t)z * dims[1] + y) * dims[0] + x0;
+                            if(brickVoxels) {
+                                memcpy(row, brickVoxels + ((size_t)(z - z0) * (y1 - y0) + y - y0) * rowLength, rowLength * width);
+                            } else {
+                                fill(row, row + rowLength, fillValue);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        fclose(fp);
+        if(!ok) {
+            cout << "Error: " << path << " is damaged" << endl;
+            vector<uint8_t>().swap(voxels);
+            return false;
+        }
+        if(decoded) {
+            *decoded = count;
+        }
+        return true;
+    }
+
+    // Value range of voxels [first - 1, last] along every axis, the border
+    // outside the volume has value border
+    template <typename T>
+    static void haloRange(const T *voxels, const int dimension[3], const int first[3], const int last[3], float border, float &lo, float &hi) {
+        lo = numeric_limits<float>::infinity();
+        hi = -lo;
+        int begin[3], end[3];
+        for(int i = 0; i < 3; i++) {
+            begin[i] = max(first[i] - 1, 0);
+            end[i] = min(last[i] + 1, dimension[i]);
+            if(first[i] == 0 || last[i] == dimension[i]) {
+                lo = min(lo, border);
+                hi = max(hi, border);
+            }
+        }
+        for(int z = begin[2]; z < end[2]; z++) {
+            for(int y = begin[1]; y < end[1]; y++) {
+                const T *row = voxels + ((size_t)z * dimension[1] + y) * dimension[0];
+                for(int x = begin[0]; x < end[0]; x++) {
+                    lo = min(lo, (float)row[x]);
+                    hi = max(hi, (float)row[x]);
+                }
+            }
+        }
+    }
+
+    template <typename T>
+    static bool write(const string &file, const VolumeSource &volume, const int dimension[3], float rangeLow, float rangeHigh, int brickSize) {
+        if(!littleEndianHost()) {
+            cout << "Error: bricked volumes are only written on little endian machines" << endl;
+            return false;
+        }
+        if(!brickFits(dimension, brickSize, VoxelTraits<T>::type)) {
+            cout << "Error: bricks of " << brickSize << "^3 voxels do not fit the 4 GB a brick can hold" << endl;
+            return false;
+        }
+        FILE *fp = fopen(file.c_str(), "wb");
+        if(!fp) {
+            cout << "Error: writing " << file << " failed" << endl;
+            return false;
+        }
+        int counts[3];
+        for(int i = 0; i < 3; i++) {
+            counts[i] = (dimension[i] + brickSize - 1) / brickSize;
+        }
+        uint64_t count = (uint64_t)counts[0] * counts[1] * counts[2];
+        uint8_t header[HEADER_BYTES];
+        int32_t type = VoxelTraits<T>::type;
+        memcpy(header, "MCBRICK1", 8);
+        memcpy(header + 8, dimension, 12);
+        memcpy(header + 20, &brickSize, 4);
+        memcpy(header + 24, &type, 4);
+        memcpy(header + 28, &rangeLow, 4);
+        memcpy(header + 32, &rangeHigh, 4);
+        memcpy(header + 36, &count, 8);
+        bool ok = fwrite(header, 1, HEADER_BYTES, fp) == HEADER_BYTES;
+
+        // The directory is written once the payload sizes are known
+        vector<uint8_t> entries(count * ENTRY_BYTES);
+        ok = ok && fwrite(entries.data(), 1, entries.size(), fp) == entries.size();
+        uint64_t offset = HEADER_BYTES + entries.size();
+
+        const T *voxels = volume.voxels<T>();
+        size_t width = sizeof(T);
+        vector<uint8_t> plain, shuffled, packed;
+        size_t i = 0;
+        for(int bz = 0; bz < counts[2] && ok; bz++) {
+            for(int by = 0; by < counts[1] && ok; by++) {
+                for(int bx = 0; bx < counts[0] && ok; bx++, i++) {
+                    int first[3] = { bx * brickSize, by * brickSize, bz * brickSize };
+                    int last[3];
+                    for(int a = 0; a < 3; a++) {
+                        last[a] = min(first[a] + brickSize, dimension[a]);
+                    }
+                    size_t rowLength = last[0] - first[0];
+                    plain.clear();
+                    for(int z = first[2]; z < last[2]; z++) {
+                        for(int y = first[1]; y < last[1]; y++) {
+                            const uint8_t *row = (const uint8_t*)(voxels + ((size_t)z * dimension[1] + y) * dimension[0] + first[0]);
+                            plain.insert(plain.end(), row, row + rowLength * width);
+                        }
+                    }
+
+                    Brick b;
+                    haloRange(voxels, dimension, first, last, rangeLow, b.min, b.max);
+                    const uint8_t *payload = plain.data();
+                    b.bytes = plain.size();
+                    b.encoding = Stored;
+                    bool constant = true;
+                    for(size_t v = width; v < plain.size() && constant; v += width) {
+                        constant = memcmp(&plain[v], &plain[0], width) == 0;
+                    }
+                    if(constant) {
+                        b.bytes = width;
+                        b.encoding = Constant;
+                    } else {
+                        shuffled.resize(plain.size());
+                        brickcodec::shuffle(plain.data(), plain.size(), width, shuffled.data());
+                        brickcodec::compress(shuffled.data(), shuffled.size(), packed);
+                        if(packed.size() < plain.size()) {
+                            payload = packed.data();
+                            b.bytes = packed.size();
+                            b.encoding = Compressed;
+                        }
+                    }
+                    b.offset = offset;
+                    offset += b.bytes;
+                    ok = fwrite(payload, 1, b.bytes, fp) == b.bytes;
+
+                    uint8_t *e = &entries[i * ENTRY_BYTES];
+                    memcpy(e, &b.offset, 8);
+                    memcpy(e + 8, &b.bytes, 4);
+                    memcpy(e + 12, &b.encoding, 4);
+                    memcpy(e + 16, &b.min, 4);
+                    memcpy(e + 20, &b.max, 4);
+                }
+            }
+        }
+        ok = ok && seekFile(fp, HEADER_BYTES) && fwrite(entries.data(), 1, entries.size(), fp) == entries.size();
+        ok = fclose(fp) == 0 && ok;
+        if(!ok) {
+            cout << "Error: writing " << file << " failed" << endl;
+        }
+        return ok;
+    }
+};
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef CAMERAPATH_H
+#define CAMERAPATH_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#include "camera.h"
+
+using namespace std;
+
+// One operation of the viewer's camera buttons, repeated on frames frames
+struct CameraStep {
+    enum Kind { ResetFront, ResetTop, Move, Rotate, Hold };
+    Kind kind;
+    // u, v or n for Move and Rotate
+    char axis;
+    // Units for Move, degrees for Rotate
+    float amount;
+    int frames;
+};
+
+/**
+ * A camera path for mc_render, recorded in the viewer with MC_RECORD or
+ * written by hand. Text with one step per line:
+ *
+ *     reset front|top
+ *     move u|v|n <units> [x<frames>]
+ *     rotate u|v|n <degrees> [x<frames>]
+ *     hold <frames>
+ *
+ * Every step is applied to the camera before a frame is drawn, once per
+ * frame for x<frames>, and hold draws frames without moving. Everything
+ * after a # is a comment. The camera starts where Camera() puts it
+ */
+class CameraPath {
+public:
+    vector<CameraStep> steps;
+
+private:
+    // Whether a step was recorded since the last endFrame
+    bool moved = false;
+
+public:
+    bool load(const string &path) {
+        ifstream file(path);
+        if(!file) {
+            cout << "Error: could not read " << path << endl;
+            return false;
+        }
+        steps.clear();
+        string line;
+        for(int number = 1; getline(file, line); number++) {
+            line = line.substr(0, line.find('#'));
+            stringstream ss(line);
+            string op;
+            if(!(ss >> op)) {
+                continue;
+            }
+            CameraStep step = { CameraStep::Hold, 'n', 0.0f, 1 };
+            string arg, repeat;
+            bool ok;
+            if(op == "reset") {
+                ok = (bool)(ss >> arg) && (arg == "front" || arg == "top");
+                step.kind = arg == "top" ? CameraStep::ResetTop : CameraStep::ResetFront;
+            } else if(op == "move" || op == "rotate") {
+                step.kind = op == "move" ? CameraStep::Move : CameraStep::Rotate;
+                ok = (bool)(ss >> arg >> step.amount) && (arg == "u" || arg == "v" || arg == "n");
+                step.axis = ok ? arg[0] : 'n';
+                if(ok && ss >> repeat) {
+                    ok = repeat.size() > 1 && repeat[0] == 'x' && parseFrames(repeat.substr(1), step.frames);
+                }
+            } else if(op == "hold") {
+                ok = (bool)(ss >> arg) && parseFrames(arg, step.frames);
+            } else {
+                ok = false;
+            }
+            if(!ok || ss >> arg) {
+                cout << "Error: " << path << ":" << number << ": can not read \"" << line << "\"" << endl;
+                return false;
+            }
+            steps.push_back(step);
+        }
+        return true;
+    }
+
+    // Write the steps in the format load reads, after comment as a # line
+    bool save(const string &path, const string &comment = "") const {
+        ofstream file(path);
+        if(!comment.empty()) {
+            file << "# " << comment << endl;
+        }
+        for(const CameraStep &step : steps) {
+            switch(step.kind) {
+                case CameraStep::ResetFront:
+                    file << "reset front" << endl;
+                    break;
+                case CameraStep::ResetTop:
+                    file << "reset top" << endl;
+                    break;
+                case CameraStep::Move:
+                case CameraStep::Rotate:
+                    file << (step.kind == CameraStep::Move ? "move " : "rotate ") << step.axis << " " << step.amount;
+                    if(step.frames > 1) {
+                        file << " x" << step.frames;
+                    }
+                    file << endl;
+                    break;
+                case CameraStep::Hold:
+                    file << "hold " << step.frames << endl;
+                    break;
+            }
+        }
+        if(!file) {
+            cout << "Error: could not write " << path << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Add an operation of the camera, the same one as the step before
+    // repeats it on the next frame
+    void record(CameraStep::Kind kind, char axis = 'n', float amount = 0.0f) {
+        moved = true;
+        if(!steps.empty()) {
+            CameraStep &last = steps.back();
+            if((kind == CameraStep::Move || kind == CameraStep::Rotate) && last.kind == kind &&
+               last.axis == axis && last.amount == amount) {
+                last.frames++;
+                return;
+            }
+        }
+        steps.push_back({ kind, axis, amount, 1 });
+    }
+
+    // Called once a frame while recording, frames without an operation
+    // become holds. Operations of the same frame replay on frames of their own
+    void endFrame() {
+        if(!moved) {
+            if(!steps.empty() && steps.back().kind == CameraStep::Hold) {
+                steps.back().frames++;
+            } else {
+                steps.push_back({ CameraStep::Hold, 'n', 0.0f, 1 });
+            }
+        }
+        moved = false;
+    }
+
+    // Frames the path draws
+    size_t frameCount() const {
+        size_t frames = 0;
+        for(const CameraStep &step : steps) {
+            frames += step.frames;
+        }
+        return frames;
+    }
+
+    // Apply one frame of step, the same calls the viewer's buttons make
+    static void apply(const CameraStep &step, Camera &camera) {
+        switch(step.kind) {
+            case CameraStep::ResetFront:
+                camera.resetCameraFront();
+                break;
+            case CameraStep::ResetTop:
+                camera.resetCameraTop();
+                break;
+            case CameraStep::Move:
+                if(step.axis == 'u') {
+                    camera.moveU(step.amount);
+                } else if(step.axis == 'v') {
+                    camera.moveV(step.amount);
+                } else {
+                    camera.moveN(step.amount);
+                }
+                break;
+            case CameraStep::Rotate:
+                if(step.axis == 'u') {
+                    camera.rotateU(step.amount);
+                } else if(step.axis == 'v') {
+                    camera.rotateV(step.amount);
+                } else {
+                    camera.rotateN(step.amount);
+                }
+                break;
+            case CameraStep::Hold:
+                break;
+        }
+    }
+
+private:
+    static bool parseFrames(const string &text, int &frames) {
+        stringstream ss(text);
+        char rest;
+        return (bool)(ss >> frames) && frames > 0 && !(ss >> rest);
+    }
+};
+
+#endif
@@ -0,0 +1,278 @@
+#ifndef CLASSIFY_H
+#define CLASSIFY_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MC_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/**
+ * Cube index classification kernels. A plane of the grid is first turned into
+ * a byte mask (0xff where the value is below the level), then the cube
+ * indices of a row of cells are combined from the masks of the 4 grid rows
+ * around it, and the cells that are neither fully inside nor fully outside
+ * are written to a compact list. The kernel is picked at runtime from the
+ * CPU, MC_SIMD=scalar|sse4|avx2 overrides it. Voxel rows of integer volumes
+ * are compared against a threshold in their own type, voxels below it are
+ * below the level
+ */
+
+// Corner bits in lookup table order: 0,1 on row (y, z), 3,2 on (y+1, z),
+// 4,5 on (y, z+1) and 7,6 on (y+1, z+1)
+inline uint8_t cubeBits(const uint8_t *m00, const uint8_t *m10, const uint8_t *m01, const uint8_t *m11, size_t x) {
+    return (m00[x] & 1) | (m00[x+1] & 2) | (m10[x+1] & 4) | (m10[x] & 8) |
+        (m01[x] & 16) | (m01[x+1] & 32) | (m11[x+1] & 64) | (m11[x] & 128);
+}
+
+inline void belowMaskScalar(const float *values, size_t n, float level, uint8_t *mask) {
+    for(size_t i = 0; i < n; i++) {
+        mask[i] = values[i] < level ? 0xff : 0;
+    }
+}
+
+template <typename T>
+inline void belowThresholdScalar(const T *values, size_t n, int threshold, uint8_t *mask) {
+    for(size_t i = 0; i < n; i++) {
+        mask[i] = values[i] < threshold ? 0xff : 0;
+    }
+}
+
+inline void belowMaskU8Scalar(const uint8_t *values, size_t n, int threshold, uint8_t *mask) {
+    belowThresholdScalar(values, n, threshold, mask);
+}
+
+inline void belowMaskU16Scalar(const uint16_t *values, size_t n, int threshold, uint8_t *mask) {
+    belowThresholdScalar(values, n, threshold, mask);
+}
+
+inline void belowMaskI16Scalar(const int16_t *values, size_t n, int threshold, uint8_t *mask) {
+    belowThresholdScalar(values, n, threshold, mask);
+}
+
+// Cells from x onwards one at a time, also the tail of the vector kernels
+inline size_t cubeRowTail(const uint8_t *m00, const uint8_t *m10, const uint8_t *m01, const uint8_t *m11,
+        size_t x, size_t cells, uint8_t *cube, uint32_t *active) {
+    size_t count = 0;
+    for(; x < cells; x++) {
+        cube[x] = cubeBits(m00, m10, m01, m11, x);
+        if(cube[x] != 0 && cube[x] != 0xff) {
+            active[count++] = x;
+        }
+    }
+    return count;
+}
+
+inline size_t cubeRowScalar(const uint8_t *m00, const uint8_t *m10, const uint8_t *m01, const uint8_t *m11,
+        size_t cells, uint8_t *cube, uint32_t *active) {
+    return cubeRowTail(m00, m10, m01, m11, 0, cells, cube, active);
+}
+
+#ifdef MC_X86_SIMD
+__attribute__((target("sse4.1")))
+inline void belowMaskSSE4(const float *values, size_t n, float level, uint8_t *mask) {
+    __m128 l = _mm_set1_ps(level);
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m128i a = _mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(values + i), l));
+        __m128i b = _mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(values + i + 4), l));
+        __m128i c = _mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(values + i + 8), l));
+        __m128i d = _mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(values + i + 12), l));
+        __m128i bytes = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        _mm_storeu_si128((__m128i*)(mask + i), bytes);
+    }
+    belowMaskScalar(values + i, n - i, level, mask + i);
+}
+
+// Unsigned v < t is min(v, t - 1) == v, thresholds outside the range of the
+// type are all or nothing and done by the scalar loop
+__attribute__((target("sse4.1")))
+inline void belowMaskU8SSE4(const uint8_t *values, size_t n, int threshold, uint8_t *mask) {
+    size_t i = 0;
+    if(threshold >= 1 && threshold <= 255) {
+        __m128i t = _mm_set1_epi8((char)(threshold - 1));
+        for(; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(values + i));
+            _mm_storeu_si128((__m128i*)(mask + i), _mm_cmpeq_epi8(_mm_min_epu8(v, t), v));
+        }
+    }
+    belowMaskU8Scalar(values + i, n - i, threshold, mask + i);
+}
+
+__attribute__((target("sse4.1")))
+inline void belowMaskU16SSE4(const uint16_t *values, size_t n, int threshold, uint8_t *mask) {
+    size_t i = 0;
+    if(threshold >= 1 && threshold <= 65535) {
+        __m128i t = _mm_set1_epi16((short)(threshold - 1));
+        for(; i + 16 <= n; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(values + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(values + i + 8));
+            a = _mm_cmpeq_epi16(_mm_min_epu16(a, t), a);
+            b = _mm_cmpeq_epi16(_mm_min_epu16(b, t), b);
+            _mm_storeu_si128((__m128i*)(mask + i), _mm_packs_epi16(a, b));
+        }
+    }
+    belowMaskU16Scalar(values + i, n - i, threshold, mask + i);
+}
+
+__attribute__((target("sse4.1")))
+inline void belowMaskI16SSE4(const int16_t *values, size_t n, int threshold, uint8_t *mask) {
+    size_t i = 0;
+    if(threshold >= -32767 && threshold <= 32767) {
+        __m128i t = _mm_set1_epi16((short)threshold);
+        for(; i + 16 <= n; i += 16) {
+            __m128i a = _mm_cmplt_epi16(_mm_loadu_si128((const __m128i*)(values + i)), t);
+            __m128i b = _mm_cmplt_epi16(_mm_loadu_si128((const __m128i*)(values + i + 8)), t);
+            _mm_storeu_si128((__m128i*)(mask + i), _mm_packs_epi16(a, b));
+        }
+    }
+    belowMaskI16Scalar(values + i, n - i, threshold, mask + i);
+}
+
+__attribute__((target("sse4.1")))
+inline size_t cubeRowSSE4(const uint8_t *m00, const uint8_t *m10, const uint8_t *m01, const uint8_t *m11,
+        size_t cells, uint8_t *cube, uint32_t *active) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi8(-1);
+    size_t count = 0, x = 0;
+    for(; x + 16 <= cells; x += 16) {
+#define MC_BITS(row, offset, bit) _mm_and_si128(_mm_loadu_si128((const __m128i*)(row + x + offset)), _mm_set1_epi8((char)bit))
+        __m128i c = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(MC_BITS(m00, 0, 1), MC_BITS(m00, 1, 2)), _mm_or_si128(MC_BITS(m10, 1, 4), MC_BITS(m10, 0, 8))),
+            _mm_or_si128(_mm_or_si128(MC_BITS(m01, 0, 16), MC_BITS(m01, 1, 32)), _mm_or_si128(MC_BITS(m11, 1, 64), MC_BITS(m11, 0, 128))));
+#undef MC_BITS
+        _mm_storeu_si128((__m128i*)(cube + x), c);
+        if(_mm_testz_si128(c, c) || _mm_test_all_ones(c)) {
+            continue;
+        }
+        unsigned empty = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(c, zero), _mm_cmpeq_epi8(c, full)));
+        for(unsigned bits = ~empty & 0xffff; bits; bits &= bits - 1) {
+            active[count++] = x + __builtin_ctz(bits);
+        }
+    }
+    return count + cubeRowTail(m00, m10, m01, m11, x, cells, cube, active + count);
+}
+
+__attribute__((target("avx2")))
+inline void belowMaskAVX2(const float *values, size_t n, float level, uint8_t *mask) {
+    __m256 l = _mm256_set1_ps(level);
+    // packs works per 128 bit lane, this puts the dwords back in order
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+    for(; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(values + i), l, _CMP_LT_OQ));
+        __m256i b = _mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(values + i + 8), l, _CMP_LT_OQ));
+        __m256i c = _mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(values + i + 16), l, _CMP_LT_OQ));
+        __m256i d = _mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(values + i + 24), l, _CMP_LT_OQ));
+        __m256i bytes = _mm256_packs_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+        _mm256_storeu_si256((__m256i*)(mask + i), _mm256_permutevar8x32_epi32(bytes, order));
+    }
+    belowMaskScalar(values + i, n - i, level, mask + i);
+}
+
+__attribute__((target("avx2")))
+inline void belowMaskU8AVX2(const uint8_t *values, size_t n, int threshold, uint8_t *mask) {
+    size_t i = 0;
+    if(threshold >= 1 && threshold <= 255) {
+        __m256i t = _mm256_set1_epi8((char)(threshold - 1));
+        for(; i + 32 <= n; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(values + i));
+            _mm256_storeu_si256((__m256i*)(mask + i), _mm256_cmpeq_epi8(_mm256_min_epu8(v, t), v));
+        }
+    }
+    belowMaskU8Scalar(values + i, n - i, threshold, mask + i);
+}
+
+__attribute__((target("avx2")))
+inline void belowMaskU16AVX2(const uint16_t *values, size_t n, int threshold, uint8_t *mask) {
+    size_t i = 0;
+    if(threshold >= 1 && threshold <= 65535) {
+        __m256i t = _mm256_set1_epi16((short)(threshold - 1));
+        for(; i + 32 <= n; i += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(values + i));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(values + i + 16));
+            a = _mm256_cmpeq_epi16(_mm256_min_epu16(a, t), a);
+            b = _mm256_cmpeq_epi16(_mm256_min_epu16(b, t), b);
+            // packs works per 128 bit lane
+            _mm256_storeu_si256((__m256i*)(mask + i), _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xd8));
+        }
+    }
+    belowMaskU16Scalar(values + i, n - i, threshold, mask + i);
+}
+
+__attribute__((target("avx2")))
+inline void belowMaskI16AVX2(const int16_t *values, size_t n, int threshold, uint8_t *mask) {
+    size_t i = 0;
+    if(threshold >= -32767 && threshold <= 32767) {
+        __m256i t = _mm256_set1_epi16((short)threshold);
+        for(; i + 32 <= n; i += 32) {
+            __m256i a = _mm256_cmpgt_epi16(t, _mm256_loadu_si256((const __m256i*)(values + i)));
+            __m256i b = _mm256_cmpgt_epi16(t, _mm256_loadu_si256((const __m256i*)(values + i + 16)));
+            _mm256_storeu_si256((__m256i*)(mask + i), _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xd8));
+        }
+    }
+    belowMaskI16Scalar(values + i, n - i, threshold, mask + i);
+}
+
+__attribute__((target("avx2")))
+inline size_t cubeRowAVX2(const uint8_t *m00, const uint8_t *m10, const uint8_t *m01, const uint8_t *m11,
+        size_t cells, uint8_t *cube, uint32_t *active) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i full = _mm256_set1_epi8(-1);
+    size_t count = 0, x = 0;
+    for(; x + 32 <= cells; x += 32) {
+#define MC_BITS(row, offset, bit) _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(row + x + offset)), _mm256_set1_epi8((char)bit))
+        __m256i c = _mm256_or_si256(
+            _mm256_or_si256(_mm256_or_si256(MC_BITS(m00, 0, 1), MC_BITS(m00, 1, 2)), _mm256_or_si256(MC_BITS(m10, 1, 4), MC_BITS(m10, 0, 8))),
+            _mm256_or_si256(_mm256_or_si256(MC_BITS(m01, 0, 16), MC_BITS(m01, 1, 32)), _mm256_or_si256(MC_BITS(m11, 1, 64), MC_BITS(m11, 0, 128))));
+#undef MC_BITS
+        _mm256_storeu_si256((__m256i*)(cube + x), c);
+        unsigned empty = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(c, zero), _mm256_cmpeq_epi8(c, full)));
+        for(unsigned bits = ~empty; bits; bits &= bits - 1) {
+            active[count++] = x + __builtin_ctz(bits);
+        }
+    }
+    return count + cubeRowTail(m00, m10, m01, m11, x, cells, cube, active + count);
+}
+#endif
+
+struct Classifier {
+    const char *name;
+    // Compare n values against level, 0xff where below
+    void (*belowMask)(const float *values, size_t n, float level, uint8_t *mask);
+    // Cube indices of a row of cells from the masks of the grid rows at
+    // (y, z), (y+1, z), (y, z+1) and (y+1, z+1), which hold cells + 1 points.
+    // Returns how many active cells were written to active
+    size_t (*cubeRow)(const uint8_t *m00, const uint8_t *m10, const uint8_t *m01, const uint8_t *m11,
+        size_t cells, uint8_t *cube, uint32_t *active);
+    // Compare n voxels against threshold, 0xff where below
+    void (*belowMaskU8)(const uint8_t *values, size_t n, int threshold, uint8_t *mask);
+    void (*belowMaskU16)(const uint16_t *values, size_t n, int threshold, uint8_t *mask);
+    void (*belowMaskI16)(const int16_t *values, size_t n, int threshold, uint8_t *mask);
+};
+
+inline Classifier selectClassifier() {
+    const char *force = getenv("MC_SIMD");
+#ifdef MC_X86_SIMD
+    __builtin_cpu_init();
+    if((!force || !strcmp(force, "avx2")) && __builtin_cpu_supports("avx2")) {
+        return { "avx2", belowMaskAVX2, cubeRowAVX2, belowMaskU8AVX2, belowMaskU16AVX2, belowMaskI16AVX2 };
+    }
+    if((!force || !strcmp(force, "avx2") || !strcmp(force, "sse4")) && __builtin_cpu_supports("sse4.1")) {
+        return { "sse4", belowMaskSSE4, cubeRowSSE4, belowMaskU8SSE4, belowMaskU16SSE4, belowMaskI16SSE4 };
+    }
+#endif
+    (void)force;
+    return { "scalar", belowMaskScalar, cubeRowScalar, belowMaskU8Scalar, belowMaskU16Scalar, belowMaskI16Scalar };
+}
+
+// The kernel for this CPU, chosen on first use
+inline const Classifier &classifier() {
+    static const Classifier chosen = selectClassifier();
+    return chosen;
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef CLI_H
+#define CLI_H
+
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+
+/**
+ * Small helpers shared by the command line tools
+ */
+
+// Split a comma separated list into values
+template <typename T>
+std::vector<T> parseList(const std::string &arg) {
+    std::vector<T> values;
+    std::stringstream ss(arg);
+    std::string item;
+    while(std::getline(ss, item, ',')) {
+        std::stringstream is(item);
+        T value;
+        if(is >> value) {
+            values.push_back(value);
+        }
+    }
+    return values;
+}
+
+// Split a comma separated list of counts such as cuts, false when an item is
+// not a whole number in [0, highest]
+inline bool parseCounts(const std::string &arg, std::vector<size_t> &values, long long highest = 0x7fffffffLL) {
+    values.clear();
+    std::stringstream ss(arg);
+    std::string item;
+    while(std::getline(ss, item, ',')) {
+        std::stringstream is(item);
+        long long value;
+        if(!(is >> value) || !(is >> std::ws).eof() || value < 0 || value > highest) {
+            return false;
+        }
+        values.push_back((size_t)value);
+    }
+    return true;
+}
+
+inline double millisecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+#endif
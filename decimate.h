@@ -0,0 +1,382 @@
+#ifndef DECIMATE_H
+#define DECIMATE_H
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+
+#include <glm/glm.hpp>
+
+#include "marchingcubes.h"
+
+using namespace std;
+
+/**
+ * Quadric error edge collapse (Garland and Heckbert). Every vertex carries
+ * the sum of the squared distances to the planes of the triangles around it,
+ * weighted by their area, and the edges whose collapse adds the least of it
+ * are collapsed first, into the point that minimizes it. Collapses that would
+ * flip a triangle or pinch the surface into a non manifold are skipped, so
+ * the closed surfaces marching cubes produces stay closed. Normals of the
+ * result are recomputed from its triangles
+ */
+class Decimator {
+    // Symmetric 4x4 matrix of a plane sum: aa ab ac ad bb bc bd cc cd dd,
+    // with the total area the planes were weighted by
+    struct Quadric {
+        double q[10] = {};
+        double area = 0.0;
+
+        void addPlane(const glm::dvec3 &n, double d, double weight) {
+            q[0] += weight * n.x * n.x; q[1] += weight * n.x * n.y; q[2] += weight * n.x * n.z; q[3] += weight * n.x * d;
+            q[4] += weight * n.y * n.y; q[5] += weight * n.y * n.z; q[6] += weight * n.y * d;
+            q[7] += weight * n.z * n.z; q[8] += weight * n.z * d;
+            q[9] += weight * d * d;
+            area += weight;
+        }
+
+        void add(const Quadric &other) {
+            for(int i = 0; i < 10; i++) {
+                q[i] += other.q[i];
+            }
+            area += other.area;
+        }
+
+        double error(const glm::dvec3 &v) const {
+            return q[0]*v.x*v.x + 2*q[1]*v.x*v.y + 2*q[2]*v.x*v.z + 2*q[3]*v.x
+                 + q[4]*v.y*v.y + 2*q[5]*v.y*v.z + 2*q[6]*v.y
+                 + q[7]*v.z*v.z + 2*q[8]*v.z + q[9];
+        }
+
+        // Point of least error, false when the planes do not pin one down
+        bool minimum(glm::dvec3 &v) const {
+            double a = q[0], b = q[1], c = q[2], e = q[4], f = q[5], i = q[7];
+            double det = a * (e * i - f * f) - b * (b * i - f * c) + c * (b * f - e * c);
+            double scale = a * e * i;
+            if(!(fabs(det) > 1e-10 * max(scale, 1e-30))) {
+                return false;
+            }
+            glm::dvec3 r(-q[3], -q[6], -q[8]);
+            v.x = (r.x * (e * i - f * f) - b * (r.y * i - f * r.z) + c * (r.y * f - e * r.z)) / det;
+            v.y = (a * (r.y * i - f * r.z) - r.x * (b * i - f * c) + c * (b * r.z - r.y * c)) / det;
+            v.z = (a * (e * r.z - r.y * f) - b * (b * r.z - r.y * c) + r.x * (b * f - e * c)) / det;
+            return true;
+        }
+    };
+
+    struct Collapse {
+        double cost;
+        uint32_t a, b;
+
+        // Cheapest first, ties in a fixed order so results never vary
+        bool operator<(const Collapse &other) const {
+            if(cost != other.cost) return cost < other.cost;
+            if(a != other.a) return a < other.a;
+            return b < other.b;
+        }
+    };
+
+    vector<glm::dvec3> positions;
+    vector<Quadric> quadrics;
+    vector<uint32_t> triangles;
+    vector<uint8_t> deadTriangle;
+    // Triangles around every vertex as of the start of the pass,
+    // aroundFirst[v] to aroundFirst[v + 1] in around
+    vector<uint32_t> aroundFirst, around;
+    // Vertices already moved by a collapse in this pass
+    vector<uint8_t> locked;
+    vector<Collapse> candidates;
+    size_t liveTriangles = 0;
+    // Scratch for the vertices around an edge
+    vector<uint32_t> ringA, ringB;
+
+public:
+    // Collapse edges of the mesh until it has at most targetTriangles, or the
+    // next collapse would move the surface by more than maxError on average
+    // over the area around it. False when cancel was set, out is then empty
+    bool run(const glm::vec3 *inPositions, size_t vertexCount, const uint32_t *indices, size_t indexCount,
+             size_t targetTriangles, float maxError, IndexedMesh &out, const atomic<bool> *cancel = nullptr) {
+        out.clear();
+        setUp(inPositions, vertexCount, indices, indexCount);
+        double maxCost = (double)maxError * maxError;
+        // Every pass sorts the edges by cost once and collapses the cheapest
+        // ones that do not touch a vertex moved earlier in the pass, so the
+        // costs it goes by stay exact without a queue of stale entries
+        while(liveTriangles > targetTriangles) {
+            if(cancel && cancel->load(memory_order_relaxed)) {
+                release();
+                return false;
+            }
+            // A collapse removes two triangles
+            size_t needed = (liveTriangles - targetTriangles + 1) / 2;
+            findCandidates(needed * 4);
+            locked.assign(positions.size(), 0);
+            size_t collapsed = 0;
+            for(const Collapse &c : candidates) {
+                if(c.cost > maxCost || collapsed == needed) break;
+                if(locked[c.a] || locked[c.b]) continue;
+                glm::dvec3 target;
+                collapseCost(c.a, c.b, target);
+                if(!canCollapse(c.a, c.b, target)) continue;
+                collapse(c.a, c.b, target);
+                locked[c.a] = locked[c.b] = 1;
+                collapsed++;
+            }
+            if(collapsed == 0) {
+                break;
+            }
+        }
+        write(out);
+        release();
+        return true;
+    }
+
+private:
+    void setUp(const glm::vec3 *inPositions, size_t vertexCount, const uint32_t *indices, size_t indexCount) {
+        positions.resize(vertexCount);
+        for(size_t i = 0; i < vertexCount; i++) {
+            positions[i] = glm::dvec3(inPositions[i]);
+        }
+        triangles.assign(indices, indices + indexCount - indexCount % 3);
+        size_t triangleCount = triangles.size() / 3;
+        deadTriangle.assign(triangleCount, 0);
+        liveTriangles = triangleCount;
+        quadrics.assign(vertexCount, Quadric());
+        for(size_t t = 0; t < triangleCount; t++) {
+            const uint32_t *v = &triangles[t * 3];
+            glm::dvec3 n = glm::cross(positions[v[1]] - positions[v[0]], positions[v[2]] - positions[v[0]]);
+            double length = glm::length(n);
+            if(length > 0.0) {
+                n /= length;
+                for(int j = 0; j < 3; j++) {
+                    quadrics[v[j]].addPlane(n, -glm::dot(n, positions[v[0]]), length * 0.5);
+                }
+            }
+        }
+    }
+
+    void release() {
+        vector<glm::dvec3>().swap(positions);
+        vector<Quadric>().swap(quadrics);
+        vector<uint32_t>().swap(triangles);
+        vector<uint8_t>().swap(deadTriangle);
+        vector<uint32_t>().swap(aroundFirst);
+        vector<uint32_t>().swap(around);
+        vector<uint8_t>().swap(locked);
+        vector<Collapse>().swap(candidates);
+    }
+
+    // Rebuild the triangle lists of the vertices and keep the limit cheapest
+    // edges, sorted. Each edge is taken from the triangle that has it with
+    // the lower vertex first; on a closed surface every edge has one, open
+    // boundaries are left alone
+    void findCandidates(size_t limit) {
+        size_t vertexCount = positions.size();
+        aroundFirst.assign(vertexCount + 1, 0);
+        for(size_t t = 0; t < deadTriangle.size(); t++) {
+            if(deadTriangle[t]) continue;
+            for(int j = 0; j < 3; j++) {
+                aroundFirst[triangles[t * 3 + j] + 1]++;
+            }
+        }
+        for(size_t v = 0; v < vertexCount; v++) {
+            aroundFirst[v + 1] += aroundFirst[v];
+        }
+        around.resize(aroundFirst[vertexCount]);
+        vector<uint32_t> next(aroundFirst.begin(), aroundFirst.end() - 1);
+        candidates.clear();
+        for(size_t t = 0; t < deadTriangle.size(); t++) {
+            if(deadTriangle[t]) continue;
+            for(int j = 0; j < 3; j++) {
+                uint32_t a = triangles[t * 3 + j], b = triangles[t * 3 + (j + 1) % 3];
+                around[next[a]++] = (uint32_t)t;
+                if(a < b) {
+                    glm::dvec3 target;
+                    Collapse c = { collapseCost(a, b, target), a, b };
+                    candidates.push_back(c);
+                }
+            }
+        }
+        if(candidates.size() > limit) {
+            nth_element(candidates.begin(), candidates.begin() + limit, candidates.end());
+            candidates.resize(limit);
+        }
+        sort(candidates.begin(), candidates.end());
+    }
+
+    // Error of collapsing a and b into target, as a squared distance
+    double collapseCost(uint32_t a, uint32_t b, glm::dvec3 &target) const {
+        Quadric q = quadrics[a];
+        q.add(quadrics[b]);
+        double area = max(q.area, 1e-30);
+        if(q.minimum(target)) {
+            return max(q.error(target), 0.0) / area;
+        }
+        // Flat or straight around the edge: the best of its ends and middle
+        glm::dvec3 candidates[3] = { positions[a], positions[b], (positions[a] + positions[b]) * 0.5 };
+        double best = numeric_limits<double>::infinity();
+        for(const glm::dvec3 &candidate : candidates) {
+            double error = q.error(candidate);
+            if(error < best) {
+                best = error;
+                target = candidate;
+            }
+        }
+        return max(best, 0.0) / area;
+    }
+
+    // Vertices sharing a live triangle with v
+    void ring(uint32_t v, vector<uint32_t> &out) const {
+        out.clear();
+        for(uint32_t i = aroundFirst[v]; i < aroundFirst[v + 1]; i++) {
+            uint32_t t = around[i];
+            if(deadTriangle[t]) continue;
+            for(int j = 0; j < 3; j++) {
+                uint32_t w = triangles[t * 3 + j];
+                if(w != v) out.push_back(w);
+            }
+        }
+        sort(out.begin(), out.end());
+        out.erase(unique(out.begin(), out.end()), out.end());
+    }
+
+    bool canCollapse(uint32_t a, uint32_t b, const glm::dvec3 &target) {
+        // Two triangles share the edge of a manifold, any other vertex both
+        // ends see would pinch the surface together
+        ring(a, ringA);
+        ring(b, ringB);
+        size_t common = 0;
+        for(size_t i = 0, j = 0; i < ringA.size() && j < ringB.size();) {
+            if(ringA[i] < ringB[j]) {
+                i++;
+            } else if(ringB[j] < ringA[i]) {
+                j++;
+            } else {
+                common++;
+                i++;
+                j++;
+            }
+        }
+        size_t shared = 0;
+        for(uint32_t i = aroundFirst[a]; i < aroundFirst[a + 1]; i++) {
+            if(!deadTriangle[around[i]] && hasVertex(around[i], b)) shared++;
+        }
+        if(common != shared || shared == 0) {
+            return false;
+        }
+        // The triangles that stay must not flip or fold onto a line
+        for(uint32_t v : { a, b }) {
+            for(uint32_t i = aroundFirst[v]; i < aroundFirst[v + 1]; i++) {
+                uint32_t t = around[i];
+                if(deadTriangle[t] || hasVertex(t, v == a ? b : a)) continue;
+                glm::dvec3 p[3], q[3];
+                for(int j = 0; j < 3; j++) {
+                    uint32_t w = triangles[t * 3 + j];
+                    p[j] = positions[w];
+                    q[j] = w == v ? target : p[j];
+                }
+                glm::dvec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+                glm::dvec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+                double lengthBefore = glm::length(before), lengthAfter = glm::length(after);
+                if(lengthAfter <= 0.0 || glm::dot(before, after) < 0.2 * lengthBefore * lengthAfter) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool hasVertex(uint32_t t, uint32_t v) const {
+        return triangles[t * 3] == v || triangles[t * 3 + 1] == v || triangles[t * 3 + 2] == v;
+    }
+
+    // Move a to target and hand it every triangle of b. The triangle list
+    // of a goes stale, a is locked for the rest of the pass
+    void collapse(uint32_t a, uint32_t b, const glm::dvec3 &target) {
+        positions[a] = target;
+        quadrics[a].add(quadrics[b]);
+        for(uint32_t i = aroundFirst[b]; i < aroundFirst[b + 1]; i++) {
+            uint32_t t = around[i];
+            if(deadTriangle[t]) continue;
+            if(hasVertex(t, a)) {
+                deadTriangle[t] = 1;
+                liveTriangles--;
+                continue;
+            }
+            for(int j = 0; j < 3; j++) {
+                if(triangles[t * 3 + j] == b) triangles[t * 3 + j] = a;
+            }
+        }
+    }
+
+    // Live vertices and triangles, normals from the area weighted triangles
+    void write(IndexedMesh &out) {
+        vector<uint32_t> remap(positions.size(), NO_VERTEX);
+        for(size_t t = 0; t < deadTriangle.size(); t++) {
+            if(deadTriangle[t]) continue;
+            for(int j = 0; j < 3; j++) {
+                uint32_t &id = remap[triangles[t * 3 + j]];
+                if(id == NO_VERTEX) {
+                    id = (uint32_t)out.positions.size();
+                    out.positions.push_back(glm::vec3(positions[triangles[t * 3 + j]]));
+                }
+                out.indices.push_back(id);
+            }
+        }
+        out.normals.assign(out.positions.size(), glm::vec3(0.0f));
+        for(size_t i = 0; i + 3 <= out.indices.size(); i += 3) {
+            const uint32_t *v = &out.indices[i];
+            glm::vec3 n = glm::cross(out.positions[v[1]] - out.positions[v[0]], out.positions[v[2]] - out.positions[v[0]]);
+            for(int j = 0; j < 3; j++) {
+                out.normals[v[j]] += n;
+            }
+        }
+        for(glm::vec3 &n : out.normals) {
+            float length = glm::length(n);
+            if(length > 0.0f) {
+                n /= length;
+            }
+        }
+    }
+};
+
+// Simplify a mesh to at most targetTriangles, see Decimator::run
+inline bool decimate(const glm::vec3 *positions, size_t vertexCount, const uint32_t *indices, size_t indexCount,
+                     size_t targetTriangles, float maxError, IndexedMesh &out, const atomic<bool> *cancel = nullptr) {
+    Decimator decimator;
+    return decimator.run(positions, vertexCount, indices, indexCount, targetTriangles, maxError, out, cancel);
+}
+
+// Chain of levels of detail, each with a quarter of the triangles of the one
+// before (half the resolution along each side), starting from a quarter of
+// the mesh. Stops after levels or once a level would have fewer than
+// minTriangles
+inline bool buildLods(const glm::vec3 *positions, size_t vertexCount, const uint32_t *indices, size_t indexCount,
+                      size_t levels, size_t minTriangles, vector<IndexedMesh> &lods, const atomic<bool> *cancel = nullptr) {
+    lods.clear();
+    size_t triangles = indexCount / 3;
+    while(lods.size() < levels && triangles / 4 >= minTriangles) {
+        IndexedMesh lod;
+        const float infinite = numeric_limits<float>::infinity();
+        bool done = lods.empty() ?
+            decimate(positions, vertexCount, indices, indexCount, triangles / 4, infinite, lod, cancel) :
+            decimate(lods.back().positions.data(), lods.back().positions.size(), lods.back().indices.data(),
+                     lods.back().indices.size(), triangles / 4, infinite, lod, cancel);
+        if(!done) {
+            lods.clear();
+            return false;
+        }
+        // A mesh that can not lose more triangles ends the chain
+        if(lod.triangleCount() >= triangles) {
+            break;
+        }
+        triangles = lod.triangleCount();
+        lods.push_back(move(lod));
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef EXTRACTOR_H
+#define EXTRACTOR_H
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <map>
+#include <memory>
+
+#include "marchingcubes.h"
+#include "meshcache.h"
+#include "decimate.h"
+#include "profiler.h"
+
+using namespace std;
+
+/**
+ * Runs loadVolume, setCuts and constructIndexed on a worker thread so the
+ * render loop never waits for them. Only the newest request is kept, and one
+ * that arrives while an older one is being extracted cancels it, unless
+ * setFinishLevels lets extractions at another level finish first. Finished
+ * meshes are built in a back buffer, sorted into chunks of CHUNK_CELLS^3
+ * cells for culling and handed over through take(). With a
+ * mesh cache, configurations extracted before are mapped from it instead.
+ * Levels of detail of large meshes are decimated after the mesh is handed
+ * over and follow through takeLods()
+ */
+class Extractor {
+public:
+    struct Request {
+        // A volume header or Name_X_Y_Z.raw file, see readVolumeInfo
+        string path;
+        size_t cuts;
+        float level;
+        NormalSource normals;
+
+        bool operator==(const Request &other) const {
+            return path == other.path && cuts == other.cuts && level == other.level && normals == other.normals;
+        }
+
+        bool operator!=(const Request &other) const {
+            return !(*this == other);
+        }
+    };
+
+private:
+    MarchingCubes mc;
+    thread worker;
+    mutable mutex lock;
+    condition_variable wake;
+    // The newest request and the one being extracted
+    Request pending, current;
+    bool hasPending = false, running = false, stop = false;
+    atomic<bool> cancel;
+    // Requests for another level or normals let the running one finish
+    bool finishLevels = false;
+
+    // What mc holds, only touched by the worker. cuts is 0 while the grid is
+    // not complete
+    string loadedPath;
+    bool loaded = false;
+    size_t loadedCuts = 0;
+
+    IndexedMesh building, ready;
+    MappedMesh buildingMapped, readyMapped;
+    bool hasReady = false;
+    atomic<bool> loadFailed;
+
+    // Decimated levels of the last mesh handed over, see setLods
+    vector<IndexedMesh> buildingLods, readyLods;
+    bool hasLods = false, decimating = false;
+    size_t lodLevels = 0, lodMinTriangles = 0;
+
+    unique_ptr<MeshCache> cache;
+    // Times the stages of every extraction when set, see setProfiler
+    Profiler *profiler = nullptr;
+    // Hash of every volume loaded so far with the stamp of its files then, so
+    // a volume that did not change is found in the cache without loading it
+    map<string, pair<string, uint64_t>> hashes;
+
+public:
+    // Keep up to cacheBytes of meshes in cacheDir, no cache when it is empty
+    explicit Extractor(size_t threads, const string &cacheDir = "", size_t cacheBytes = 0) : cancel(false), loadFailed(false) {
+        if(!cacheDir.empty()) {
+            cache.reset(new MeshCache(cacheDir, cacheBytes));
+        }
+        mc.setThreads(threads);
+        // Dragging the level slider only revisits the cells that change
+        mc.setIntervalIndex(true);
+        mc.setCancelFlag(&cancel);
+        worker = thread([this]() { work(); });
+    }
+
+    ~Extractor() {
+        {
+            unique_lock<mutex> guard(lock);
+            stop = true;
+            cancel = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    // Decimate up to levels levels of detail of every mesh, each with a
+    // quarter of the triangles of the one before and no fewer than
+    // minTriangles. 0 levels turns them off
+    void setLods(size_t levels, size_t minTriangles) {
+        unique_lock<mutex> guard(lock);
+        lodLevels = levels;
+        lodMinTriangles = minTriangles;
+    }
+
+    // Time loading, setCuts, constructIndexed, chunking, the cache and
+    // decimation as stages of profiler, on an "extractor" track. Call before
+    // the first request
+    void setProfiler(Profiler *p) {
+        unique_lock<mutex> guard(lock);
+        profiler = p;
+    }
+
+    // Let an extraction finish and hand its mesh over when a request for
+    // another level or normals of the same grid arrives, so dragging the
+    // level slider shows the meshes on the way. Off by default, the
+    // extraction of a level nobody wants any more is cancelled
+    void setFinishLevels(bool finish) {
+        unique_lock<mutex> guard(lock);
+        finishLevels = finish;
+    }
+
+    // Extract r next, dropping any request that has not finished yet
+    void request(const Request &r) {
+        {
+            unique_lock<mutex> guard(lock);
+            pending = r;
+            hasPending = true;
+            bool sameGrid = r.path == current.path && r.cuts == current.cuts;
+            if(decimating || (r != current && !(finishLevels && sameGrid))) {
+                cancel = true;
+            }
+        }
+        wake.notify_all();
+    }
+
+    // Swap the newest finished mesh into mesh, or into cached when it came
+    // from the mesh cache; the other one is left empty. False when there is none
+    bool take(IndexedMesh &mesh, MappedMesh &cached) {
+        unique_lock<mutex> guard(lock);
+        if(!hasReady) {
+            return false;
+        }
+        swap(mesh, ready);
+        swap(cached, readyMapped);
+        hasReady = false;
+        return true;
+    }
+
+    // Swap in the levels of detail of the mesh taken last once they are
+    // decimated, finest first. False until then
+    bool takeLods(vector<IndexedMesh> &lods) {
+        unique_lock<mutex> guard(lock);
+        if(!hasLods || hasReady) {
+            return false;
+        }
+        swap(lods, readyLods);
+        hasLods = false;
+        return true;
+    }
+
+    // Whether a request is still waiting or being extracted
+    bool busy() const {
+        unique_lock<mutex> guard(lock);
+        return hasPending || running;
+    }
+
+    // Whether the levels of detail of the last mesh are still being decimated
+    bool decimatingLods() const {
+        unique_lock<mutex> guard(lock);
+        return decimating;
+    }
+
+    // Whether the volume of the last request could not be read
+    bool failed() const {
+        return loadFailed;
+    }
+
+private:
+    void work() {
+        while(true) {
+            Request r;
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [this]() { return stop || hasPending; });
+                if(stop) {
+                    return;
+                }
+                r = pending;
+                current = r;
+                hasPending = false;
+                running = true;
+                cancel = false;
+            }
+            if(profiler) {
+                profiler->nameThread("extractor");
+            }
+
+            bool done = extract(r);
+
+            // The mesh is handed over before its levels of detail are
+            // decimated, from a copy of its positions and triangles
+            size_t levels, minTriangles;
+            {
+                unique_lock<mutex> guard(lock);
+                levels = lodLevels;
+                minTriangles = lodMinTriangles;
+            }
+            vector<glm::vec3> positions;
+            vector<uint32_t> indices;
+            if(done && levels > 0 && !hasNewer()) {
+                if(buildingMapped.valid()) {
+                    positions.assign(buildingMapped.vertexData(), buildingMapped.vertexData() + buildingMapped.vertexCount());
+                    indices.assign(buildingMapped.indexData(), buildingMapped.indexData() + buildingMapped.indexCount());
+                } else {
+                    positions = building.positions;
+                    indices = building.indices;
+                }
+            }
+            {
+                unique_lock<mutex> guard(lock);
+                running = false;
+                // A newer request that did not cancel this one comes next,
+                // the mesh is shown until it is done
+                if(!done || cancel) {
+                    continue;
+                }
+                swap(building, ready);
+                swap(buildingMapped, readyMapped);
+                hasReady = true;
+                hasLods = false;
+                // Levels of detail are only decimated for the newest mesh
+                if(hasPending) {
+                    continue;
+                }
+                decimating = levels > 0;
+            }
+
+            {
+                Profiler::Scope scope(levels > 0 ? profiler : nullptr, "decimate");
+                done = buildLods(positions.data(), positions.size(), indices.data(), indices.size(), levels, minTriangles,
+                                 buildingLods, &cancel);
+            }
+            unique_lock<mutex> guard(lock);
+            decimating = false;
+            if(done && !hasPending && !buildingLods.empty()) {
+                swap(buildingLods, readyLods);
+                hasLods = true;
+            }
+            buildingLods.clear();
+        }
+    }
+
+    bool hasNewer() const {
+        unique_lock<mutex> guard(lock);
+        return hasPending;
+    }
+
+    // Bring mc up to date with r, redoing only the steps whose inputs changed.
+    // Returns false when a newer request cancelled it
+    bool extract(const Request &r) {
+        buildingMapped.release();
+        if(findCached(r)) {
+            return true;
+        }
+        if(r.path != loadedPath) {
+            string stamp = volumeStamp(r.path);
+            loadedPath = r.path;
+            {
+                Profiler::Scope scope(profiler, "load");
+                loaded = mc.loadVolume(r.path);
+            }
+            loadFailed = !loaded;
+            loadedCuts = 0;
+            if(loaded && cache) {
+                hashes[r.path] = make_pair(stamp, mc.volumeHash());
+                if(findCached(r)) {
+                    return true;
+                }
+            }
+        }
+        if(!loaded || cancel) {
+            return false;
+        }
+        if(r.cuts != loadedCuts) {
+            loadedCuts = 0;
+            {
+                Profiler::Scope scope(profiler, "setCuts");
+                mc.setCuts(r.cuts);
+            }
+            if(cancel) {
+                return false;
+            }
+            loadedCuts = r.cuts;
+        }
+        mc.setNormalSource(r.normals);
+        {
+            Profiler::Scope scope(profiler, "construct");
+            mc.constructIndexed(r.level, building);
+        }
+        if(cancel) {
+            return false;
+        }
+        // Before caching, so meshes from the cache come in chunks too
+        {
+            Profiler::Scope scope(profiler, "chunk");
+            chunkMesh(building, mc.chunkSize());
+        }
+        if(cache) {
+            Profiler::Scope scope(profiler, "cache store");
+            cache->store(MeshCache::key(hashes[r.path].second, r.cuts, r.level, r.normals), building);
+        }
+        return true;
+    }
+
+    // Map the mesh of r from the cache when its volume was hashed before and
+    // has not changed since
+    bool findCached(const Request &r) {
+        if(!cache) {
+            return false;
+        }
+        Profiler::Scope scope(profiler, "cache lookup");
+        auto known = hashes.find(r.path);
+        if(known == hashes.end() || known->second.first != volumeStamp(r.path) ||
+           !cache->find(MeshCache::key(known->second.second, r.cuts, r.level, r.normals), buildingMapped)) {
+            return false;
+        }
+        building.clear();
+        loadFailed = false;
+        return true;
+    }
+
+    // Size and modification time of the files of the volume at path, empty
+    // when it can not be read
+    static string volumeStamp(const string &path) {
+        VolumeInfo info;
+        if(!readVolumeInfo(path, info, true)) {
+            return "";
+        }
+        return MeshCache::fileStamp(path) + " " + MeshCache::fileStamp(info.dataPath);
+    }
+};
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef GPUTIMERS_H
+#define GPUTIMERS_H
+
+#include <vector>
+
+// GLEW
+#include <GL/glew.h>
+
+#include "profiler.h"
+
+using namespace std;
+
+/**
+ * GPU time of stages of the render thread from GL_TIME_ELAPSED queries,
+ * added to a Profiler next to their CPU time. Results are collected a few
+ * frames later once the GPU has them, so timing never waits for it. Elapsed
+ * time queries can not nest, so a scope inside another times the CPU only
+ */
+class GpuTimers {
+    struct Pending {
+        GLuint query;
+        const char *stage;
+        double start;
+    };
+
+    Profiler &profiler;
+    vector<GLuint> unused;
+    vector<Pending> pending;
+    bool open = false;
+
+public:
+    // Times the CPU and the GPU commands issued from here to the end of the
+    // scope as stage
+    class Scope {
+        Profiler::Scope cpu;
+        GpuTimers *timers;
+
+    public:
+        Scope(GpuTimers &gpu, const char *stage) : cpu(&gpu.profiler, stage), timers(gpu.begin(stage) ? &gpu : nullptr) {
+        }
+
+        ~Scope() {
+            if(timers) {
+                timers->end();
+            }
+        }
+    };
+
+    explicit GpuTimers(Profiler &p) : profiler(p) {
+    }
+
+    ~GpuTimers() {
+        for(const Pending &p : pending) {
+            unused.push_back(p.query);
+        }
+        if(!unused.empty()) {
+            glDeleteQueries(unused.size(), unused.data());
+        }
+    }
+
+    // Hand the queries the GPU has finished to the profiler, once a frame
+    void collect() {
+        size_t done = 0;
+        for(; done < pending.size(); done++) {
+            if(open && done + 1 == pending.size()) {
+                break;
+            }
+            GLint available = 0;
+            glGetQueryObjectiv(pending[done].query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if(!available) {
+                // Queries finish in order
+                break;
+            }
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(pending[done].query, GL_QUERY_RESULT, &nanoseconds);
+            profiler.addGpu(pending[done].stage, pending[done].start, nanoseconds * 1e-9);
+            unused.push_back(pending[done].query);
+        }
+        pending.erase(pending.begin(), pending.begin() + done);
+    }
+
+private:
+    bool begin(const char *stage) {
+        if(!profiler.enabled() || open) {
+            return false;
+        }
+        GLuint query;
+        if(unused.empty()) {
+            glGenQueries(1, &query);
+        } else {
+            query = unused.back();
+            unused.pop_back();
+        }
+        glBeginQuery(GL_TIME_ELAPSED, query);
+        pending.push_back({ query, stage, profiler.now() });
+        open = true;
+        return true;
+    }
+
+    void end() {
+        glEndQuery(GL_TIME_ELAPSED);
+        open = false;
+    }
+};
+
+#endif
@@ -12,6 +12,9 @@
 
 #include <nanogui/nanogui.h>
 #include "camera.h"
+#include "camerapath.h"
+#include "volumeheader.h"
+#include "marchingcubes.h"
 
 using namespace nanogui;
 
@@ -36,13 +39,6 @@ enum depth_type {
     Always
 };
 
-enum model_type {
-    Bonsai,
-    BostonTeapot,
-    Bucky,
-    Head
-};
-
 struct Light {
     bool status = true;
     Color ambient;
@@ -50,11 +46,6 @@ struct Light {
     Color specular;
 };
 
-struct ModelName {
-    std::string name;
-    int x, y, z;
-};
-
 Screen *screen;
 
 class GUI {
@@ -69,6 +60,23 @@ public:
     bool showDiffuse, showNormal;
     GLfloat depth = 0.1f;
     int cuts = 100;
+    NormalSource normals = FaceNormals;
+    // Draw decimated levels of detail of large meshes from lodDistance away
+    bool useLods = true;
+    GLfloat lodDistance = 3.0f;
+    // Upload meshes as PackedVertex instead of floats
+    bool packVertices = false;
+    // Skip the chunks of the mesh outside the view
+    bool cullChunks = true;
+    // Format of the next export and whether the button asked for one
+    MeshFormat exportFormat = Ply;
+    bool exportRequested = false;
+    // Time the stages of every frame and extraction, and whether the button
+    // asked to save the trace recorded since
+    bool profiling = false;
+    bool traceRequested = false;
+    // Camera operations are added here while the viewer records a path
+    CameraPath *recording = nullptr;
 
 private:
     GLfloat rotateVal = 5.0f, moveVal = 0.4f;
@@ -76,11 +84,17 @@ private:
     culling_type cullingType = CW;
     shading_type shadingType = Smooth;
     depth_type depthType = Less;
-    model_type modelType = BostonTeapot;
+    // Volumes found in models/, their dimensions and types come from the
+    // headers or file names
+    std::vector<std::string> modelPaths;
+    int modelIndex = 0;
     Camera* camera;
 
     nanogui::detail::FormWidget<GLfloat> *fovIn;
     nanogui::detail::FormWidget<bool> *pointRotateXIn, *pointRotateYIn, *pointRotateZIn;
+    Label *statusLabel;
+    // A line of the timings window per stage
+    std::vector<Label*> timingLabels;
     
 public:
     GUI(GLFWwindow* window, Camera* camera) {
@@ -160,7 +174,21 @@ public:
         gui->addGroup("Configuration");
         gui->addVariable("Render type", renderType)->setItems({ "Point", "Line", "Triangle" });
         gui->addVariable("Shading type", shadingType)->setItems({ "Smooth", "Flat" });
-        gui->addVariable("Model name", modelType)->setItems({ "Bonsai", "BostonTeapot", "Bucky", "Head" });
+        modelPaths = listVolumes("models");
+        std::vector<std::string> modelNames;
+        for(size_t i = 0; i < modelPaths.size(); i++) {
+            std::string name = modelPaths[i].substr(modelPaths[i].find_last_of('/') + 1);
+            modelNames.push_back(name.substr(0, name.find_last_of('.')));
+            if(name.compare(0, 12, "BostonTeapot") == 0) {
+                modelIndex = i;
+            }
+        }
+        ComboBox* modelBox = new ComboBox(frame, modelNames);
+        modelBox->setSelectedIndex(modelIndex);
+        modelBox->setCallback([this](int index) {
+            modelIndex = index;
+        });
+        gui->addWidget("Model name", modelBox);
         Slider* depthSlider = new Slider(frame);
         depthSlider->setValue(depth);
         gui->addWidget("View depth", depthSlider);
@@ -168,6 +196,30 @@ public:
             depth = value;
         });
         gui->addVariable("Cuts", cuts);
+        gui->addVariable("Normals", normals)->setItems({ "Faces", "Central difference", "Sobel" });
+        gui->addVariable("Level of detail", useLods);
+        gui->addVariable("LOD distance", lodDistance)->setSpinnable(true);
+        gui->addVariable("Packed vertices", packVertices);
+        gui->addVariable("Cull chunks", cullChunks);
+        statusLabel = new Label(frame, "ready");
+        gui->addWidget("Status", statusLabel);
+
+        gui->addGroup("Export");
+        gui->addVariable("Format", exportFormat)->setItems({ "PLY", "STL", "OBJ" });
+        gui->addButton("Export mesh", [this]() {
+            exportRequested = true;
+        });
+
+        // Stage timings, filled in by setTimings
+        Window *timings = gui->addWindow(Eigen::Vector2i(10, 560), "Timings");
+        gui->addVariable("Profile", profiling);
+        gui->addButton("Save trace", [this]() {
+            traceRequested = true;
+        });
+        for(int i = 0; i < 12; i++) {
+            timingLabels.push_back(new Label(timings, ""));
+            gui->addWidget("", timingLabels.back());
+        }
         
         // Lighting controls
         /* gui->addWindow(Eigen::Vector2i(10, 10), "Lighting"); */
@@ -250,17 +302,40 @@ public:
         screen->drawWidgets();
     }
 
+    // Show a line per stage in the timings window, as many as fit
+    void setTimings(const std::vector<std::string> &lines) {
+        for(size_t i = 0; i < timingLabels.size(); i++) {
+            timingLabels[i]->setCaption(i < lines.size() ? lines[i] : "");
+        }
+    }
+
+    // Show what the background extraction is doing
+    void setStatus(const std::string &status) {
+        if(statusLabel->caption() != status) {
+            statusLabel->setCaption(status);
+        }
+    }
+
     void reset() {
         fov = 45.0f;
         fovIn->setValue(fov);
         camera->resetCameraFront();
+        if(recording) {
+            recording->record(CameraStep::ResetFront);
+        }
     }
 
     void resetTop() {
         camera->resetCameraTop();
+        if(recording) {
+            recording->record(CameraStep::ResetTop);
+        }
     }
 
     void moveCamera(char direction, GLfloat units) {
+        if(recording) {
+            recording->record(CameraStep::Move, direction, units);
+        }
         switch(direction) {
             case 'n':
                 camera->moveN(units);
@@ -274,37 +349,43 @@ public:
         }
     }
 
-    ModelName getModelType() {
-        switch(modelType) {
-            case BostonTeapot:
-                return {
-                    "models/BostonTeapot_256_256_178.raw", 256, 256, 178
-                };
-            case Bonsai:
-                return {
-                    "models/Bonsai_512_512_154.raw", 512, 512, 154
-                };
-            case Bucky:
-                return {
-                    "models/Bucky_32_32_32.raw", 32, 32, 32
-                };
-            case Head:
-                return {
-                    "models/Head_256_256_225.raw", 256, 256, 225
-                };
+    // File the current mesh is exported to, named after the volume, cuts
+    // and level
+    std::string getExportPath() {
+        std::string name = getModelPath();
+        name = name.substr(name.find_last_of('/') + 1);
+        name = name.substr(0, name.find_last_of('.'));
+        return (name.empty() ? std::string("surface") : name) + "_" + std::to_string(cuts) + "_" +
+            std::to_string((int)(depth * 1000)) + "." + meshFormatName(exportFormat);
+    }
+
+    // Path of the selected volume, empty when models/ has none
+    std::string getModelPath() {
+        if(modelPaths.empty()) {
+            return "";
         }
+        return modelPaths[modelIndex];
     }
 
     void rotateCameraU(GLfloat degrees) {
         camera->rotateU(degrees);
+        if(recording) {
+            recording->record(CameraStep::Rotate, 'u', degrees);
+        }
     }
 
     void rotateCameraV(GLfloat degrees) {
         camera->rotateV(degrees);
+        if(recording) {
+            recording->record(CameraStep::Rotate, 'v', degrees);
+        }
     }
 
     void rotateCameraN(GLfloat degrees) {
         camera->rotateN(degrees);
+        if(recording) {
+            recording->record(CameraStep::Rotate, 'n', degrees);
+        }
     }
 
     GLenum getRenderType() {
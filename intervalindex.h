@@ -0,0 +1,197 @@
+#ifndef INTERVALINDEX_H
+#define INTERVALINDEX_H
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+/**
+ * Span space index over the value range of every cell of a grid. Cells are
+ * bucketed by the BUCKETS x BUCKETS grid of their (min, max) pair, so the
+ * cells crossing a level, or the cells that start or stop crossing it when the
+ * level moves, are found by visiting the buckets of a rectangle of span space
+ * and only testing the cells of the buckets on its border. Cells with a
+ * constant value never cross a level and are not stored. Buckets split [0, 1]
+ * unless the grid holds values of another range
+ */
+class IntervalIndex {
+public:
+    static const int BUCKETS = 256;
+
+private:
+    struct Entry {
+        uint32_t cell;
+        float min, max;
+    };
+    vector<Entry> entries;
+    // Start of bucket (minBucket, maxBucket) in entries, BUCKETS^2 + 1 of them
+    vector<size_t> starts;
+    // Values v map to (v - origin) * scale in [0, 1] for bucketing
+    float origin = 0.0f, scale = 1.0f;
+
+    int bucket(float value) const {
+        value = (value - origin) * scale;
+        if(!(value > 0.0f)) {
+            return 0;
+        }
+        return value >= 1.0f ? BUCKETS - 1 : (int)(value * BUCKETS);
+    }
+
+    // Value range of a bucket, the outer buckets reach to infinity so values
+    // outside the range stay in it
+    float lowerEdge(int b) const {
+        return b == 0 ? -numeric_limits<float>::infinity() : origin + ((float)b / BUCKETS) / scale;
+    }
+
+    float upperEdge(int b) const {
+        return b == BUCKETS - 1 ? numeric_limits<float>::infinity() : origin + ((float)(b + 1) / BUCKETS) / scale;
+    }
+
+    // Range of the cells of layer z of a grid, minimum and maximum of each
+    // 2x2 quad of points of the two planes bounding it
+    static void quadRange(const float *plane, const int dims[3], vector<float> &lo, vector<float> &hi) {
+        int dx = dims[0];
+        int dy = dims[1];
+        lo.resize((size_t)(dx - 1) * (dy - 1));
+        hi.resize(lo.size());
+        for(int y = 0; y < dy - 1; y++) {
+            const float *r0 = plane + (size_t)y * dx;
+            const float *r1 = r0 + dx;
+            float *l = &lo[(size_t)y * (dx - 1)];
+            float *h = &hi[(size_t)y * (dx - 1)];
+            for(int x = 0; x < dx - 1; x++) {
+                l[x] = min(min(r0[x], r0[x+1]), min(r1[x], r1[x+1]));
+                h[x] = max(max(r0[x], r0[x+1]), max(r1[x], r1[x+1]));
+            }
+        }
+    }
+
+    // Call fn(cell, min, max) for every cell of the grid with a varying value
+    template <typename Plane, typename F>
+    static void eachCell(const int dims[3], Plane plane, F fn) {
+        vector<float> lo[2], hi[2];
+        size_t layer = (size_t)(dims[0] - 1) * (dims[1] - 1);
+        quadRange(plane(0), dims, lo[0], hi[0]);
+        for(int z = 0; z < dims[2] - 1; z++) {
+            vector<float> &l0 = lo[z & 1], &h0 = hi[z & 1];
+            vector<float> &l1 = lo[(z + 1) & 1], &h1 = hi[(z + 1) & 1];
+            quadRange(plane(z + 1), dims, l1, h1);
+            for(size_t i = 0; i < layer; i++) {
+                float a = min(l0[i], l1[i]);
+                float b = max(h0[i], h1[i]);
+                if(a < b) {
+                    fn((uint32_t)(z * layer + i), a, b);
+                }
+            }
+        }
+    }
+
+public:
+    // Build the index over a grid with the given number of points per axis.
+    // Cells are numbered in scan order, x fastest
+    void build(const vector<float> &grid, const int dims[3]) {
+        size_t planeSize = (size_t)dims[0] * dims[1];
+        build(dims, [&](int z) { return &grid[z * planeSize]; });
+    }
+
+    // Build the index from planes of a grid with values in [low, high],
+    // plane(z) returns the points of plane z, valid until the next call
+    template <typename Plane>
+    void build(const int dims[3], Plane plane, float low = 0.0f, float high = 1.0f) {
+        origin = low;
+        scale = high > low ? 1.0f / (high - low) : 1.0f;
+        vector<size_t> counts((size_t)BUCKETS * BUCKETS + 1, 0);
+        eachCell(dims, plane, [&](uint32_t, float a, float b) {
+            counts[bucket(a) * BUCKETS + bucket(b)]++;
+        });
+        starts.assign(counts.size(), 0);
+        for(size_t i = 1; i < starts.size(); i++) {
+            starts[i] = starts[i - 1] + counts[i - 1];
+        }
+        entries.resize(starts.back());
+        vector<size_t> next(starts.begin(), starts.end() - 1);
+        eachCell(dims, plane, [&](uint32_t cell, float a, float b) {
+            entries[next[bucket(a) * BUCKETS + bucket(b)]++] = { cell, a, b };
+        });
+    }
+
+    void clear() {
+        entries.clear();
+        starts.clear();
+    }
+
+    bool empty() const {
+        return starts.empty();
+    }
+
+    // Append the cells with min in [minLo, minHi) and max in [maxLo, maxHi)
+    void query(float minLo, float minHi, float maxLo, float maxHi, vector<uint32_t> &cells) const {
+        if(starts.empty() || minLo >= minHi || maxLo >= maxHi) {
+            return;
+        }
+        int a0 = bucket(minLo), a1 = bucket(minHi);
+        int b0 = bucket(maxLo), b1 = bucket(maxHi);
+        for(int a = a0; a <= a1; a++) {
+            // max >= min, so buckets below the diagonal are empty
+            for(int b = max(a, b0); b <= b1; b++) {
+                size_t begin = starts[a * BUCKETS + b];
+                size_t end = starts[a * BUCKETS + b + 1];
+                bool inside = lowerEdge(a) >= minLo && upperEdge(a) <= minHi &&
+                    lowerEdge(b) >= maxLo && upperEdge(b) <= maxHi;
+                for(size_t i = begin; i < end; i++) {
+                    const Entry &e = entries[i];
+                    if(inside || (e.min >= minLo && e.min < minHi && e.max >= maxLo && e.max < maxHi)) {
+                        cells.push_back(e.cell);
+                    }
+                }
+            }
+        }
+    }
+
+    // Cells that cross level, with a value below it and a value at or above it
+    void activeCells(float level, vector<uint32_t> &cells) const {
+        const float inf = numeric_limits<float>::infinity();
+        query(-inf, level, level, inf, cells);
+    }
+
+    // Cells that start (added) or stop (removed) crossing the level when it
+    // moves from one value to another
+    void changedCells(float from, float to, vector<uint32_t> &added, vector<uint32_t> &removed) const {
+        const float inf = numeric_limits<float>::infinity();
+        if(to > from) {
+            query(-inf, from, from, to, removed);
+            query(from, to, to, inf, added);
+        } else if(to < from) {
+            query(-inf, to, to, from, added);
+            query(to, from, from, inf, removed);
+        }
+    }
+};
+
+// Sort cell numbers with a radix sort, fewer passes than a comparison sort for
+// the large active sets of dense volumes
+inline void sortCells(vector<uint32_t> &cells) {
+    if(cells.size() < 4096) {
+        sort(cells.begin(), cells.end());
+        return;
+    }
+    vector<uint32_t> scratch(cells.size());
+    for(int shift = 0; shift < 32; shift += 16) {
+        vector<size_t> counts(65537, 0);
+        for(uint32_t c : cells) {
+            counts[((c >> shift) & 0xffff) + 1]++;
+        }
+        for(size_t i = 1; i < counts.size(); i++) {
+            counts[i] += counts[i - 1];
+        }
+        for(uint32_t c : cells) {
+            scratch[counts[(c >> shift) & 0xffff]++] = c;
+        }
+        cells.swap(scratch);
+    }
+}
+
+#endif
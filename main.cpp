@@ -1,4 +1,5 @@
 #include <iostream>
+#include <thread>
 
 // GLEW
 #define GLEW_STATIC
@@ -13,6 +14,11 @@
 #include "gui.h"
 #include "camera.h"
 #include "marchingcubes.h"
+#include "extractor.h"
+#include "meshexport.h"
+#include "profiler.h"
+#include "gputimers.h"
+#include "camerapath.h"
 
 using namespace std;
 
@@ -63,6 +69,9 @@ int main() {
 
     // Load shaders
     Shader shader("shader/basic.vert", "shader/basic.frag");
+    // Camera and lights, uploaded once a frame where they changed
+    UniformBuffer<FrameUniforms> frame(0);
+    frame.attach(shader, "Frame");
 
     // Mesh object
     /* Mesh *mesh = new Mesh(); */
@@ -77,16 +86,54 @@ int main() {
     pointLightPosition = glm::vec4(camera->position.x, camera->position.y, camera->position.z, 0.0f);
     pointLight2Position = glm::vec4(camera->position.x, camera->position.y, camera->position.z, 0.0f);
 
-    MarchingCubes mc;
+    // Extraction runs in the background, the last finished mesh stays on
+    // screen until the next one is ready
+    // Meshes seen before are mapped from the cache instead of extracted again
+    Extractor extractor(thread::hardware_concurrency(), "cache", (size_t)512 << 20);
+    // Meshes of more than 80k triangles get up to 4 levels of detail, kept
+    // to upload again when the vertex format changes
+    extractor.setLods(4, 20000);
+    // MC_FINISH_LEVELS=on shows the meshes at the levels passed while the
+    // slider is dragged instead of cancelling them
+    const char *finishLevels = getenv("MC_FINISH_LEVELS");
+    extractor.setFinishLevels(finishLevels && string(finishLevels) == "on");
+    vector<IndexedMesh> lods;
+    Extractor::Request extracting = { "", 0, 0.0f, FaceNormals };
+    IndexedMesh surface;
+    MappedMesh cachedSurface;
     Mesh mesh;
-
-    GLfloat level = 0.0f;
-    int cuts = 0;
-    ModelName modelName;
+    string exportStatus;
+
+    // Stage timings for the timings window and traces. MC_TRACE=path profiles
+    // from the start and writes the trace of the session there on exit
+    Profiler profiler;
+    profiler.nameThread("render");
+    GpuTimers gpuTimers(profiler);
+    extractor.setProfiler(&profiler);
+    const char *tracePath = getenv("MC_TRACE");
+    if(tracePath) {
+        gui.profiling = true;
+    }
+    double timingsShown = 0.0;
+
+    // MC_RECORD=path records the camera buttons pressed, frame by frame, as a
+    // camera path for mc_render and writes it there on exit
+    const char *recordPath = getenv("MC_RECORD");
+    CameraPath recording;
+    if(recordPath) {
+        gui.recording = &recording;
+    }
 
     // Main loop
     while (!glfwWindowShouldClose(window))
 	{
+        if(gui.profiling != profiler.enabled()) {
+            profiler.setEnabled(gui.profiling);
+            if(gui.profiling) {
+                profiler.startTrace();
+            }
+        }
+        Profiler::Scope frameScope(&profiler, "frame");
 		glfwPollEvents();
 
 		// Check if a new mesh path has been input
@@ -96,23 +143,63 @@ int main() {
 		/* 	setCameraDefaults(mesh, camera); */
 		/* 	gui.reset(); */
 		/* } */
-        bool update = false;
-        if(modelName.name != gui.getModelType().name){
-            modelName = gui.getModelType();
-            update = true;
-            mc.loadModel(modelName.name, modelName.x, modelName.y, modelName.z);
+        Extractor::Request wanted = { gui.getModelPath(), (size_t)gui.cuts, gui.depth, gui.normals };
+        if(wanted != extracting) {
+            extracting = wanted;
+            extractor.request(wanted);
+            exportStatus = "";
+        }
+        // A cached mesh stays mapped after the upload so it can be exported
+        if(extractor.take(surface, cachedSurface)) {
+            GpuTimers::Scope scope(gpuTimers, "upload");
+            if(cachedSurface.valid()) {
+                mesh.createMesh(cachedSurface);
+            } else {
+                mesh.createMesh(surface);
+            }
+            lods.clear();
         }
-        if(cuts != gui.cuts || update) {
-            cuts = gui.cuts;
-            update = true;
-            mc.setCuts(cuts);
+        if(extractor.takeLods(lods)) {
+            GpuTimers::Scope scope(gpuTimers, "upload");
+            mesh.setLods(lods);
         }
-        if(level != gui.depth || update) {
-            level = gui.depth;
-            vector<Face*> faces = mc.construct(level);
-            mesh.createMesh(faces);
-            mc.cleanUp();
+        // Upload the mesh again in the other vertex format to compare them
+        if(gui.packVertices != mesh.packVertices) {
+            GpuTimers::Scope scope(gpuTimers, "upload");
+            mesh.packVertices = gui.packVertices;
+            if(cachedSurface.valid()) {
+                mesh.createMesh(cachedSurface);
+            } else if(!surface.positions.empty()) {
+                mesh.createMesh(surface);
+            }
+            mesh.setLods(lods);
         }
+        mesh.lodDistance = gui.lodDistance;
+        mesh.cullChunks = gui.cullChunks;
+        float cameraDistance = gui.useLods ? glm::distance(camera->position, glm::vec3(0.5f)) : 0.0f;
+        size_t lod = mesh.lodFor(cameraDistance);
+        if(gui.exportRequested) {
+            gui.exportRequested = false;
+            string exportPath = gui.getExportPath();
+            bool exported;
+            if(cachedSurface.valid()) {
+                exported = exportMesh(exportPath, cachedSurface.vertexData(), cachedSurface.vertexData() + cachedSurface.vertexCount(),
+                                      cachedSurface.vertexCount(), cachedSurface.indexData(), cachedSurface.indexCount());
+            } else {
+                exported = exportMesh(exportPath, surface.positions.data(), surface.normals.data(), surface.positions.size(),
+                                      surface.indices.data(), surface.indices.size());
+            }
+            exportStatus = exported ? "exported " + exportPath : "export failed";
+        }
+        if(gui.traceRequested) {
+            gui.traceRequested = false;
+            exportStatus = profiler.writeTrace("trace.json") ? "wrote trace.json" : "could not write trace.json";
+        }
+        gui.setStatus(extractor.busy() ? "extracting..." : extractor.failed() ? "could not read volume" :
+                      !exportStatus.empty() ? exportStatus : extractor.decimatingLods() ? "decimating..." :
+                      lod > 0 ? "level of detail " + to_string(lod) :
+                      gui.cullChunks && mesh.chunkCount() > 0 ?
+                      to_string(mesh.drawnChunks()) + " of " + to_string(mesh.chunkCount()) + " chunks" : "ready");
 
 		// Render
 		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
@@ -138,49 +225,80 @@ int main() {
         pointLightPosition = glm::rotateY(pointLightPosition, glm::radians(0.25f));
         pointLight2Position = glm::rotateX(pointLight2Position, glm::radians(0.25f));
 		
+		// Per frame state goes to the Frame block, only what changed is uploaded
+        FrameUniforms &f = frame.data;
+        f.view = view;
+        f.projection = projection;
+        f.cameraPos = camera->position;
+        f.colorIn = GUI::vec3(gui.color);
+        f.shininess = gui.shininess;
+        f.shadeFlat = gui.getShadingType();
+        setLight(f.point, GUI::vec3(gui.point.ambient), GUI::vec3(gui.point.diffuse), GUI::vec3(gui.point.specular),
+                 pointLightPosition, gui.point.status);
+        setLight(f.point2, glm::vec3(0.0f), glm::vec3(0.2f, 0.0f, 0.3f), glm::vec3(0.0f, 0.6f, 0.2f),
+                 pointLight2Position, gui.point.status);
+        glm::vec3 cameraLight = camera->u * gui.directionalX + camera->v * gui.directionalY + camera->n * gui.directionalZ * -1.0f;
+        setLight(f.directional, GUI::vec3(gui.directional.ambient), GUI::vec3(gui.directional.diffuse),
+                 GUI::vec3(gui.directional.specular), glm::vec4(cameraLight.x, cameraLight.y, cameraLight.z, 1.0f),
+                 gui.directional.status);
+        frame.update();
+
 		// Load and setup the shaders
         shader.use();
         shader.setMat4("model", model);
-        shader.setMat4("view", view);
-        shader.setMat4("projection", projection);
-
-        shader.setVec3("cameraPos", camera->position);
-        shader.setVec3("colorIn", GUI::vec3(gui.color));
-        shader.setFloat("shininess", gui.shininess);
-
-        shader.setVec3("point.ambient", GUI::vec3(gui.point.ambient));
-        shader.setVec3("point.diffuse", GUI::vec3(gui.point.diffuse));
-        shader.setVec3("point.specular", GUI::vec3(gui.point.specular));
-        shader.setVec4("point.position", pointLightPosition);
-        shader.setBool("point.enabled", gui.point.status);
-        shader.setVec3("point2.ambient", glm::vec3(0.0f));
-        shader.setVec3("point2.diffuse", glm::vec3(0.2f, 0.0f, 0.3f));
-        shader.setVec3("point2.specular", glm::vec3(0.0f, 0.6f, 0.2f));
-        shader.setVec4("point2.position", pointLight2Position);
-        shader.setBool("point2.enabled", gui.point.status);
-
-        shader.setVec3("directional.ambient", GUI::vec3(gui.directional.ambient));
-        shader.setVec3("directional.diffuse", GUI::vec3(gui.directional.diffuse));
-        shader.setVec3("directional.specular", GUI::vec3(gui.directional.specular));
-        glm::vec3 cameraLight = camera->u * gui.directionalX + camera->v * gui.directionalY + camera->n * gui.directionalZ * -1.0f;
-        shader.setVec4("directional.position", glm::vec4(cameraLight.x, cameraLight.y, cameraLight.z, 1.0f));
-        shader.setBool("directional.enabled", gui.directional.status);
-
-        shader.setBool("shadeFlat", gui.getShadingType());
 
         shader.setInt("diffuseTexture", 0);
         shader.setInt("normalTexture", 1);
 
 		// Draw the mesh
 		glPolygonMode(GL_FRONT_AND_BACK, gui.getRenderType());
-		mesh.draw();
+        {
+            GpuTimers::Scope scope(gpuTimers, "draw");
+            mesh.draw(shader, cameraDistance, projection * view * model);
+        }
 		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 		
         // Draw the gui
-        gui.draw();
+        {
+            GpuTimers::Scope scope(gpuTimers, "gui");
+            gui.draw();
+        }
 
 		// Swap the screen buffers
-		glfwSwapBuffers(window);
+        {
+            Profiler::Scope scope(&profiler, "swap");
+            glfwSwapBuffers(window);
+        }
+        if(recordPath) {
+            recording.endFrame();
+        }
+
+        // Mean and longest time of every stage, twice a second
+        gpuTimers.collect();
+        if(profiler.enabled() && profiler.now() - timingsShown > 0.5) {
+            timingsShown = profiler.now();
+            vector<string> lines;
+            for(const Profiler::Stats &stats : profiler.breakdown()) {
+                char line[128];
+                int length = snprintf(line, sizeof(line), "%s: cpu %.2f / %.2f ms", stats.name.c_str(), stats.cpuMean, stats.cpuMax);
+                if(stats.gpuSamples > 0) {
+                    snprintf(line + length, sizeof(line) - length, ", gpu %.2f / %.2f ms", stats.gpuMean, stats.gpuMax);
+                }
+                lines.push_back(line);
+            }
+            gui.setTimings(lines);
+        }
 	}
+
+    if(tracePath) {
+        profiler.writeTrace(tracePath);
+    }
+    if(recordPath) {
+        // The command that replays it
+        char comment[512];
+        snprintf(comment, sizeof(comment), "mc_render %s --cuts %d --level %g --path %s",
+                 extracting.path.c_str(), gui.cuts, gui.depth, recordPath);
+        recording.save(recordPath, comment);
+    }
 }
 
@@ -1,9 +1,10 @@
 #ifndef MARCHINGCUBES
 #define MARCHINGCUBES
 
-// GLEW
-#define GLEW_STATIC
-#include <GL/glew.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -12,18 +13,26 @@
 #include <iostream>
 #include <iomanip>
 #include <vector>
+#include <array>
 #include <unordered_map>
+#include <algorithm>
+#include <memory>
+#include <iterator>
+#include <atomic>
+#include <limits>
 
 #include "marchingcubeslookup.h"
+#include "threadpool.h"
+#include "classify.h"
+#include "minmaxpyramid.h"
+#include "intervalindex.h"
+#include "volume.h"
+#include "volumeheader.h"
+#include "resampler.h"
+#include "meshexport.h"
 
 using namespace std;
 
-struct Cell {
-    glm::vec3 p[8];
-    float val[8];
-    size_t x, y, z;
-};
-
 struct Intersection;
 
 struct Face {
@@ -37,199 +46,501 @@ struct Intersection {
 	vector<Face*> faceList;
 };
 
+// Marks an edge whose vertex has not been emitted yet
+const uint32_t NO_VERTEX = 0xffffffff;
+// Cell layers per slab of constructStreamed
+const int STREAM_LAYERS = 16;
+
+// Where vertex normals come from. FaceNormals averages the normals of the
+// triangles around each vertex once they are all emitted; the others take
+// the gradient of the field at both ends of the crossed edge, by central
+// differences or a 3x3x3 Sobel filter, and interpolate it like the position
+enum NormalSource {
+    FaceNormals,
+    CentralDifference,
+    Sobel
+};
+
+// Cells along each axis of the blocks chunkMesh sorts triangles into
+const int CHUNK_CELLS = 32;
+
+// The triangles of a mesh inside one block of the grid: indices [first,
+// first + count) and the box around their vertices
+struct SurfaceChunk {
+    glm::vec3 low, high;
+    uint32_t first, count;
+};
+
+// Extraction output with shared vertices and an index buffer. chunks is
+// empty until chunkMesh sorts the triangles into blocks
+struct IndexedMesh {
+    vector<glm::vec3> positions;
+    vector<glm::vec3> normals;
+    vector<uint32_t> indices;
+    vector<SurfaceChunk> chunks;
+
+    void clear() {
+        positions.clear();
+        normals.clear();
+        indices.clear();
+        chunks.clear();
+    }
+
+    size_t triangleCount() const {
+        return indices.size() / 3;
+    }
+};
+
+// Reorder the triangles of mesh by the block of size chunkSize their centroid
+// lies in, keeping their order within a block, and list the blocks that hold
+// any in mesh.chunks. A renderer can then skip the blocks out of view
+inline void chunkMesh(IndexedMesh &mesh, const glm::vec3 &chunkSize) {
+    mesh.chunks.clear();
+    size_t triangles = mesh.triangleCount();
+    if(triangles == 0) {
+        return;
+    }
+    glm::vec3 high = mesh.positions[0];
+    for(size_t i = 1; i < mesh.positions.size(); i++) {
+        high = glm::max(high, mesh.positions[i]);
+    }
+    int blocks[3];
+    for(int i = 0; i < 3; i++) {
+        blocks[i] = max(1, (int)(high[i] / chunkSize[i]) + 1);
+    }
+
+    // Counting sort on the block of every triangle
+    vector<uint32_t> blockOf(triangles);
+    vector<uint32_t> starts((size_t)blocks[0] * blocks[1] * blocks[2] + 1, 0);
+    for(size_t t = 0; t < triangles; t++) {
+        const uint32_t *tri = &mesh.indices[3 * t];
+        glm::vec3 centroid = (mesh.positions[tri[0]] + mesh.positions[tri[1]] + mesh.positions[tri[2]]) / 3.0f;
+        int b[3];
+        for(int i = 0; i < 3; i++) {
+            b[i] = min(max((int)(centroid[i] / chunkSize[i]), 0), blocks[i] - 1);
+        }
+        blockOf[t] = (uint32_t)(b[0] + blocks[0] * (b[1] + blocks[1] * b[2]));
+        starts[blockOf[t] + 1]++;
+    }
+    for(size_t b = 1; b < starts.size(); b++) {
+        starts[b] += starts[b - 1];
+    }
+    vector<uint32_t> sorted(mesh.indices.size());
+    vector<uint32_t> next(starts.begin(), starts.end() - 1);
+    for(size_t t = 0; t < triangles; t++) {
+        uint32_t to = 3 * next[blockOf[t]]++;
+        sorted[to] = mesh.indices[3 * t];
+        sorted[to + 1] = mesh.indices[3 * t + 1];
+        sorted[to + 2] = mesh.indices[3 * t + 2];
+    }
+    mesh.indices.swap(sorted);
+
+    for(size_t b = 0; b + 1 < starts.size(); b++) {
+        if(starts[b] == starts[b + 1]) {
+            continue;
+        }
+        SurfaceChunk chunk;
+        chunk.first = 3 * starts[b];
+        chunk.count = 3 * (starts[b + 1] - starts[b]);
+        chunk.low = chunk.high = mesh.positions[mesh.indices[chunk.first]];
+        for(uint32_t i = chunk.first; i < chunk.first + chunk.count; i++) {
+            chunk.low = glm::min(chunk.low, mesh.positions[mesh.indices[i]]);
+            chunk.high = glm::max(chunk.high, mesh.positions[mesh.indices[i]]);
+        }
+        mesh.chunks.push_back(chunk);
+    }
+}
+
+/**
+ * Resamples a raw volume onto a grid and extracts an isosurface from it, or
+ * extracts it from the voxels themselves at their native resolution.
+ * Has no OpenGL dependency so it can be driven headlessly (see mc_extract.cpp)
+ */
 class MarchingCubes {
-    GLubyte *raw_data;
+    // A range of cell layers extracted on its own by constructIndexed
+    struct Slab {
+        int z0, z1;
+        size_t vertexCount = 0, triangleCount = 0;
+        size_t vertexBase = 0, indexBase = 0;
+        // Vertex id and index position of the first entries of the mesh the
+        // slab writes to, 0 unless it has a mesh of its own
+        size_t vertexOrigin = 0, indexOrigin = 0;
+        // Vertex ids of the edges starting on plane z1
+        vector<uint32_t> top;
+        // Index positions and edge slots that refer to the slab below
+        vector<pair<size_t, size_t>> patches;
+        // Face normals for vertices owned by the slab below, in emit order
+        vector<pair<size_t, glm::vec3>> sharedNormals;
+    };
+
+    // Owns the voxels, mapped from the file when possible
+    VolumeSource volume;
     int raw_dimension[3];
     size_t raw_size;
-    vector<Cell> cells;
-    int cells_dimension[3];
+    vector<float> grid;
+    // Whether the grid points are the voxels themselves, see setNativeResolution
+    bool native = false;
+    // Level of the current constructIndexed in the voxel type when native
+    int threshold = 0;
+    int grid_dimension[3];
+    float spacing[3];
+    ResampleFilter filter = Trilinear;
+    NormalSource normalSource = FaceNormals;
+    AxisWeights axes[3];
     vector<Face*> faces;
     unordered_map<int, Intersection*> intersections;
+    unique_ptr<ThreadPool> pool;
+
+    // A cell found by the classification kernel
+    struct ActiveCell {
+        int x, y;
+        uint8_t cube;
+    };
+
+    // Plane masks and scratch rows while walking the layers of a slab
+    struct Layer {
+        vector<uint8_t> masks[2];
+        vector<uint8_t> rowCube;
+        vector<uint32_t> rowActive;
+        vector<ActiveCell> active;
+        // Live cell ranges along x per block row of the current block layer
+        vector<vector<pair<int, int>>> runs;
+        int blockLayer = -1;
+        bool empty = true;
+    };
+    MinMaxPyramid pyramid;
+    // Pyramid blocks that can hold the surface at the current level
+    vector<uint8_t> liveBlocks;
+    // Span space index of the cell ranges, used instead of the pyramid when on
+    IntervalIndex intervals;
+    bool useIntervals = false;
+    // Cells crossing activeLevel in scan order and where each layer starts
+    vector<uint32_t> activeCells;
+    vector<size_t> layerStarts;
+    float activeLevel = 0.0f;
+    bool activeKnown = false;
+    // Set from another thread to stop setCuts or constructIndexed early
+    const atomic<bool> *cancel = nullptr;
+    // Levels bricked volumes are decoded for, see setLoadLevels. Every brick
+    // until it is called
+    float loadLow = -numeric_limits<float>::infinity();
+    float loadHigh = numeric_limits<float>::infinity();
 public: 
-    GLfloat scale;
+    float scale;
+    // Map the 8 bit volume at texture_path, the previous volume is released
     void loadModel(std::string texture_path, int x, int y, int z) {
-        raw_size = x * y * z;
+        VolumeInfo info;
+        info.dataPath = texture_path;
+        info.dimension[0] = x;
+        info.dimension[1] = y;
+        info.dimension[2] = z;
+        info.hasRange = true;
+        if(!loadVolume(info)) {
+            std::cout << "Error: loading .raw file failed" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Map the volume described by the header at path (see readVolumeInfo),
+    // false when it can not be read
+    bool loadVolume(const string &path) {
+        VolumeInfo info;
+        return readVolumeInfo(path, info) && loadVolume(info);
+    }
+
+    bool loadVolume(const VolumeInfo &info) {
+        raw_size = info.voxelCount();
+        raw_dimension[0] = info.dimension[0];
+        raw_dimension[1] = info.dimension[1];
+        raw_dimension[2] = info.dimension[2];
+        if(info.bricked) {
+            BrickedVolume bricked;
+            vector<uint8_t> voxels;
+            if(!bricked.open(info.dataPath) || !bricked.read(voxels, loadLow, loadHigh)) {
+                return false;
+            }
+            volume.adopt(voxels, info.type);
+        } else if(!volume.load(info.dataPath, info.byteCount(), info.type, info.offset, volumeNeedsSwap(info))) {
+            return false;
+        }
+        if(info.hasRange) {
+            volume.setRange(info.low, info.high);
+        } else {
+            scanRange();
+        }
+        return true;
+    }
+
+    // Only decompress the bricks of bricked volumes that can hold the surface
+    // at a level in [lowest, highest]; the voxels of the others get a value
+    // on the same side of those levels. Extracting at one of them with
+    // setNativeResolution and face normals gives the same surface as the
+    // full volume. Gradient normals sample voxels of the skipped bricks and
+    // grids resampled by setCuts can change next to them. Applies to the
+    // next loadVolume
+    void setLoadLevels(float lowest, float highest) {
+        loadLow = clampLevel(lowest);
+        loadHigh = clampLevel(highest);
+    }
+
+    // Load a volume that is already in memory, the data is copied. 8 bit
+    // volumes map [0, 255] to [0, 1], others their smallest and largest voxel
+    template <typename T>
+    void loadData(const T *data, int x, int y, int z) {
+        raw_size = (size_t)x * y * z;
         raw_dimension[0] = x;
         raw_dimension[1] = y;
         raw_dimension[2] = z;
-        raw_data = load_3d_raw_data(texture_path);
+        volume.copy((const uint8_t*)data, raw_size * sizeof(T), VoxelTraits<T>::type);
+        if(VoxelTraits<T>::type == Uint8) {
+            volume.setRange(0.0f, 255.0f);
+        } else {
+            scanRange();
+        }
+    }
 
-        /* for (size_t i = 0; i < raw_size; ++i) */
-            /* cout << hex << setfill('0') << setw(2) << raw_data[i] << " "; */
-            /* cout << (float)raw_data[i] << endl; */
+    // Identifies the loaded volume by its voxels, dimensions and value range.
+    // Reads the whole volume
+    uint64_t volumeHash() const {
+        float range[2] = { volume.rangeLow(), volume.rangeHigh() };
+        uint64_t h = hashBytes(raw_dimension, sizeof(raw_dimension), volume.contentHash());
+        return hashBytes(range, sizeof(range), h);
     }
 
-    void setCuts(size_t cuts) {
-        size_t xti = cuts, yti = cuts, zti = cuts;
-        size_t xsi = xti+2, ysi = yti+2, zsi = yti+2;
-        vector<GLfloat> points(xsi * ysi * zsi);
-        vector<glm::vec3> normals(xsi * ysi * zsi);
-        cells.clear();
-        cells.resize((xsi-1)*(ysi-1)*(zsi-1));
-        cells_dimension[0] = xsi-1;
-        cells_dimension[1] = ysi-1;
-        cells_dimension[2] = zsi-1;
-        GLfloat xdi = 1.0f * (raw_dimension[0]) / (xti-1);
-        GLfloat ydi = 1.0f * (raw_dimension[1]) / (yti-1);
-        GLfloat zdi = 1.0f * (raw_dimension[2]) / (zti-1);
-
-        for(size_t z = 1; z < zsi - 1; z++) {
-            for(size_t y = 1; y < ysi - 1; y++) {
-                for(size_t x = 1; x < xsi - 1; x++) {
-                    points[index(x, y, z, xsi, ysi)] = trilinear(xdi*(x-1), ydi*(y-1), zdi*(z-1));
-                    /* cout<<setw(8)<<points[index(x,y,z,xsi, ysi)]<<" "; */
-                }
-            /* cout<<endl; */
-            }
-            /* cout<<endl; */
-        }
-
-        for(size_t z = 0; z < zsi-1; z++) {
-            for(size_t y = 0; y < ysi-1; y++) {
-                for(size_t x = 0; x < xsi-1; x++) {
-                    GLfloat x1 = xdi*x;
-                    GLfloat x2 = x1 + xdi;
-                    GLfloat y1 = ydi*y;
-                    GLfloat y2 = y1 + ydi;
-                    GLfloat z1 = zdi*z;
-                    GLfloat z2 = z1 + zdi;
-                    int xp = x+1;
-                    int yp = y+1;
-                    int zp = z+1;
-                    cells[index(x, y, z, xsi-1, ysi-1)] = {
-                        {
-                            glm::vec3(x1, y1, z1),
-                            glm::vec3(x2, y1, z1),
-                            glm::vec3(x2, y2, z1),
-                            glm::vec3(x1, y2, z1),
-                            glm::vec3(x1, y1, z2),
-                            glm::vec3(x2, y1, z2),
-                            glm::vec3(x2, y2, z2),
-                            glm::vec3(x1, y2, z2)
-                        },
-                        {
-                            points[index(x, y, z, xsi, ysi)],
-                            points[index(xp, y, z, xsi, ysi)],
-                            points[index(xp, yp, z, xsi, ysi)],
-                            points[index(x, yp, z, xsi, ysi)],
-                            points[index(x, y, zp, xsi, ysi)],
-                            points[index(xp, y, zp, xsi, ysi)],
-                            points[index(xp, yp, zp, xsi, ysi)],
-                            points[index(x, yp, zp, xsi, ysi)],
-                        },
-                        x, y, z
-                    };
-                }
-            }
-        }
+    VoxelType voxelType() const {
+        return volume.type();
+    }
+
+    const int *dimension() const {
+        return raw_dimension;
     }
 
-    vector<Face*> construct(GLfloat level) {
+    // Levels are kept inside the range of the volume so the surface is closed
+    static float clampLevel(float level) {
         if(level < 0.01) {
             level = 0.01;
         }
         if(level > 0.99) {
             level = 0.99;
         }
-        GLfloat xmu = 1.0f / raw_dimension[0];
-        GLfloat ymu = 1.0f / raw_dimension[1];
-        GLfloat zmu = 1.0f / raw_dimension[2];
+        return level;
+    }
+
+    // Whether the current volume is memory mapped rather than read in
+    bool volumeMapped() const {
+        return volume.mapped();
+    }
+
+    void setCuts(size_t cuts) {
+        size_t xti = cuts, yti = cuts, zti = cuts;
+        size_t xsi = xti+2, ysi = yti+2, zsi = yti+2;
+        native = false;
+        activeKnown = false;
+        // The grid has a border of zeros so the surface is closed
+        grid.assign(xsi * ysi * zsi, 0.0f);
+        grid_dimension[0] = xsi;
+        grid_dimension[1] = ysi;
+        grid_dimension[2] = zsi;
+        spacing[0] = 1.0f * (raw_dimension[0]) / (xti-1);
+        spacing[1] = 1.0f * (raw_dimension[1]) / (yti-1);
+        spacing[2] = 1.0f * (raw_dimension[2]) / (zti-1);
+        axes[0].build(filter, raw_dimension[0], xti, spacing[0]);
+        axes[1].build(filter, raw_dimension[1], yti, spacing[1]);
+        axes[2].build(filter, raw_dimension[2], zti, spacing[2]);
+
+        // The volume is swept plane by plane; when the sampled planes are far
+        // apart readahead would mostly fetch the planes in between
+        volume.advise(spacing[2] > 2.0f ? VolumeSource::Random : VolumeSource::Sequential);
+        // One switch per call, every voxel type gets its own filter loops
+        switch(volume.type()) {
+            case Uint8: resample<uint8_t>(); break;
+            case Uint16: resample<uint16_t>(); break;
+            case Int16: resample<int16_t>(); break;
+            case Float32: resample<float>(); break;
+        }
+        volume.advise(VolumeSource::Normal);
+        if(cancelled()) {
+            return;
+        }
+        pyramid.build(grid, grid_dimension);
+        if(useIntervals && !cancelled()) {
+            buildIntervals();
+        }
+    }
+
+    // Extract from the voxels themselves instead of a resampled grid, one cell
+    // between every 8 neighbouring voxels. Cells are classified on the voxels
+    // as stored against the level converted to their type, so no float grid is
+    // kept; values are only converted for the edges the surface crosses.
+    // Lasts until the next setCuts
+    void setNativeResolution() {
+        native = true;
+        activeKnown = false;
+        vector<float>().swap(grid);
+        for(int i = 0; i < 3; i++) {
+            grid_dimension[i] = raw_dimension[i] + 2;
+            spacing[i] = 1.0f;
+        }
+        vector<float> points;
+        auto plane = [&](int z) {
+            nativePlane(z, points);
+            return points.data();
+        };
+        volume.advise(VolumeSource::Sequential);
+        pyramid.build(grid_dimension, plane);
+        if(useIntervals && !cancelled()) {
+            buildIntervals();
+        }
+        volume.advise(VolumeSource::Normal);
+    }
+
+    // Filter used by setCuts along axes with fewer cuts than voxels
+    void setResampleFilter(ResampleFilter f) {
+        filter = f;
+    }
+
+    // Size of cells x cells x cells cells of the grid set up by setCuts in
+    // the unit cube meshes are scaled to, for chunkMesh
+    glm::vec3 chunkSize(int cells = CHUNK_CELLS) const {
+        glm::vec3 size;
+        for(int i = 0; i < 3; i++) {
+            size[i] = cells * spacing[i] / raw_dimension[i];
+        }
+        return size;
+    }
+
+    // How construct, constructIndexed and constructStreamed find normals
+    void setNormalSource(NormalSource source) {
+        normalSource = source;
+    }
+
+    // Poll flag between layers of work; once it is set setCuts and
+    // constructIndexed return early and leave the grid or mesh incomplete,
+    // so the caller has to redo them
+    void setCancelFlag(const atomic<bool> *flag) {
+        cancel = flag;
+    }
+
+    // Keep an index of the value range of every cell so a new level only
+    // visits the cells crossing it, and a level close to the last one only the
+    // cells that changed. Used by constructIndexed, costs 12 bytes per cell.
+    // Grids of more than 2^32 cells are extracted without it
+    void setIntervalIndex(bool enable) {
+        useIntervals = enable;
+        activeKnown = false;
+        if(enable && (native || !grid.empty())) {
+            buildIntervals();
+        } else if(!enable) {
+            intervals.clear();
+            activeCells.clear();
+        }
+    }
+
+    vector<Face*> construct(float level) {
+        level = surfaceLevel(clampLevel(level));
+        float xmu = 1.0f / raw_dimension[0];
+        float ymu = 1.0f / raw_dimension[1];
+        float zmu = 1.0f / raw_dimension[2];
         glm::vec3 mu(xmu, ymu, zmu);
 
-        for (size_t i = 0; i < cells.size(); ++i) {
-            int cubeIndex = 0;
-            glm::vec3 vertList[12];
-            if(cells[i].val[0] < level) cubeIndex |= 1;
-            if(cells[i].val[1] < level) cubeIndex |= 2;
-            if(cells[i].val[2] < level) cubeIndex |= 4;
-            if(cells[i].val[3] < level) cubeIndex |= 8;
-            if(cells[i].val[4] < level) cubeIndex |= 16;
-            if(cells[i].val[5] < level) cubeIndex |= 32;
-            if(cells[i].val[6] < level) cubeIndex |= 64;
-            if(cells[i].val[7] < level) cubeIndex |= 128;
-
-            if(MCEdgeTable[cubeIndex] == 0) continue;
-            if(MCEdgeTable[cubeIndex] & 1)
-                vertList[0] = vertexLinear(level, cells[i], 0, 1);
-            if(MCEdgeTable[cubeIndex] & 2)
-                vertList[1] = vertexLinear(level, cells[i], 1, 2);
-            if(MCEdgeTable[cubeIndex] & 4)
-                vertList[2] = vertexLinear(level, cells[i], 2, 3);
-            if(MCEdgeTable[cubeIndex] & 8)
-                vertList[3] = vertexLinear(level, cells[i], 3, 0);
-            if(MCEdgeTable[cubeIndex] & 16)
-                vertList[4] = vertexLinear(level, cells[i], 4, 5);
-            if(MCEdgeTable[cubeIndex] & 32)
-                vertList[5] = vertexLinear(level, cells[i], 5, 6);
-            if(MCEdgeTable[cubeIndex] & 64)
-                vertList[6] = vertexLinear(level, cells[i], 6, 7);
-            if(MCEdgeTable[cubeIndex] & 128)
-                vertList[7] = vertexLinear(level, cells[i], 7, 4);
-            if(MCEdgeTable[cubeIndex] & 256)
-                vertList[8] = vertexLinear(level, cells[i], 0, 4);
-            if(MCEdgeTable[cubeIndex] & 512)
-                vertList[9] = vertexLinear(level, cells[i], 1, 5);
-            if(MCEdgeTable[cubeIndex] & 1024)
-                vertList[10] = vertexLinear(level, cells[i], 2, 6);
-            if(MCEdgeTable[cubeIndex] & 2048)
-                vertList[11] = vertexLinear(level, cells[i], 3, 7);
-
-                    /* cout<<"new cell"<< " "; */
-            for(size_t k = 0; MCTriTable[cubeIndex][k] != -1; k += 3) {
-                Face *f = new Face();
-                for(size_t j = 0; j < 3; j++) {
-                    int vId = MCTriTable[cubeIndex][k+j];
-                    int edgeId = 0;
-                    int x = cells[i].x;
-                    int y = cells[i].y;
-                    int z = cells[i].z;
-                    int dx = cells_dimension[0] + 1;
-                    int dy = cells_dimension[1] + 1;
-                    if(vId == 0) {
-                        edgeId = index(x, y, z, dx, dy) * 3 + 0;
-                    } else if(vId == 3) {
-                        edgeId = index(x, y, z, dx, dy) * 3 + 1;
-                    } else if(vId == 8) {
-                        edgeId = index(x, y, z, dx, dy) * 3 + 2;
-                    } else if(vId == 4) {
-                        edgeId = index(x, y, z+1, dx, dy) * 3 + 0;
-                    } else if(vId == 7) {
-                        edgeId = index(x, y, z+1, dx, dy) * 3 + 1;
-                    } else if(vId == 1) {
-                        edgeId = index(x+1, y, z, dx, dy) * 3 + 1;
-                    } else if(vId == 9) {
-                        edgeId = index(x+1, y, z, dx, dy) * 3 + 2;
-                    } else if(vId == 2) {
-                        edgeId = index(x, y+1, z, dx, dy) * 3 + 0;
-                    } else if(vId == 11) {
-                        edgeId = index(x, y+1, z, dx, dy) * 3 + 2;
-                    } else if(vId == 10) {
-                        edgeId = index(x+1, y+1, z, dx, dy) * 3 + 2;
-                    } else if(vId == 5) {
-                        edgeId = index(x+1, y, z+1, dx, dy) * 3 + 1;
-                    } else if(vId == 6) {
-                        edgeId = index(x, y+1, z+1, dx, dy) * 3 + 0;
-                    }
-                    /* cout<<vId<<">"<<edgeId<< " "; */
-                    Intersection *point = intersections[edgeId];
-                    if(!point) {
-                        point = new Intersection();
-                        intersections[edgeId] = point;
+        int dx = grid_dimension[0];
+        int dy = grid_dimension[1];
+        for(int z = 0; z < grid_dimension[2] - 1; z++) {
+            for(int y = 0; y < dy - 1; y++) {
+                for(int x = 0; x < dx - 1; x++) {
+                    float val[8];
+                    int cubeIndex = cellIndex(x, y, z, level, val);
+                    if(MCEdgeTable[cubeIndex] == 0) continue;
+
+                    // Corner positions are only needed for cells on the surface
+                    glm::vec3 p[8];
+                    cellCorners(x, y, z, p);
+
+                    glm::vec3 vertList[12];
+                    if(MCEdgeTable[cubeIndex] & 1)
+                        vertList[0] = vertexLinear(level, p, val, 0, 1);
+                    if(MCEdgeTable[cubeIndex] & 2)
+                        vertList[1] = vertexLinear(level, p, val, 1, 2);
+                    if(MCEdgeTable[cubeIndex] & 4)
+                        vertList[2] = vertexLinear(level, p, val, 2, 3);
+                    if(MCEdgeTable[cubeIndex] & 8)
+                        vertList[3] = vertexLinear(level, p, val, 3, 0);
+                    if(MCEdgeTable[cubeIndex] & 16)
+                        vertList[4] = vertexLinear(level, p, val, 4, 5);
+                    if(MCEdgeTable[cubeIndex] & 32)
+                        vertList[5] = vertexLinear(level, p, val, 5, 6);
+                    if(MCEdgeTable[cubeIndex] & 64)
+                        vertList[6] = vertexLinear(level, p, val, 6, 7);
+                    if(MCEdgeTable[cubeIndex] & 128)
+                        vertList[7] = vertexLinear(level, p, val, 7, 4);
+                    if(MCEdgeTable[cubeIndex] & 256)
+                        vertList[8] = vertexLinear(level, p, val, 0, 4);
+                    if(MCEdgeTable[cubeIndex] & 512)
+                        vertList[9] = vertexLinear(level, p, val, 1, 5);
+                    if(MCEdgeTable[cubeIndex] & 1024)
+                        vertList[10] = vertexLinear(level, p, val, 2, 6);
+                    if(MCEdgeTable[cubeIndex] & 2048)
+                        vertList[11] = vertexLinear(level, p, val, 3, 7);
+
+                    for(size_t k = 0; MCTriTable[cubeIndex][k] != -1; k += 3) {
+                        Face *f = new Face();
+                        for(size_t j = 0; j < 3; j++) {
+                            int vId = MCTriTable[cubeIndex][k+j];
+                            int edgeId = 0;
+                            if(vId == 0) {
+                                edgeId = index(x, y, z, dx, dy) * 3 + 0;
+                            } else if(vId == 3) {
+                                edgeId = index(x, y, z, dx, dy) * 3 + 1;
+                            } else if(vId == 8) {
+                                edgeId = index(x, y, z, dx, dy) * 3 + 2;
+                            } else if(vId == 4) {
+                                edgeId = index(x, y, z+1, dx, dy) * 3 + 0;
+                            } else if(vId == 7) {
+                                edgeId = index(x, y, z+1, dx, dy) * 3 + 1;
+                            } else if(vId == 1) {
+                                edgeId = index(x+1, y, z, dx, dy) * 3 + 1;
+                            } else if(vId == 9) {
+                                edgeId = index(x+1, y, z, dx, dy) * 3 + 2;
+                            } else if(vId == 2) {
+                                edgeId = index(x, y+1, z, dx, dy) * 3 + 0;
+                            } else if(vId == 11) {
+                                edgeId = index(x, y+1, z, dx, dy) * 3 + 2;
+                            } else if(vId == 10) {
+                                edgeId = index(x+1, y+1, z, dx, dy) * 3 + 2;
+                            } else if(vId == 5) {
+                                edgeId = index(x+1, y, z+1, dx, dy) * 3 + 1;
+                            } else if(vId == 6) {
+                                edgeId = index(x, y+1, z+1, dx, dy) * 3 + 0;
+                            }
+                            /* cout<<vId<<">"<<edgeId<< " "; */
+                            Intersection *point = intersections[edgeId];
+                            if(!point) {
+                                point = new Intersection();
+                                intersections[edgeId] = point;
+                            }
+                            point->position = vertList[vId];
+                            if(normalSource == FaceNormals) {
+                                point->faceList.push_back(f);
+                            }
+                            f->iList[j] = point;
+                        }
+                
+                        glm::vec3 cross = glm::cross(f->iList[1]->position - f->iList[0]->position, f->iList[2]->position - f->iList[0]->position);
+                        f->normal = glm::normalize(cross);
+                        faces.push_back(f);
                     }
-                    point->position = vertList[vId];
-                    point->faceList.push_back(f);
-                    f->iList[j] = point;
                 }
-                
-                glm::vec3 cross = glm::cross(f->iList[1]->position - f->iList[0]->position, f->iList[2]->position - f->iList[0]->position);
-                f->normal = glm::normalize(cross);
-                faces.push_back(f);
             }
         }
 
         for(auto const& i : intersections) {
             Intersection *point = i.second;
             glm::vec3 normal(0.0f);
+            if(normalSource != FaceNormals) {
+                // The key is the edge, see above
+                size_t cell = i.first / 3;
+                edgeVertex(level, cell % dx, cell / dx % dy, cell / ((size_t)dx * dy), i.first % 3, &normal);
+            }
             /* cout << "int" <<endl; */
             for(size_t j = 0; j < point->faceList.size(); j++) {
                 /* cout << point->faceList[j]->normal.x <<" "; */
@@ -245,6 +556,177 @@ public:
         return faces;
     }
 
+    // Run constructIndexed on this many threads, 1 keeps it on the calling thread
+    void setThreads(size_t threads) {
+        pool.reset(threads > 1 ? new ThreadPool(threads) : nullptr);
+    }
+
+    // Extract the surface into shared vertices and an index buffer. Vertices are
+    // deduplicated through the edges of the two grid slices bounding the
+    // current layer of cells instead of a hash map over the whole grid.
+    // With threads the grid is split into z-slabs; the output is the same
+    // byte for byte as the single threaded one
+    void constructIndexed(float level, IndexedMesh &mesh) {
+        level = prepareLevel(level);
+        mesh.clear();
+
+        int layers = grid_dimension[2] - 1;
+        if(!pool) {
+            Slab slab;
+            slab.z0 = 0;
+            slab.z1 = layers;
+            emitSlab(level, slab, mesh, true);
+            if(!cancelled()) {
+                finishVertices(mesh, 0, mesh.positions.size());
+            }
+            return;
+        }
+
+        // Count the exact output of every slab so each one can fill its own
+        // range of the buffers
+        size_t slabCount = min((size_t)layers, pool->size() * 4);
+        vector<Slab> slabs(slabCount);
+        for(size_t i = 0; i < slabCount; i++) {
+            slabs[i].z0 = layers * i / slabCount;
+            slabs[i].z1 = layers * (i + 1) / slabCount;
+        }
+        pool->parallelFor(slabCount, [&](size_t i) {
+            countSlab(level, slabs[i]);
+        });
+        if(cancelled()) {
+            return;
+        }
+        size_t vertices = 0, triangles = 0;
+        for(Slab &slab : slabs) {
+            slab.vertexBase = vertices;
+            slab.indexBase = triangles * 3;
+            vertices += slab.vertexCount;
+            triangles += slab.triangleCount;
+        }
+        mesh.positions.resize(vertices);
+        mesh.normals.resize(vertices);
+        mesh.indices.resize(triangles * 3);
+
+        pool->parallelFor(slabCount, [&](size_t i) {
+            emitSlab(level, slabs[i], mesh, false);
+        });
+        if(cancelled()) {
+            return;
+        }
+
+        // Stitch the vertices on the plane between two slabs, they belong to
+        // the lower slab and the upper one only referenced them
+        pool->parallelFor(slabCount, [&](size_t i) {
+            if(i == 0) {
+                return;
+            }
+            const vector<uint32_t> &below = slabs[i - 1].top;
+            for(auto const& patch : slabs[i].patches) {
+                mesh.indices[patch.first] = below[patch.second];
+            }
+            for(auto const& normal : slabs[i].sharedNormals) {
+                mesh.normals[below[normal.first]] += normal.second;
+            }
+        });
+        pool->parallelFor(slabCount, [&](size_t i) {
+            finishVertices(mesh, slabs[i].vertexBase, slabs[i].vertexBase + slabs[i].vertexCount);
+        });
+    }
+
+    // Extract the surface like constructIndexed but hand it to writer slab by
+    // slab as soon as the vertices of a slab are final, so only a few slabs
+    // of the mesh are in memory at once. The file holds the same mesh
+    // constructIndexed builds. False when cancelled
+    bool constructStreamed(float level, MeshWriter &writer) {
+        level = prepareLevel(level);
+        auto run = [&](size_t count, const function<void(size_t)> &task) {
+            if(pool) {
+                pool->parallelFor(count, task);
+            } else {
+                for(size_t i = 0; i < count; i++) {
+                    task(i);
+                }
+            }
+        };
+
+        int layers = grid_dimension[2] - 1;
+        size_t slabCount = max((size_t)1, (size_t)(layers + STREAM_LAYERS - 1) / STREAM_LAYERS);
+        vector<Slab> slabs(slabCount);
+        for(size_t i = 0; i < slabCount; i++) {
+            slabs[i].z0 = layers * i / slabCount;
+            slabs[i].z1 = layers * (i + 1) / slabCount;
+        }
+        run(slabCount, [&](size_t i) {
+            countSlab(level, slabs[i]);
+        });
+        if(cancelled()) {
+            return false;
+        }
+        size_t vertices = 0, triangles = 0;
+        for(Slab &slab : slabs) {
+            slab.vertexBase = slab.vertexOrigin = vertices;
+            slab.indexBase = slab.indexOrigin = triangles * 3;
+            vertices += slab.vertexCount;
+            triangles += slab.triangleCount;
+        }
+        if(!writer.begin(vertices, triangles)) {
+            return false;
+        }
+
+        // Slabs are emitted a batch at a time, each into a mesh of its own. A
+        // slab is written once the one above it added its normals, and
+        // freed once the one above that no longer needs its positions
+        vector<IndexedMesh> parts(slabCount);
+        auto chunkOf = [&](size_t i) {
+            const Slab &slab = slabs[i];
+            const IndexedMesh &part = parts[i];
+            MeshChunk chunk = { slab.vertexBase, part.positions.data(), part.normals.data(), part.positions.size(),
+                                slab.indexBase, part.indices.data(), part.indices.size() };
+            return chunk;
+        };
+        auto writeSlab = [&](size_t i) {
+            finishVertices(parts[i], 0, parts[i].positions.size());
+            MeshChunk before, chunk = chunkOf(i);
+            if(i > 0) {
+                before = chunkOf(i - 1);
+            }
+            bool ok = writer.write(chunk, i > 0 ? &before : nullptr);
+            if(i > 0) {
+                parts[i - 1] = IndexedMesh();
+            }
+            return ok;
+        };
+        size_t batch = pool ? pool->size() : 1;
+        for(size_t first = 0; first < slabCount; first += batch) {
+            size_t count = min(batch, slabCount - first);
+            run(count, [&](size_t k) {
+                Slab &slab = slabs[first + k];
+                IndexedMesh &part = parts[first + k];
+                part.positions.resize(slab.vertexCount);
+                part.normals.resize(slab.vertexCount);
+                part.indices.resize(slab.triangleCount * 3);
+                emitSlab(level, slab, part, false);
+            });
+            if(cancelled()) {
+                return false;
+            }
+            for(size_t i = max(first, (size_t)1); i < first + count; i++) {
+                Slab &below = slabs[i - 1];
+                for(auto const& patch : slabs[i].patches) {
+                    parts[i].indices[patch.first - slabs[i].indexOrigin] = below.top[patch.second];
+                }
+                for(auto const& normal : slabs[i].sharedNormals) {
+                    parts[i - 1].normals[below.top[normal.first] - below.vertexOrigin] += normal.second;
+                }
+                vector<uint32_t>().swap(below.top);
+                if(!writeSlab(i - 1)) {
+                    return false;
+                }
+            }
+        }
+        return writeSlab(slabCount - 1);
+    }
+
     void cleanUp() {
         for(auto const& i : intersections) {
             delete i.second;
@@ -258,67 +740,583 @@ public:
 
 
 private:
-    GLfloat trilinear(GLfloat x, GLfloat y, GLfloat z) {
-        /* GLfloat sx = x * (raw_dimension[0] - 1); */
-        /* GLfloat sy = y * (raw_dimension[1] - 1); */
-        /* GLfloat sz = z * (raw_dimension[2] - 1); */
-        int v0x = floor(x);
-        int v0y = floor(y);
-        int v0z = floor(z);
-        if(v0x >= raw_dimension[0]-1)
-            v0x = raw_dimension[0]-2;
-        if(v0y >= raw_dimension[1]-1)
-            v0y = raw_dimension[1]-2;
-        if(v0z >= raw_dimension[2]-1)
-            v0z = raw_dimension[2]-2;
-        GLfloat lx = x - v0x; 
-        GLfloat ly = y - v0y; 
-        GLfloat lz = z - v0z; 
-
-        /* cout << sx <<endl<< sy<<endl << sz <<endl; */
-        /* cout << lx <<endl<< ly<<endl << lz <<endl; */
-        /* cout << v0x <<endl<< v0y<<endl << v0z <<endl; */
-        /* cout << raw(v0x, v0y, v0z)<<endl; */
-
-        GLfloat vxyz = raw(v0x, v0y, v0z)*(1-lx)*(1-ly)*(1-lz) +
-            raw(v0x+1, v0y, v0z)*lx*(1-ly)*(1-lz) +
-            raw(v0x+1, v0y+1, v0z)*lx*ly*(1-lz) +
-            raw(v0x+1, v0y+1, v0z+1)*lx*ly*lz +
-            raw(v0x, v0y+1, v0z+1)*(1-lx)*ly*lz +
-            raw(v0x, v0y, v0z+1)*(1-lx)*(1-ly)*lz +
-            raw(v0x+1, v0y, v0z+1)*lx*(1-ly)*lz +
-            raw(v0x, v0y+1, v0z)*(1-lx)*ly*(1-lz);
-
-        return vxyz / 255.0f;
-    }
-
-    GLfloat raw(int x, int y, int z) {
-        size_t index = z*raw_dimension[0]*raw_dimension[1] + y*raw_dimension[0] + x;
-        return raw_data[index];
-    }
-
-    int index(int x, int y, int z, int xsi, int ysi) {
-        return xsi*ysi*z + xsi*y + x;
-    }
-
-    glm::vec3 vertexLinear(GLfloat level, Cell cell, int p1, int p2) {
-        GLfloat pos = (level - cell.val[p1]) / (cell.val[p2] - cell.val[p1]);
-        return cell.p[p1] + pos * (cell.p[p2] - cell.p[p1]);
-    }
-
-    GLubyte* load_3d_raw_data(std::string texture_path) {
-        FILE *fp;
-        GLubyte *data = new GLubyte[raw_size];			  // 8bit
-        if (!(fp = fopen(texture_path.c_str(), "rb"))) {
-            std::cout << "Error: opening .raw file failed" << std::endl;
-            exit(EXIT_FAILURE);
+    // Fill the inside of the grid with samples of a volume of type T, in
+    // z-slabs on the pool. Every grid point gets the same value for any
+    // number of slabs
+    template <typename T>
+    void resample() {
+        size_t xsi = grid_dimension[0], ysi = grid_dimension[1];
+        int planes = axes[2].first.size();
+        float *inside = &grid[index(1, 1, 1, xsi, ysi)];
+        float low = volume.rangeLow(), high = volume.rangeHigh();
+        size_t slabCount = pool ? min((size_t)planes, pool->size()) : 1;
+        auto slab = [&](size_t i) {
+            SlabResampler<T> resampler(volume.voxels<T>(), raw_dimension, axes);
+            resampler.run(planes * i / slabCount, planes * (i + 1) / slabCount, inside, xsi, xsi * ysi, low, high, cancel);
+        };
+        if(pool) {
+            pool->parallelFor(slabCount, slab);
+        } else {
+            slab(0);
+        }
+    }
+
+    // Map the smallest and largest voxel to 0 and 1
+    void scanRange() {
+        float low = 0.0f, high = 1.0f;
+        switch(volume.type()) {
+            case Uint8: volume.valueRange<uint8_t>(low, high); break;
+            case Uint16: volume.valueRange<uint16_t>(low, high); break;
+            case Int16: volume.valueRange<int16_t>(low, high); break;
+            case Float32: volume.valueRange<float>(low, high); break;
+        }
+        // A constant volume has no surface, any range will do
+        if(!(high > low)) {
+            high = low + 1.0f;
+        }
+        volume.setRange(low, high);
+    }
+
+    // A level in [0, 1] in the values the grid holds, the voxel values when
+    // native
+    float surfaceLevel(float level) const {
+        if(!native) {
+            return level;
+        }
+        return volume.rangeLow() + level * (volume.rangeHigh() - volume.rangeLow());
+    }
+
+    void buildIntervals() {
+        // Cells are numbered with 32 bits, larger grids use the pyramid
+        size_t cells = (size_t)(grid_dimension[0] - 1) * (grid_dimension[1] - 1) * (grid_dimension[2] - 1);
+        if(cells > numeric_limits<uint32_t>::max()) {
+            intervals.clear();
+            activeCells.clear();
+            return;
+        }
+        if(!native) {
+            intervals.build(grid, grid_dimension);
+            return;
+        }
+        vector<float> points;
+        intervals.build(grid_dimension, [&](int z) {
+            nativePlane(z, points);
+            return points.data();
+        }, volume.rangeLow(), volume.rangeHigh());
+    }
+
+    // Whether the cells crossing a level come from the interval index, it is
+    // not built for grids of more than 2^32 cells
+    bool indexed() const {
+        return useIntervals && !intervals.empty();
+    }
+
+    // Values of the points of plane z when native. The border has the value
+    // that maps to 0 like the border of zeros of a resampled grid
+    void nativePlane(int z, vector<float> &points) {
+        switch(volume.type()) {
+            case Uint8: nativePlane<uint8_t>(z, points); break;
+            case Uint16: nativePlane<uint16_t>(z, points); break;
+            case Int16: nativePlane<int16_t>(z, points); break;
+            case Float32: nativePlane<float>(z, points); break;
+        }
+    }
+
+    template <typename T>
+    void nativePlane(int z, vector<float> &points) {
+        int dx = grid_dimension[0];
+        int dy = grid_dimension[1];
+        points.assign((size_t)dx * dy, volume.rangeLow());
+        if(z == 0 || z == grid_dimension[2] - 1) {
+            return;
+        }
+        for(int y = 1; y < dy - 1; y++) {
+            const T *row = volume.voxels<T>() + ((size_t)(z - 1) * raw_dimension[1] + y - 1) * raw_dimension[0];
+            float *out = &points[(size_t)y * dx + 1];
+            for(int x = 0; x < raw_dimension[0]; x++) {
+                out[x] = (float)row[x];
+            }
+        }
+    }
+
+    // Value of grid point (x, y, z) when native
+    float nativeValue(int x, int y, int z) const {
+        if(x == 0 || y == 0 || z == 0 || x > raw_dimension[0] || y > raw_dimension[1] || z > raw_dimension[2]) {
+            return volume.rangeLow();
+        }
+        size_t i = ((size_t)(z - 1) * raw_dimension[1] + y - 1) * raw_dimension[0] + x - 1;
+        switch(volume.type()) {
+            case Uint8: return volume.voxels<uint8_t>()[i];
+            case Uint16: return volume.voxels<uint16_t>()[i];
+            case Int16: return volume.voxels<int16_t>()[i];
+            default: return volume.voxels<float>()[i];
+        }
+    }
+
+    size_t index(int x, int y, int z, int xsi, int ysi) {
+        return (size_t)xsi*ysi*z + xsi*y + x;
+    }
+
+    bool cancelled() const {
+        return cancel && cancel->load(memory_order_relaxed);
+    }
+
+    // Read the corner values of cell (x, y, z) and classify them against level
+    int cellIndex(int x, int y, int z, float level, float val[8]) {
+        int dx = grid_dimension[0];
+        int dy = grid_dimension[1];
+        if(native) {
+            val[0] = nativeValue(x, y, z);
+            val[1] = nativeValue(x + 1, y, z);
+            val[2] = nativeValue(x + 1, y + 1, z);
+            val[3] = nativeValue(x, y + 1, z);
+            val[4] = nativeValue(x, y, z + 1);
+            val[5] = nativeValue(x + 1, y, z + 1);
+            val[6] = nativeValue(x + 1, y + 1, z + 1);
+            val[7] = nativeValue(x, y + 1, z + 1);
+        } else {
+            size_t i0 = index(x, y, z, dx, dy);
+            size_t i4 = i0 + (size_t)dx * dy;
+            val[0] = grid[i0];
+            val[1] = grid[i0 + 1];
+            val[2] = grid[i0 + dx + 1];
+            val[3] = grid[i0 + dx];
+            val[4] = grid[i4];
+            val[5] = grid[i4 + 1];
+            val[6] = grid[i4 + dx + 1];
+            val[7] = grid[i4 + dx];
+        }
+
+        int cubeIndex = 0;
+        if(val[0] < level) cubeIndex |= 1;
+        if(val[1] < level) cubeIndex |= 2;
+        if(val[2] < level) cubeIndex |= 4;
+        if(val[3] < level) cubeIndex |= 8;
+        if(val[4] < level) cubeIndex |= 16;
+        if(val[5] < level) cubeIndex |= 32;
+        if(val[6] < level) cubeIndex |= 64;
+        if(val[7] < level) cubeIndex |= 128;
+        return cubeIndex;
+    }
+
+    // Crossing on the edge starting at grid point (x, y, z) along axis. Always
+    // interpolated from the lower end so every cell sharing it agrees. With
+    // normal the field gradient there is interpolated into it as well
+    glm::vec3 edgeVertex(float level, int x, int y, int z, int axis, glm::vec3 *normal = nullptr) {
+        int dx = grid_dimension[0];
+        int dy = grid_dimension[1];
+        float v0, v1;
+        if(native) {
+            v0 = nativeValue(x, y, z);
+            v1 = nativeValue(x + (axis == 0), y + (axis == 1), z + (axis == 2));
+        } else {
+            size_t i0 = index(x, y, z, dx, dy);
+            size_t i1 = i0 + (axis == 0 ? 1 : axis == 1 ? dx : (size_t)dx * dy);
+            v0 = grid[i0];
+            v1 = grid[i1];
+        }
+        float t = (level - v0) / (v1 - v0);
+        glm::vec3 p(spacing[0]*x, spacing[1]*y, spacing[2]*z);
+        p[axis] += t * spacing[axis];
+        if(normal) {
+            // Values rise into the volume, so the surface faces down the gradient
+            glm::vec3 g0 = gradient(x, y, z);
+            glm::vec3 g1 = gradient(x + (axis == 0), y + (axis == 1), z + (axis == 2));
+            *normal = -(g0 + t * (g1 - g0));
         }
-        if (fread(data, sizeof(char), raw_size, fp) != raw_size) {
-            std::cout << "Error: read .raw file failed" << std::endl;
-            exit(1);
+        return p;
+    }
+
+    // Value of grid point (x, y, z), clamped to the grid
+    float gridValue(int x, int y, int z) const {
+        x = min(max(x, 0), grid_dimension[0] - 1);
+        y = min(max(y, 0), grid_dimension[1] - 1);
+        z = min(max(z, 0), grid_dimension[2] - 1);
+        if(native) {
+            return nativeValue(x, y, z);
         }
-        fclose(fp);
-        return data;
+        return grid[((size_t)z * grid_dimension[1] + y) * grid_dimension[0] + x];
+    }
+
+    // Gradient of the field at grid point (x, y, z) per unit of position, one
+    // sided on the faces of the grid
+    glm::vec3 gradient(int x, int y, int z) const {
+        glm::vec3 g;
+        if(normalSource == Sobel) {
+            // Difference along each axis smoothed by 1 2 1 along the other two
+            static const float smooth[3] = { 1.0f, 2.0f, 1.0f };
+            g = glm::vec3(0.0f);
+            for(int k = -1; k <= 1; k++) {
+                for(int j = -1; j <= 1; j++) {
+                    float w = smooth[j + 1] * smooth[k + 1];
+                    g.x += w * (gridValue(x + 1, y + j, z + k) - gridValue(x - 1, y + j, z + k));
+                    g.y += w * (gridValue(x + j, y + 1, z + k) - gridValue(x + j, y - 1, z + k));
+                    g.z += w * (gridValue(x + j, y + k, z + 1) - gridValue(x + j, y + k, z - 1));
+                }
+            }
+            g /= 16.0f;
+        } else {
+            g.x = gridValue(x + 1, y, z) - gridValue(x - 1, y, z);
+            g.y = gridValue(x, y + 1, z) - gridValue(x, y - 1, z);
+            g.z = gridValue(x, y, z + 1) - gridValue(x, y, z - 1);
+        }
+        for(int i = 0; i < 3; i++) {
+            int steps = 2;
+            int at = i == 0 ? x : i == 1 ? y : z;
+            if(at == 0 || at == grid_dimension[i] - 1) {
+                steps = 1;
+            }
+            g[i] /= steps * spacing[i];
+        }
+        return g;
+    }
+
+    // Live cell ranges along x for every block row of block layer bz, runs
+    // of adjacent live blocks are merged
+    void blockRuns(int bz, Layer &layer) {
+        const int *blocks = pyramid.blocks();
+        int cells = grid_dimension[0] - 1;
+        layer.runs.resize(blocks[1]);
+        layer.blockLayer = bz;
+        layer.empty = true;
+        for(int by = 0; by < blocks[1]; by++) {
+            vector<pair<int, int>> &runs = layer.runs[by];
+            runs.clear();
+            for(int bx = 0; bx < blocks[0]; bx++) {
+                if(!liveBlocks[((size_t)bz * blocks[1] + by) * blocks[0] + bx]) continue;
+                int x0 = bx * MinMaxPyramid::BLOCK;
+                int x1 = min(x0 + MinMaxPyramid::BLOCK, cells);
+                if(!runs.empty() && runs.back().second == x0) {
+                    runs.back().second = x1;
+                } else {
+                    runs.push_back(make_pair(x0, x1));
+                }
+            }
+            layer.empty = layer.empty && runs.empty();
+        }
+    }
+
+    // Classify the grid points of plane z covered by the live runs against
+    // level, 0xff where below. Other points of the mask are left as they are
+    void classifyPlane(int z, float level, const Layer &layer, vector<uint8_t> &mask) {
+        int dx = grid_dimension[0];
+        int dy = grid_dimension[1];
+        mask.resize((size_t)dx * dy);
+        for(size_t by = 0; by < layer.runs.size(); by++) {
+            int y0 = by * MinMaxPyramid::BLOCK;
+            int y1 = min(y0 + MinMaxPyramid::BLOCK, dy - 1);
+            for(auto const& run : layer.runs[by]) {
+                for(int y = y0; y <= y1; y++) {
+                    if(native) {
+                        classifyVoxels(run.first, run.second, y, z, level, &mask[(size_t)y * dx]);
+                    } else {
+                        classifier().belowMask(&grid[index(run.first, y, z, dx, dy)], run.second - run.first + 1,
+                            level, &mask[(size_t)y * dx + run.first]);
+                    }
+                }
+            }
+        }
+    }
+
+    // Classify grid points x0..x1 of row (y, z) when native, straight from the
+    // voxels against threshold, or level for float voxels. The border is below
+    void classifyVoxels(int x0, int x1, int y, int z, float level, uint8_t *mask) {
+        if(y == 0 || z == 0 || y > raw_dimension[1] || z > raw_dimension[2]) {
+            fill(mask + x0, mask + x1 + 1, (uint8_t)0xff);
+            return;
+        }
+        if(x0 == 0) {
+            mask[x0++] = 0xff;
+        }
+        if(x1 > raw_dimension[0]) {
+            mask[x1--] = 0xff;
+        }
+        if(x0 > x1) {
+            return;
+        }
+        size_t i = ((size_t)(z - 1) * raw_dimension[1] + y - 1) * raw_dimension[0] + x0 - 1;
+        size_t n = x1 - x0 + 1;
+        const Classifier &c = classifier();
+        switch(volume.type()) {
+            case Uint8: c.belowMaskU8(volume.voxels<uint8_t>() + i, n, threshold, mask + x0); break;
+            case Uint16: c.belowMaskU16(volume.voxels<uint16_t>() + i, n, threshold, mask + x0); break;
+            case Int16: c.belowMaskI16(volume.voxels<int16_t>() + i, n, threshold, mask + x0); break;
+            case Float32: c.belowMask(volume.voxels<float>() + i, n, level, mask + x0); break;
+        }
+    }
+
+    // Collect the cells of the live runs between the planes classified in
+    // lower and upper that intersect the surface, in scan order
+    void findActive(const vector<uint8_t> &lower, const vector<uint8_t> &upper, Layer &layer) {
+        int dx = grid_dimension[0];
+        int dy = grid_dimension[1];
+        layer.active.clear();
+        layer.rowCube.resize(dx - 1);
+        layer.rowActive.resize(dx - 1);
+        for(int y = 0; y < dy - 1; y++) {
+            size_t row = (size_t)y * dx;
+            for(auto const& run : layer.runs[y / MinMaxPyramid::BLOCK]) {
+                size_t x0 = run.first;
+                size_t n = classifier().cubeRow(&lower[row + x0], &lower[row + dx + x0], &upper[row + x0], &upper[row + dx + x0],
+                    run.second - x0, &layer.rowCube[x0], &layer.rowActive[0]);
+                for(size_t i = 0; i < n; i++) {
+                    int x = x0 + layer.rowActive[i];
+                    layer.active.push_back({ x, y, layer.rowCube[x] });
+                }
+            }
+        }
+    }
+
+    // Classify the next layer of cells z, reusing the masks of plane z when the
+    // layer is in the same block layer as the last one, or take its cells from
+    // the interval index when that is on. Returns false when no block of the
+    // layer can hold the surface
+    bool classifyLayer(int z, float level, Layer &layer, vector<uint8_t> &mask, vector<uint8_t> &next) {
+        if(indexed()) {
+            return indexedLayer(z, level, layer);
+        }
+        int bz = z / MinMaxPyramid::BLOCK;
+        if(bz != layer.blockLayer) {
+            blockRuns(bz, layer);
+            classifyPlane(z, level, layer, mask);
+        }
+        if(layer.empty) {
+            return false;
+        }
+        classifyPlane(z + 1, level, layer, next);
+        findActive(mask, next, layer);
+        return true;
+    }
+
+    // Bring the sorted list of cells crossing level up to date, through the
+    // cells that changed since the last level when there is one
+    void updateActive(float level) {
+        if(!activeKnown) {
+            activeCells.clear();
+            intervals.activeCells(level, activeCells);
+            sortCells(activeCells);
+        } else if(level != activeLevel) {
+            vector<uint32_t> added, removed, kept;
+            intervals.changedCells(activeLevel, level, added, removed);
+            sortCells(added);
+            sortCells(removed);
+            kept.reserve(activeCells.size() - removed.size());
+            set_difference(activeCells.begin(), activeCells.end(), removed.begin(), removed.end(), back_inserter(kept));
+            activeCells.clear();
+            merge(kept.begin(), kept.end(), added.begin(), added.end(), back_inserter(activeCells));
+        }
+        activeLevel = level;
+        activeKnown = true;
+
+        size_t layerCells = (size_t)(grid_dimension[0] - 1) * (grid_dimension[1] - 1);
+        int layers = grid_dimension[2] - 1;
+        layerStarts.resize(layers + 1);
+        size_t i = 0;
+        for(int z = 0; z <= layers; z++) {
+            while(i < activeCells.size() && activeCells[i] < z * layerCells) {
+                i++;
+            }
+            layerStarts[z] = i;
+        }
+    }
+
+    // Active cells of layer z from the list kept by updateActive
+    bool indexedLayer(int z, float level, Layer &layer) {
+        int cells = grid_dimension[0] - 1;
+        size_t layerCells = (size_t)cells * (grid_dimension[1] - 1);
+        layer.active.clear();
+        for(size_t i = layerStarts[z]; i < layerStarts[z + 1]; i++) {
+            size_t rest = activeCells[i] - z * layerCells;
+            int x = rest % cells;
+            int y = rest / cells;
+            float val[8];
+            layer.active.push_back({ x, y, (uint8_t)cellIndex(x, y, z, level, val) });
+        }
+        return !layer.active.empty();
+    }
+
+    // Edges a cell only owns when it is the first cell along x, y or z: the
+    // edges on its lower face in that axis, which the cell before it also has
+    static const int *edgesOnLowerFace() {
+        // Built once, thread safe as slabs are counted in parallel
+        static const array<int, 3> faces = []() {
+            array<int, 3> masks = {{ 0, 0, 0 }};
+            for(int e = 0; e < 12; e++) {
+                for(int axis = 0; axis < 3; axis++) {
+                    if(MCEdgeOrigin[e][3] != axis && MCEdgeOrigin[e][axis] == 0) {
+                        masks[axis] |= 1 << e;
+                    }
+                }
+            }
+            return masks;
+        }();
+        return faces.data();
+    }
+
+    // Number of triangles the lookup table emits for a cube index
+    static int triangleCount(int cubeIndex) {
+        int count = 0;
+        for(size_t k = 0; MCTriTable[cubeIndex][k] != -1; k += 3) {
+            count++;
+        }
+        return count;
+    }
+
+    // Map level into the voxel domain and find the cells or blocks crossing it
+    float prepareLevel(float level) {
+        level = surfaceLevel(clampLevel(level));
+        // Integer voxels are below level exactly when below its ceiling
+        if(native && volume.type() != Float32) {
+            threshold = (int)ceil(level);
+        }
+        if(indexed()) {
+            updateActive(level);
+        } else {
+            pyramid.activeBlocks(level, liveBlocks);
+        }
+        return level;
+    }
+
+    // Count the triangles of the cells in the slab and the crossed edges it owns.
+    // Every edge is counted by the first cell in scan order that has it, so
+    // the x and y edges on the first plane of a slab belong to the slab below
+    void countSlab(float level, Slab &slab) {
+        const int *lowerFace = edgesOnLowerFace();
+        Layer layer;
+        slab.triangleCount = 0;
+        slab.vertexCount = 0;
+        for(int z = slab.z0; z < slab.z1 && !cancelled(); z++) {
+            vector<uint8_t> &mask = layer.masks[(z - slab.z0) & 1];
+            vector<uint8_t> &next = layer.masks[(z - slab.z0 + 1) & 1];
+            if(!classifyLayer(z, level, layer, mask, next)) continue;
+
+            for(const ActiveCell &cell : layer.active) {
+                slab.triangleCount += triangleCount(cell.cube);
+                int edges = MCEdgeTable[cell.cube];
+                if(cell.x > 0) edges &= ~lowerFace[0];
+                if(cell.y > 0) edges &= ~lowerFace[1];
+                if(z > 0) edges &= ~lowerFace[2];
+                slab.vertexCount += __builtin_popcount(edges);
+            }
+        }
+    }
+
+    // Emit the triangles of the cells in the slab. When append is false the
+    // buffers are already sized and the slab writes from its bases onwards.
+    // Edges on the first plane owned by the slab below are left for stitching
+    void emitSlab(float level, Slab &slab, IndexedMesh &mesh, bool append) {
+        int dx = grid_dimension[0];
+        int dy = grid_dimension[1];
+        size_t plane = (size_t)dx * dy;
+        size_t nextVertex = slab.vertexBase;
+        size_t nextIndex = slab.indexBase;
+        bool gradientNormals = normalSource != FaceNormals;
+        // Vertex id of the x, y and z edge starting at each grid point
+        vector<uint32_t> slices[2];
+        slices[0].assign(plane * 3, NO_VERTEX);
+        slices[1].assign(plane * 3, NO_VERTEX);
+        Layer layer;
+
+        for(int z = slab.z0; z < slab.z1 && !cancelled(); z++) {
+            vector<uint32_t> *slice[2] = { &slices[(z - slab.z0) & 1], &slices[(z - slab.z0 + 1) & 1] };
+            fill(slice[1]->begin(), slice[1]->end(), NO_VERTEX);
+            vector<uint8_t> &mask = layer.masks[(z - slab.z0) & 1];
+            vector<uint8_t> &next = layer.masks[(z - slab.z0 + 1) & 1];
+            if(!classifyLayer(z, level, layer, mask, next)) continue;
+
+            for(const ActiveCell &cell : layer.active) {
+                int x = cell.x;
+                int y = cell.y;
+                int cubeIndex = cell.cube;
+                for(size_t k = 0; MCTriTable[cubeIndex][k] != -1; k += 3) {
+                    uint32_t tri[3];
+                    size_t slot[3];
+                    glm::vec3 p[3];
+                    for(size_t j = 0; j < 3; j++) {
+                        const int *e = MCEdgeOrigin[MCTriTable[cubeIndex][k+j]];
+                        slot[j] = ((size_t)(y + e[1]) * dx + x + e[0]) * 3 + e[3];
+                        if(slab.z0 > 0 && z == slab.z0 && e[2] == 0 && e[3] != 2) {
+                            // Shared with the slab below
+                            tri[j] = NO_VERTEX;
+                            p[j] = edgeVertex(level, x + e[0], y + e[1], z, e[3]);
+                            slab.patches.push_back(make_pair(nextIndex + j, slot[j]));
+                            continue;
+                        }
+                        uint32_t &id = (*slice[e[2]])[slot[j]];
+                        if(id == NO_VERTEX) {
+                            id = nextVertex++;
+                            glm::vec3 normal(0.0f);
+                            glm::vec3 v = edgeVertex(level, x + e[0], y + e[1], z + e[2], e[3], gradientNormals ? &normal : nullptr);
+                            if(append) {
+                                mesh.positions.push_back(v);
+                                mesh.normals.push_back(normal);
+                            } else {
+                                mesh.positions[id - slab.vertexOrigin] = v;
+                                mesh.normals[id - slab.vertexOrigin] = normal;
+                            }
+                        }
+                        tri[j] = id;
+                        p[j] = mesh.positions[id - slab.vertexOrigin];
+                    }
+
+                    glm::vec3 cross = glm::cross(p[1] - p[0], p[2] - p[0]);
+                    float length = glm::length(cross);
+                    for(size_t j = 0; j < 3; j++) {
+                        if(length > 0.0f && !gradientNormals) {
+                            if(tri[j] == NO_VERTEX) {
+                                slab.sharedNormals.push_back(make_pair(slot[j], cross / length));
+                            } else {
+                                mesh.normals[tri[j] - slab.vertexOrigin] += cross / length;
+                            }
+                        }
+                        if(append) {
+                            mesh.indices.push_back(tri[j]);
+                        } else {
+                            mesh.indices[nextIndex - slab.indexOrigin] = tri[j];
+                        }
+                        nextIndex++;
+                    }
+                }
+            }
+        }
+
+        // The x and y edges on the last plane are what the slab above shares
+        slab.top.swap(slices[(slab.z1 - slab.z0) & 1]);
+    }
+
+    // Normalize the accumulated normals and scale positions into the unit cube
+    void finishVertices(IndexedMesh &mesh, size_t begin, size_t end) {
+        glm::vec3 mu(1.0f / raw_dimension[0], 1.0f / raw_dimension[1], 1.0f / raw_dimension[2]);
+        for(size_t i = begin; i < end; i++) {
+            float length = glm::length(mesh.normals[i]);
+            if(length > 0.0f) {
+                mesh.normals[i] /= length;
+            }
+            mesh.positions[i] *= mu;
+        }
+    }
+
+    // Positions of the 8 corners of cell (x, y, z), in lookup table order
+    void cellCorners(int x, int y, int z, glm::vec3 p[8]) {
+        float x1 = spacing[0]*x;
+        float x2 = x1 + spacing[0];
+        float y1 = spacing[1]*y;
+        float y2 = y1 + spacing[1];
+        float z1 = spacing[2]*z;
+        float z2 = z1 + spacing[2];
+        p[0] = glm::vec3(x1, y1, z1);
+        p[1] = glm::vec3(x2, y1, z1);
+        p[2] = glm::vec3(x2, y2, z1);
+        p[3] = glm::vec3(x1, y2, z1);
+        p[4] = glm::vec3(x1, y1, z2);
+        p[5] = glm::vec3(x2, y1, z2);
+        p[6] = glm::vec3(x2, y2, z2);
+        p[7] = glm::vec3(x1, y2, z2);
+    }
+
+    glm::vec3 vertexLinear(float level, const glm::vec3 p[8], const float val[8], int p1, int p2) {
+        float pos = (level - val[p1]) / (val[p2] - val[p1]);
+        return p[p1] + pos * (p[p2] - p[p1]);
     }
 };
 
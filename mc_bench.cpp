@@ -0,0 +1,424 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+#include <cstdlib>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+#include "cli.h"
+#include "marchingcubes.h"
+#include "vertex.h"
+
+using namespace std;
+
+/**
+ * Extraction benchmark. Times setCuts, construct, cleanUp, vertex flattening
+ * and the single and multithreaded indexed extraction separately over a sweep of cuts and levels, writes the results as
+ * JSON and optionally compares them against a stored baseline. The first
+ * object of the JSON names the machine and build the times were taken on,
+ * times are only compared against a baseline from the same ones
+ */
+
+struct Volume {
+    string name;
+    vector<uint8_t> data;
+    int x, y, z;
+};
+
+struct Result {
+    string volume;
+    size_t cuts;
+    float level;
+    size_t triangles;
+    double setCuts, construct, cleanUp, flatten, indexed, parallel;
+};
+
+const int stageCount = 6;
+const char *stageNames[] = { "setCuts_ms", "construct_ms", "cleanUp_ms", "flatten_ms", "indexed_ms", "parallel_ms" };
+
+double stage(const Result &r, int i) {
+    switch(i) {
+        case 0: return r.setCuts;
+        case 1: return r.construct;
+        case 2: return r.cleanUp;
+        case 3: return r.flatten;
+        case 4: return r.indexed;
+        default: return r.parallel;
+    }
+}
+
+bool loadRaw(const string &path, Volume &volume) {
+    ifstream file(path, ios::binary);
+    if(!file) {
+        return false;
+    }
+    volume.data.resize(volume.x * volume.y * volume.z);
+    file.read((char*)&volume.data[0], volume.data.size());
+    return (size_t)file.gcount() == volume.data.size();
+}
+
+// Distance from the center, dense in the middle and empty outside the sphere
+Volume sphereVolume(int n) {
+    Volume v = { "sphere", vector<uint8_t>(n * n * n), n, n, n };
+    float c = (n - 1) * 0.5f;
+    for(int z = 0; z < n; z++)
+        for(int y = 0; y < n; y++)
+            for(int x = 0; x < n; x++) {
+                float d = sqrt((x-c)*(x-c) + (y-c)*(y-c) + (z-c)*(z-c)) / c;
+                v.data[(z*n + y)*n + x] = (uint8_t)(255.0f * max(0.0f, 1.0f - d));
+            }
+    return v;
+}
+
+// Gyroid, a surface that fills the whole volume
+Volume gyroidVolume(int n) {
+    Volume v = { "gyroid", vector<uint8_t>(n * n * n), n, n, n };
+    float f = 2.0f * 3.14159265f * 4.0f / n;
+    for(int z = 0; z < n; z++)
+        for(int y = 0; y < n; y++)
+            for(int x = 0; x < n; x++) {
+                float g = sin(x*f)*cos(y*f) + sin(y*f)*cos(z*f) + sin(z*f)*cos(x*f);
+                v.data[(z*n + y)*n + x] = (uint8_t)(255.0f * (g + 1.5f) / 3.0f);
+            }
+    return v;
+}
+
+// Run fn repeat times and return the fastest time in ms
+template <typename F>
+double timeBest(int repeat, F fn) {
+    double best = 0;
+    for(int i = 0; i < repeat; i++) {
+        auto start = chrono::steady_clock::now();
+        fn();
+        double t = millisecondsSince(start);
+        if(i == 0 || t < best) {
+            best = t;
+        }
+    }
+    return best;
+}
+
+// Where the times were taken, host, classify kernel and threads. Spaces,
+// quotes and commas are left out so readJson reads them back unchanged
+map<string, string> environment(size_t threads) {
+    string host = "unknown";
+#if defined(__unix__) || defined(__APPLE__)
+    char name[256] = {};
+    if(gethostname(name, sizeof(name) - 1) == 0 && name[0]) {
+        host = name;
+    }
+#endif
+    stringstream build;
+#if defined(__clang__)
+    build << "clang-" << __clang_major__ << "." << __clang_minor__;
+#elif defined(__GNUC__)
+    build << "gcc-" << __GNUC__ << "." << __GNUC_MINOR__;
+#elif defined(_MSC_VER)
+    build << "msvc-" << _MSC_VER;
+#else
+    build << "unknown";
+#endif
+#if defined(__OPTIMIZE__) || (defined(_MSC_VER) && defined(NDEBUG))
+    build << "-optimized";
+#else
+    build << "-unoptimized";
+#endif
+    map<string, string> env = {
+        { "host", host }, { "build", build.str() }, { "kernel", classifier().name }, { "threads", to_string(threads) }
+    };
+    for(auto &field : env) {
+        string &value = field.second;
+        value.erase(remove_if(value.begin(), value.end(), [](char c) { return c == ' ' || c == '"' || c == ','; }), value.end());
+    }
+    return env;
+}
+
+void writeJson(ostream &out, const map<string, string> &env, const vector<Result> &results) {
+    out << "[" << endl << "  {";
+    for(auto it = env.begin(); it != env.end(); ++it) {
+        out << (it == env.begin() ? "" : ", ") << "\"" << it->first << "\": \"" << it->second << "\"";
+    }
+    out << "}" << (results.empty() ? "" : ",") << endl;
+    for(size_t i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        out << "  {\"volume\": \"" << r.volume << "\", \"cuts\": " << r.cuts
+            << ", \"level\": " << r.level << ", \"triangles\": " << r.triangles;
+        for(int s = 0; s < stageCount; s++) {
+            out << ", \"" << stageNames[s] << "\": " << stage(r, s);
+        }
+        out << "}" << (i + 1 < results.size() ? "," : "") << endl;
+    }
+    out << "]" << endl;
+}
+
+// Read back the flat objects written by writeJson
+vector<map<string, string>> readJson(const string &path) {
+    vector<map<string, string>> objects;
+    ifstream file(path);
+    stringstream ss;
+    ss << file.rdbuf();
+    string text = ss.str();
+
+    size_t pos = 0;
+    while((pos = text.find('{', pos)) != string::npos) {
+        size_t end = text.find('}', pos);
+        if(end == string::npos) {
+            break;
+        }
+        map<string, string> object;
+        stringstream fields(text.substr(pos + 1, end - pos - 1));
+        string field;
+        while(getline(fields, field, ',')) {
+            size_t colon = field.find(':');
+            if(colon == string::npos) {
+                continue;
+            }
+            string key = field.substr(0, colon), value = field.substr(colon + 1);
+            key.erase(remove(key.begin(), key.end(), '"'), key.end());
+            key.erase(remove(key.begin(), key.end(), ' '), key.end());
+            value.erase(remove(value.begin(), value.end(), '"'), value.end());
+            value.erase(remove(value.begin(), value.end(), ' '), value.end());
+            object[key] = value;
+        }
+        objects.push_back(object);
+        pos = end;
+    }
+    return objects;
+}
+
+string resultKey(const string &volume, size_t cuts, float level) {
+    stringstream ss;
+    ss << volume << "/" << cuts << "/" << level;
+    return ss.str();
+}
+
+// Field key of a baseline entry as a number, false when it is missing or
+// not a number
+bool numberField(const map<string, string> &object, const string &key, double &value) {
+    auto it = object.find(key);
+    if(it == object.end() || it->second.empty()) {
+        return false;
+    }
+    char *end;
+    value = strtod(it->second.c_str(), &end);
+    return *end == '\0';
+}
+
+// Compare against the baseline, returns the number of regressions. Results
+// without a baseline entry and broken entries count as regressions. Times
+// only do when the baseline was taken on the same machine and build
+int compare(const vector<Result> &results, const map<string, string> &env, const string &path, double threshold, double floor) {
+    int regressions = 0;
+    map<string, map<string, string>> baseline;
+    map<string, string> recorded;
+    vector<map<string, string>> objects = readJson(path);
+    for(size_t i = 0; i < objects.size(); i++) {
+        map<string, string> &object = objects[i];
+        if(object.count("host")) {
+            recorded = object;
+            continue;
+        }
+        double cuts, level;
+        if(!object.count("volume") || !numberField(object, "cuts", cuts) || !numberField(object, "level", level)) {
+            cout << "Error: entry " << i << " of " << path << " has no valid volume, cuts or level" << endl;
+            regressions++;
+            continue;
+        }
+        baseline[resultKey(object["volume"], (size_t)cuts, (float)level)] = object;
+    }
+    if(baseline.empty()) {
+        cout << "Error: no baseline entries in " << path << endl;
+        return regressions + 1;
+    }
+
+    bool sameMachine = recorded == env;
+    if(!sameMachine) {
+        cout << "Baseline taken on";
+        for(auto &field : recorded) {
+            cout << " " << field.first << "=" << field.second;
+        }
+        cout << (recorded.empty() ? " an unknown machine" : "") << ", this run on";
+        for(auto &field : env) {
+            cout << " " << field.first << "=" << field.second;
+        }
+        cout << ": only triangle counts are compared, record a baseline here to compare times" << endl;
+    }
+
+    for(const Result &r : results) {
+        string key = resultKey(r.volume, r.cuts, r.level);
+        auto it = baseline.find(key);
+        if(it == baseline.end()) {
+            cout << "MISSING  " << key << " has no baseline entry" << endl;
+            regressions++;
+            continue;
+        }
+        double triangles;
+        if(!numberField(it->second, "triangles", triangles)) {
+            cout << "Error: baseline entry " << key << " has no valid triangles" << endl;
+            regressions++;
+        } else if((size_t)triangles != r.triangles) {
+            cout << "MISMATCH " << key << " triangles " << it->second["triangles"] << " -> " << r.triangles << endl;
+            regressions++;
+        }
+        for(int s = 0; s < stageCount; s++) {
+            if(!it->second.count(stageNames[s])) {
+                continue;
+            }
+            double before;
+            if(!numberField(it->second, stageNames[s], before)) {
+                cout << "Error: baseline entry " << key << " has no valid " << stageNames[s] << endl;
+                regressions++;
+                continue;
+            }
+            double after = stage(r, s);
+            bool slower = sameMachine && after > before * (1.0 + threshold) && after - before > floor;
+            if(slower) {
+                regressions++;
+            }
+            cout << (slower ? "REGRESS  " : sameMachine ? "ok       " : "         ") << key << " " << stageNames[s] << " "
+                 << before << " -> " << after << endl;
+        }
+    }
+    cout << regressions << " regression(s)" << endl;
+    return regressions;
+}
+
+void usage(const char *name) {
+    cout << "Usage: " << name << " [--volumes bucky,sphere,gyroid] [--cuts 32,64,128,256,512]"
+         << " [--levels 0.1,0.3,0.5] [--repeat 3] [--threads n] [--models models] [--out results.json]"
+         << " [--compare bench/baseline.json] [--threshold 0.15]" << endl;
+}
+
+int main(int argc, char **argv) {
+    vector<string> volumeNames = { "bucky", "sphere", "gyroid" };
+    vector<size_t> cuts = { 32, 64, 128, 256, 512 };
+    vector<float> levels = { 0.1f, 0.3f, 0.5f };
+    int repeat = 3;
+    size_t threads = max(1u, thread::hardware_concurrency());
+    string models = "models", out, baselinePath;
+    double threshold = 0.15;
+
+    for(int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(arg == "--volumes" && hasValue) {
+            volumeNames = parseList<string>(argv[++i]);
+        } else if(arg == "--cuts" && hasValue) {
+            // More cuts give grids larger than a vector can hold
+            if(!parseCounts(argv[++i], cuts, 1 << 20)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(arg == "--levels" && hasValue) {
+            levels = parseList<float>(argv[++i]);
+        } else if(arg == "--repeat" && hasValue) {
+            repeat = max(1, atoi(argv[++i]));
+        } else if(arg == "--threads" && hasValue) {
+            threads = max(1, atoi(argv[++i]));
+        } else if(arg == "--models" && hasValue) {
+            models = argv[++i];
+        } else if(arg == "--out" && hasValue) {
+            out = argv[++i];
+        } else if(arg == "--compare" && hasValue) {
+            baselinePath = argv[++i];
+        } else if(arg == "--threshold" && hasValue) {
+            threshold = atof(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    cout << "classify kernel " << classifier().name << ", " << threads << " thread(s)" << endl;
+
+    vector<Result> results;
+    for(const string &name : volumeNames) {
+        Volume volume;
+        if(name == "bucky") {
+            volume = { name, {}, 32, 32, 32 };
+            if(!loadRaw(models + "/Bucky_32_32_32.raw", volume)) {
+                cout << "Error: could not read " << models << "/Bucky_32_32_32.raw" << endl;
+                return 1;
+            }
+        } else if(name == "sphere") {
+            volume = sphereVolume(128);
+        } else if(name == "gyroid") {
+            volume = gyroidVolume(128);
+        } else {
+            cout << "Error: unknown volume " << name << endl;
+            return 1;
+        }
+
+        MarchingCubes mc;
+        mc.loadData(&volume.data[0], volume.x, volume.y, volume.z);
+
+        for(size_t c : cuts) {
+            if(c < 2) {
+                continue;
+            }
+            double setCutsTime = timeBest(repeat, [&]() { mc.setCuts(c); });
+
+            for(float level : levels) {
+                Result r = { name, c, level, 0, setCutsTime, 0, 0, 0, 0, 0 };
+                IndexedMesh surface;
+                for(int i = 0; i < repeat; i++) {
+                    auto start = chrono::steady_clock::now();
+                    vector<Face*> faces = mc.construct(level);
+                    double constructTime = millisecondsSince(start);
+
+                    start = chrono::steady_clock::now();
+                    vector<Vertex> vertices = flattenFaces(faces);
+                    double flattenTime = millisecondsSince(start);
+
+                    start = chrono::steady_clock::now();
+                    mc.cleanUp();
+                    double cleanUpTime = millisecondsSince(start);
+
+                    mc.setThreads(1);
+                    start = chrono::steady_clock::now();
+                    mc.constructIndexed(level, surface);
+                    double indexedTime = millisecondsSince(start);
+
+                    mc.setThreads(threads);
+                    start = chrono::steady_clock::now();
+                    mc.constructIndexed(level, surface);
+                    double parallelTime = millisecondsSince(start);
+
+                    r.triangles = faces.size();
+                    r.construct = i == 0 ? constructTime : min(r.construct, constructTime);
+                    r.flatten = i == 0 ? flattenTime : min(r.flatten, flattenTime);
+                    r.cleanUp = i == 0 ? cleanUpTime : min(r.cleanUp, cleanUpTime);
+                    r.indexed = i == 0 ? indexedTime : min(r.indexed, indexedTime);
+                    r.parallel = i == 0 ? parallelTime : min(r.parallel, parallelTime);
+                }
+                cout << name << " cuts " << c << " level " << level << ": " << r.triangles << " triangles, "
+                     << r.setCuts << " / " << r.construct << " / " << r.cleanUp << " / " << r.flatten
+                     << " / " << r.indexed << " / " << r.parallel
+                     << " ms (setCuts / construct / cleanUp / flatten / indexed / parallel)" << endl;
+                results.push_back(r);
+            }
+        }
+    }
+
+    map<string, string> env = environment(threads);
+    if(!out.empty()) {
+        ofstream file(out);
+        writeJson(file, env, results);
+    } else if(baselinePath.empty()) {
+        writeJson(cout, env, results);
+    }
+
+    if(!baselinePath.empty()) {
+        return compare(results, env, baselinePath, threshold, 0.5) > 0 ? 2 : 0;
+    }
+    return 0;
+}
@@ -0,0 +1,172 @@
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <cctype>
+
+#include "cli.h"
+#include "volume.h"
+#include "volumeheader.h"
+#include "brickedvolume.h"
+#include "marchingcubes.h"
+
+using namespace std;
+
+/**
+ * Converts a volume to the bricked format of brickedvolume.h. Takes anything
+ * mc_extract reads: a NRRD or MetaImage header, a Name_X_Y_Z.raw file, or an
+ * 8 bit .raw file followed by its dimensions. With --check the native
+ * surfaces at the given levels are extracted from both volumes, the way
+ * mc_extract --native would, and have to match bit for bit
+ */
+
+void usage(const char *name) {
+    cout << "Usage: " << name << " <volume.nrrd|.nhdr|.mhd|.mha|.raw> [<x> <y> <z>] <out.bvol> [--brick n] [--check 0.3,0.6]" << endl;
+}
+
+// Native surface of the volume at level with the given normals. Bricked
+// volumes only decode the bricks the level needs when the normals are face
+// normals, as in mc_extract
+bool nativeSurface(const VolumeInfo &info, float level, NormalSource normals, IndexedMesh &mesh) {
+    MarchingCubes mc;
+    mc.setNormalSource(normals);
+    if(info.bricked && normals == FaceNormals) {
+        mc.setLoadLevels(level, level);
+    }
+    if(!mc.loadVolume(info)) {
+        return false;
+    }
+    mc.setNativeResolution();
+    mc.constructIndexed(level, mesh);
+    return true;
+}
+
+template <typename T>
+size_t differences(const vector<T> &a, const vector<T> &b) {
+    size_t count = max(a.size(), b.size()) - min(a.size(), b.size());
+    for(size_t i = 0; i < min(a.size(), b.size()); i++) {
+        count += memcmp(&a[i], &b[i], sizeof(T)) != 0;
+    }
+    return count;
+}
+
+// Compare the native surfaces of the source volume and the bricked one
+bool check(const VolumeInfo &source, const string &outPath, const vector<float> &levels) {
+    VolumeInfo bricked;
+    if(!readVolumeInfo(outPath, bricked)) {
+        return false;
+    }
+    const NormalSource sources[] = { FaceNormals, CentralDifference, Sobel };
+    const char *names[] = { "face", "central", "sobel" };
+    bool same = true;
+    for(float level : levels) {
+        for(int n = 0; n < 3; n++) {
+            IndexedMesh expected, got;
+            if(!nativeSurface(source, level, sources[n], expected) || !nativeSurface(bricked, level, sources[n], got)) {
+                cout << "Error: loading the volumes to check failed" << endl;
+                return false;
+            }
+            size_t positions = differences(expected.positions, got.positions);
+            size_t normals = differences(expected.normals, got.normals);
+            size_t indices = differences(expected.indices, got.indices);
+            cout << "check level " << level << " " << names[n] << " normals: " << expected.triangleCount() << " triangles, ";
+            if(positions + normals + indices == 0) {
+                cout << "same" << endl;
+            } else {
+                cout << positions << " positions, " << normals << " normals, " << indices << " indices differ" << endl;
+                same = false;
+            }
+        }
+    }
+    if(!same) {
+        cout << "Error: " << outPath << " does not give the same surfaces as " << source.dataPath << endl;
+    }
+    return same;
+}
+
+int main(int argc, char **argv) {
+    if(argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    string path = argv[1];
+    VolumeInfo info;
+    int next = 2;
+    if(argc >= 6 && isdigit(argv[2][0]) && isdigit(argv[3][0]) && isdigit(argv[4][0])) {
+        info.dataPath = path;
+        info.dimension[0] = atoi(argv[2]);
+        info.dimension[1] = atoi(argv[3]);
+        info.dimension[2] = atoi(argv[4]);
+        info.hasRange = true;
+        next = 5;
+    } else if(!readVolumeInfo(path, info)) {
+        return 1;
+    }
+    string outPath = argv[next++];
+    int brick = BrickedVolume::BRICK;
+    vector<float> checkLevels;
+    for(int i = next; i < argc; i++) {
+        string arg = argv[i];
+        if(arg == "--brick" && i + 1 < argc) {
+            brick = atoi(argv[++i]);
+        } else if(arg == "--check" && i + 1 < argc) {
+            checkLevels = parseList<float>(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(brick < 2 || info.bricked) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(!BrickedVolume::brickFits(info.dimension, brick, info.type)) {
+        cout << "Error: bricks of " << brick << "^3 " << voxelTypeName(info.type) << " voxels do not fit the 4 GB a brick can hold" << endl;
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    VolumeSource volume;
+    if(!volume.load(info.dataPath, info.byteCount(), info.type, info.offset, volumeNeedsSwap(info))) {
+        cout << "Error: loading " << path << " failed" << endl;
+        return 1;
+    }
+    volume.advise(VolumeSource::Sequential);
+    // The same range MarchingCubes scans for volumes without one
+    float low = info.low, high = info.high;
+    if(!info.hasRange) {
+        switch(info.type) {
+            case Uint8: volume.valueRange<uint8_t>(low, high); break;
+            case Uint16: volume.valueRange<uint16_t>(low, high); break;
+            case Int16: volume.valueRange<int16_t>(low, high); break;
+            case Float32: volume.valueRange<float>(low, high); break;
+        }
+        if(!(high > low)) {
+            high = low + 1.0f;
+        }
+    }
+    if(!BrickedVolume::write(outPath, volume, info.dimension, low, high, brick)) {
+        return 1;
+    }
+
+    BrickedVolume written;
+    if(!written.open(outPath)) {
+        return 1;
+    }
+    size_t bytes = 0, constant = 0, compressed = 0;
+    for(const BrickedVolume::Brick &b : written.bricks()) {
+        bytes += b.bytes;
+        constant += b.encoding == BrickedVolume::Constant;
+        compressed += b.encoding == BrickedVolume::Compressed;
+    }
+    cout << path << " " << info.dimension[0] << "x" << info.dimension[1] << "x" << info.dimension[2] << " "
+         << voxelTypeName(info.type) << " -> " << outPath << " in " << millisecondsSince(start) << " ms" << endl;
+    cout << written.bricks().size() << " bricks of " << brick << "^3: " << constant << " constant, " << compressed
+         << " compressed; " << info.byteCount() << " -> " << bytes << " bytes of voxels" << endl;
+    volume.release();
+    if(!checkLevels.empty() && !check(info, outPath, checkLevels)) {
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,273 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cctype>
+
+#include "cli.h"
+#include "marchingcubes.h"
+#include "volumeheader.h"
+#include "streaming.h"
+#include "decimate.h"
+
+using namespace std;
+
+/**
+ * Headless extraction driver. Runs setCuts/construct for every combination of
+ * the given cuts and levels and prints timings and triangle counts. With
+ * --native the voxels are extracted at their own resolution instead of cuts,
+ * with --stream brick by brick into a PLY file, and with --export into a
+ * PLY, STL or OBJ file slab by slab as they are extracted. --decimate and
+ * --max-error simplify every mesh by quadric edge collapse.
+ * The volume is a NRRD or MetaImage header, a bricked .bvol file, a
+ * Name_X_Y_Z.raw file, or an 8 bit .raw file followed by its dimensions
+ */
+
+void usage(const char *name) {
+    cout << "Usage: " << name << " <volume.nrrd|.nhdr|.mhd|.mha|.bvol|.raw> [<x> <y> <z>] [--cuts 50,100] [--levels 0.1,0.5] [--threads n] [--filter trilinear|box|lanczos] [--normals face|central|sobel] [--index] [--legacy] [--native]"
+         << " [--stream out.ply] [--memory MB] [--export out.ply|.stl|.obj]"
+         << " [--decimate triangles] [--max-error e]" << endl;
+}
+
+int main(int argc, char **argv) {
+    if(argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    string path = argv[1];
+    VolumeInfo info;
+    int first = 2;
+    if(argc >= 5 && isdigit(argv[2][0]) && isdigit(argv[3][0]) && isdigit(argv[4][0])) {
+        info.dataPath = path;
+        info.dimension[0] = atoi(argv[2]);
+        info.dimension[1] = atoi(argv[3]);
+        info.dimension[2] = atoi(argv[4]);
+        info.hasRange = true;
+        first = 5;
+    } else if(!readVolumeInfo(path, info)) {
+        return 1;
+    }
+    vector<size_t> cuts = { 100 };
+    vector<float> levels = { 0.1f };
+    bool legacy = false;
+    bool index = false;
+    bool native = false;
+    ResampleFilter filter = Trilinear;
+    NormalSource normals = FaceNormals;
+    string streamPath;
+    string exportPath;
+    // Decimation target, off while both are unset
+    size_t decimateTo = 0;
+    float maxError = numeric_limits<float>::infinity();
+    bool decimating = false;
+    size_t memory = 256;
+    size_t threads = max(1u, thread::hardware_concurrency());
+
+    for(int i = first; i < argc; i++) {
+        string arg = argv[i];
+        if(arg == "--cuts" && i + 1 < argc) {
+            // More cuts give grids larger than a vector can hold
+            if(!parseCounts(argv[++i], cuts, 1 << 20)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(arg == "--levels" && i + 1 < argc) {
+            levels = parseList<float>(argv[++i]);
+        } else if(arg == "--threads" && i + 1 < argc) {
+            threads = max(1, atoi(argv[++i]));
+        } else if(arg == "--filter" && i + 1 < argc) {
+            string name = argv[++i];
+            if(name == "trilinear") {
+                filter = Trilinear;
+            } else if(name == "box") {
+                filter = Box;
+            } else if(name == "lanczos") {
+                filter = Lanczos;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(arg == "--normals" && i + 1 < argc) {
+            string name = argv[++i];
+            if(name == "face") {
+                normals = FaceNormals;
+            } else if(name == "central") {
+                normals = CentralDifference;
+            } else if(name == "sobel") {
+                normals = Sobel;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(arg == "--index") {
+            index = true;
+        } else if(arg == "--stream" && i + 1 < argc) {
+            streamPath = argv[++i];
+        } else if(arg == "--export" && i + 1 < argc) {
+            exportPath = argv[++i];
+        } else if(arg == "--decimate" && i + 1 < argc) {
+            decimateTo = atoi(argv[++i]);
+            decimating = true;
+        } else if(arg == "--max-error" && i + 1 < argc) {
+            maxError = atof(argv[++i]);
+            decimating = true;
+        } else if(arg == "--memory" && i + 1 < argc) {
+            memory = max(1, atoi(argv[++i]));
+        } else if(arg == "--legacy") {
+            legacy = true;
+        } else if(arg == "--native") {
+            native = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(info.dimension[0] < 2 || info.dimension[1] < 2 || info.dimension[2] < 2 || cuts.empty() || levels.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+    for(size_t c : cuts) {
+        if(c < 2) {
+            cout << "Error: cuts must be at least 2" << endl;
+            return 1;
+        }
+    }
+
+    if(native && !streamPath.empty()) {
+        cout << "Error: --native can not be streamed" << endl;
+        return 1;
+    }
+    // Streamed meshes have face normals and are written as they are
+    if(!streamPath.empty() && (!exportPath.empty() || normals != FaceNormals || decimating)) {
+        cout << "Error: --stream writes its own PLY with face normals, it can not be combined with --export, --normals, --decimate or --max-error" << endl;
+        return 1;
+    }
+    if(!streamPath.empty()) {
+        if(cuts.size() != 1 || levels.size() != 1) {
+            cout << "Error: --stream takes a single cuts and level" << endl;
+            return 1;
+        }
+        StreamingExtractor streamer(info);
+        streamer.setMemoryBudget(memory << 20);
+        streamer.setResampleFilter(filter);
+        streamer.setCuts(cuts[0]);
+        auto start = chrono::steady_clock::now();
+        if(!streamer.extract(levels[0], streamPath)) {
+            return 1;
+        }
+        const StreamingExtractor::Stats &stats = streamer.statistics();
+        cout << "streamed " << stats.bricks << " bricks of " << stats.brickCells << "^3 cells in "
+             << millisecondsSince(start) << " ms, peak " << (stats.peakBytes >> 20) << " MB" << endl;
+        cout << stats.triangles << " triangles, " << stats.vertices << " vertices -> " << streamPath << endl;
+        return 0;
+    }
+
+    MeshFormat format = Ply;
+    if(!exportPath.empty()) {
+        if((!native && cuts.size() != 1) || levels.size() != 1) {
+            cout << "Error: --export takes a single cuts and level" << endl;
+            return 1;
+        }
+        if(legacy || !meshFormatOf(exportPath, format)) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    MarchingCubes mc;
+    mc.setThreads(threads);
+    mc.setIntervalIndex(index);
+    mc.setResampleFilter(filter);
+    mc.setNormalSource(normals);
+    if(native && normals == FaceNormals) {
+        // Native extraction with face normals is unchanged by skipping the
+        // bricks no level needs, gradients also read the voxels around them
+        mc.setLoadLevels(*min_element(levels.begin(), levels.end()), *max_element(levels.begin(), levels.end()));
+    }
+    auto start = chrono::steady_clock::now();
+    if(!mc.loadVolume(info)) {
+        cout << "Error: loading " << path << " failed" << endl;
+        return 1;
+    }
+    cout << "load " << path << " " << info.dimension[0] << "x" << info.dimension[1] << "x" << info.dimension[2] << " "
+         << voxelTypeName(info.type) << " " << millisecondsSince(start) << " ms" << (mc.volumeMapped() ? " (mapped)" : "") << endl;
+    cout << "classify kernel " << classifier().name << ", " << threads << " thread(s)" << endl;
+
+    // Cuts of 0 stand for the native resolution
+    if(native) {
+        cuts = { 0 };
+    }
+    IndexedMesh surface;
+    if(!exportPath.empty()) {
+        start = chrono::steady_clock::now();
+        if(native) {
+            mc.setNativeResolution();
+        } else {
+            mc.setCuts(cuts[0]);
+        }
+        double cutsTime = millisecondsSince(start);
+        start = chrono::steady_clock::now();
+        if(decimating) {
+            // Decimation needs the whole mesh, nothing to stream
+            IndexedMesh simplified;
+            mc.constructIndexed(levels[0], surface);
+            decimate(surface.positions.data(), surface.positions.size(), surface.indices.data(), surface.indices.size(),
+                     decimateTo, maxError, simplified);
+            cout << surface.triangleCount() << " -> " << simplified.triangleCount() << " triangles" << endl;
+            if(!exportMesh(exportPath, simplified.positions.data(), simplified.normals.data(), simplified.positions.size(),
+                           simplified.indices.data(), simplified.indices.size())) {
+                return 1;
+            }
+        } else {
+            MeshWriter writer;
+            if(!writer.open(exportPath) || !mc.constructStreamed(levels[0], writer) || !writer.close()) {
+                return 1;
+            }
+        }
+        cout << (native ? string("native") : to_string(cuts[0])) << "\t" << levels[0] << "\tsetCuts " << cutsTime << " ms\texport "
+             << millisecondsSince(start) << " ms -> " << exportPath << " (" << meshFormatName(format) << ")" << endl;
+        return 0;
+    }
+
+    cout << "cuts\tlevel\tsetCuts_ms\tconstruct_ms\ttriangles\tvertices" << (decimating ? "\tdecimate_ms\tdecimated" : "") << endl;
+    for(size_t c : cuts) {
+        start = chrono::steady_clock::now();
+        if(c == 0) {
+            mc.setNativeResolution();
+        } else {
+            mc.setCuts(c);
+        }
+        double cutsTime = millisecondsSince(start);
+
+        for(float level : levels) {
+            size_t triangles, vertices;
+            start = chrono::steady_clock::now();
+            if(legacy) {
+                vector<Face*> faces = mc.construct(level);
+                triangles = faces.size();
+                vertices = triangles * 3;
+            } else {
+                mc.constructIndexed(level, surface);
+                triangles = surface.triangleCount();
+                vertices = surface.positions.size();
+            }
+            double constructTime = millisecondsSince(start);
+
+            cout << (c == 0 ? string("native") : to_string(c)) << "\t" << level << "\t" << cutsTime << "\t" << constructTime << "\t" << triangles << "\t" << vertices;
+            if(decimating && !legacy) {
+                IndexedMesh simplified;
+                start = chrono::steady_clock::now();
+                decimate(surface.positions.data(), surface.positions.size(), surface.indices.data(), surface.indices.size(),
+                         decimateTo, maxError, simplified);
+                cout << "\t" << millisecondsSince(start) << "\t" << simplified.triangleCount();
+            }
+            cout << endl;
+            mc.cleanUp();
+        }
+    }
+
+    return 0;
+}
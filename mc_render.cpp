@@ -0,0 +1,372 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <cctype>
+
+// GLEW
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+// EGL, without the X11 types
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "cli.h"
+#include "shader.h"
+#include "mesh.h"
+#include "camera.h"
+#include "camerapath.h"
+#include "marchingcubes.h"
+#include "volumeheader.h"
+
+using namespace std;
+
+/**
+ * Offscreen render benchmark. Extracts a volume like the viewer does and
+ * replays a camera path (camerapath.h) with the viewer's shaders, colours
+ * and lights into a framebuffer object of an EGL context without a window,
+ * so it runs on render nodes and in CI, llvmpipe included. Every frame ends
+ * in glFinish and is timed from the camera update to there; the frame time
+ * percentiles are printed and with --out written as JSON. --dump writes
+ * every frame as a PPM image
+ */
+
+void usage(const char *name) {
+    cout << "Usage: " << name << " <volume.nrrd|.nhdr|.mhd|.mha|.bvol|.raw> [<x> <y> <z>] [--cuts 100 | --native] [--level 0.1]"
+         << " [--normals face|central|sobel] [--path bench/camera.path] [--size 1200x800] [--warmup 10]"
+         << " [--packed] [--no-cull] [--dump frames/frame] [--out results.json]" << endl;
+}
+
+// Surfaceless display and a 3.3 core context current without a surface
+bool createContext(EGLDisplay &display, EGLContext &context) {
+    // Mesa renders without a window system on the surfaceless platform
+    const char *extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    display = EGL_NO_DISPLAY;
+    if(extensions && strstr(extensions, "EGL_MESA_platform_surfaceless") && getPlatformDisplay) {
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    }
+    if(display == EGL_NO_DISPLAY) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    EGLint major, minor;
+    if(display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+        cout << "Error: no EGL display" << endl;
+        return false;
+    }
+    const EGLint configAttributes[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint configs = 0;
+    if(!eglChooseConfig(display, configAttributes, &config, 1, &configs) || configs == 0) {
+        cout << "Error: no EGL config for OpenGL" << endl;
+        return false;
+    }
+    const EGLint contextAttributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    eglBindAPI(EGL_OPENGL_API);
+    context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+    if(context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        cout << "Error: could not create an OpenGL 3.3 core context" << endl;
+        return false;
+    }
+    return true;
+}
+
+// Write the framebuffer as a binary PPM, top row first
+bool writeFrame(const string &path, int width, int height, vector<uint8_t> &pixels) {
+    pixels.resize((size_t)width * height * 3);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+    ofstream file(path, ios::binary);
+    file << "P6\n" << width << " " << height << "\n255\n";
+    for(int y = height - 1; y >= 0; y--) {
+        file.write((const char*)&pixels[(size_t)y * width * 3], width * 3);
+    }
+    if(!file) {
+        cout << "Error: could not write " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+// Nearest rank percentile of sorted frame times
+double percentile(const vector<double> &sorted, double p) {
+    size_t rank = (size_t)ceil(p / 100.0 * sorted.size());
+    return sorted[min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+int main(int argc, char **argv) {
+    if(argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    string path = argv[1];
+    VolumeInfo info;
+    int first = 2;
+    if(argc >= 5 && isdigit(argv[2][0]) && isdigit(argv[3][0]) && isdigit(argv[4][0])) {
+        info.dataPath = path;
+        info.dimension[0] = atoi(argv[2]);
+        info.dimension[1] = atoi(argv[3]);
+        info.dimension[2] = atoi(argv[4]);
+        info.hasRange = true;
+        first = 5;
+    } else if(!readVolumeInfo(path, info)) {
+        return 1;
+    }
+    // The viewer's defaults
+    int cuts = 100;
+    float level = 0.1f;
+    bool native = false;
+    NormalSource normals = FaceNormals;
+    string pathFile = "bench/camera.path";
+    int width = 1200, height = 800;
+    int warmup = 10;
+    bool packed = false;
+    bool cull = true;
+    string dumpPrefix;
+    string out;
+
+    for(int i = first; i < argc; i++) {
+        string arg = argv[i];
+        if(arg == "--cuts" && i + 1 < argc) {
+            cuts = atoi(argv[++i]);
+        } else if(arg == "--native") {
+            native = true;
+        } else if(arg == "--level" && i + 1 < argc) {
+            level = atof(argv[++i]);
+        } else if(arg == "--normals" && i + 1 < argc) {
+            string name = argv[++i];
+            if(name == "face") {
+                normals = FaceNormals;
+            } else if(name == "central") {
+                normals = CentralDifference;
+            } else if(name == "sobel") {
+                normals = Sobel;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(arg == "--path" && i + 1 < argc) {
+            pathFile = argv[++i];
+        } else if(arg == "--size" && i + 1 < argc) {
+            if(sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width < 1 || height < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if(arg == "--warmup" && i + 1 < argc) {
+            warmup = max(0, atoi(argv[++i]));
+        } else if(arg == "--packed") {
+            packed = true;
+        } else if(arg == "--no-cull") {
+            cull = false;
+        } else if(arg == "--dump" && i + 1 < argc) {
+            dumpPrefix = argv[++i];
+        } else if(arg == "--out" && i + 1 < argc) {
+            out = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(info.dimension[0] < 2 || info.dimension[1] < 2 || info.dimension[2] < 2 || (!native && cuts < 2)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    CameraPath cameraPath;
+    if(!cameraPath.load(pathFile)) {
+        return 1;
+    }
+    if(cameraPath.frameCount() == 0) {
+        cout << "Error: " << pathFile << " has no frames" << endl;
+        return 1;
+    }
+
+    EGLDisplay display;
+    EGLContext context;
+    if(!createContext(display, context)) {
+        return 1;
+    }
+    // GLEW built for GLX reports the missing GLX display after it loaded the
+    // GL entry points, so only the version counts
+    glewExperimental = GL_TRUE;
+    glewInit();
+    if(!GLEW_VERSION_3_3) {
+        cout << "Error: OpenGL 3.3 is not available" << endl;
+        return 1;
+    }
+    cout << "renderer " << glGetString(GL_RENDERER) << ", OpenGL " << glGetString(GL_VERSION) << endl;
+
+    // The default framebuffer of the viewer's window, without the window
+    GLuint framebuffer, color, depth;
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glGenRenderbuffers(1, &color);
+    glBindRenderbuffer(GL_RENDERBUFFER, color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+    glGenRenderbuffers(1, &depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        cout << "Error: framebuffer of " << width << "x" << height << " is incomplete" << endl;
+        return 1;
+    }
+    glViewport(0, 0, width, height);
+    glEnable(GL_PROGRAM_POINT_SIZE);
+
+    // The mesh the viewer would show, chunked for culling
+    MarchingCubes mc;
+    mc.setNormalSource(normals);
+    auto start = chrono::steady_clock::now();
+    if(!mc.loadVolume(info)) {
+        cout << "Error: loading " << path << " failed" << endl;
+        return 1;
+    }
+    if(native) {
+        mc.setNativeResolution();
+    } else {
+        mc.setCuts((size_t)cuts);
+    }
+    IndexedMesh surface;
+    mc.constructIndexed(level, surface);
+    chunkMesh(surface, mc.chunkSize());
+    cout << "extracted " << path << " in " << millisecondsSince(start) << " ms" << endl;
+
+    Shader shader("shader/basic.vert", "shader/basic.frag");
+    UniformBuffer<FrameUniforms> frame(0);
+    frame.attach(shader, "Frame");
+    Mesh mesh;
+    mesh.packVertices = packed;
+    mesh.cullChunks = cull;
+    mesh.createMesh(surface);
+
+    Camera camera;
+    glm::vec4 pointLightPosition = glm::vec4(camera.position.x, camera.position.y, camera.position.z, 0.0f);
+    glm::vec4 pointLight2Position = pointLightPosition;
+    const float fov = 45.0f, zNear = 0.05f, zFar = 10.0f;
+    const glm::vec3 direction(0.0f, -1.0f, -1.0f);
+
+    // Draw a frame the way the viewer's main loop does with its default settings
+    auto render = [&]() {
+        glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+        glEnable(GL_DEPTH_TEST);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glDepthFunc(GL_LESS);
+        glEnable(GL_CULL_FACE);
+        glCullFace(GL_FRONT);
+        glFrontFace(GL_CW);
+
+        glm::mat4 model = glm::mat4(1.0f);
+        glm::mat4 view = camera.getView();
+        glm::mat4 projection = glm::perspective(glm::radians(fov), (float)width / height, zNear, zFar);
+        pointLightPosition = glm::rotateY(pointLightPosition, glm::radians(0.25f));
+        pointLight2Position = glm::rotateX(pointLight2Position, glm::radians(0.25f));
+
+        FrameUniforms &f = frame.data;
+        f.view = view;
+        f.projection = projection;
+        f.cameraPos = camera.position;
+        f.colorIn = glm::vec3(0.5f);
+        f.shininess = 20.0f;
+        f.shadeFlat = false;
+        setLight(f.point, glm::vec3(0.0f), glm::vec3(0.5f, 0.0f, 0.0f), glm::vec3(1.0f, 0.5f, 0.0f),
+                 pointLightPosition, true);
+        setLight(f.point2, glm::vec3(0.0f), glm::vec3(0.2f, 0.0f, 0.3f), glm::vec3(0.0f, 0.6f, 0.2f),
+                 pointLight2Position, true);
+        glm::vec3 cameraLight = camera.u * direction.x + camera.v * direction.y + camera.n * direction.z * -1.0f;
+        setLight(f.directional, glm::vec3(0.2f, 0.2f, 0.5f), glm::vec3(0.8f), glm::vec3(0.8f),
+                 glm::vec4(cameraLight.x, cameraLight.y, cameraLight.z, 1.0f), true);
+        frame.update();
+
+        shader.use();
+        shader.setMat4("model", model);
+        shader.setInt("diffuseTexture", 0);
+        shader.setInt("normalTexture", 1);
+        mesh.draw(shader, 0.0f, projection * view * model);
+        glFinish();
+    };
+
+    // Warm up caches, shader compilation and the driver from the first pose,
+    // the lights start over after it so frames do not depend on --warmup
+    for(int i = 0; i < warmup; i++) {
+        render();
+    }
+    pointLightPosition = pointLight2Position = glm::vec4(camera.position.x, camera.position.y, camera.position.z, 0.0f);
+
+    vector<double> times;
+    times.reserve(cameraPath.frameCount());
+    size_t chunksDrawn = 0;
+    vector<uint8_t> pixels;
+    for(const CameraStep &step : cameraPath.steps) {
+        for(int i = 0; i < step.frames; i++) {
+            start = chrono::steady_clock::now();
+            CameraPath::apply(step, camera);
+            render();
+            times.push_back(millisecondsSince(start));
+            chunksDrawn += mesh.drawnChunks();
+            if(!dumpPrefix.empty()) {
+                char name[32];
+                snprintf(name, sizeof(name), "%05zu.ppm", times.size() - 1);
+                if(!writeFrame(dumpPrefix + name, width, height, pixels)) {
+                    return 1;
+                }
+            }
+        }
+    }
+
+    vector<double> sorted = times;
+    sort(sorted.begin(), sorted.end());
+    double total = 0.0;
+    for(double t : times) {
+        total += t;
+    }
+    double mean = total / times.size();
+    cout << times.size() << " frames of " << pathFile << " at " << width << "x" << height << ", "
+         << surface.triangleCount() << " triangles";
+    if(cull && mesh.chunkCount() > 0) {
+        cout << ", " << (double)chunksDrawn / times.size() << " of " << mesh.chunkCount() << " chunks drawn on average";
+    }
+    cout << endl;
+    cout << "frame mean " << mean << " ms, p50 " << percentile(sorted, 50) << " ms, p90 " << percentile(sorted, 90)
+         << " ms, p99 " << percentile(sorted, 99) << " ms, max " << sorted.back() << " ms, "
+         << 1000.0 / mean << " fps" << endl;
+
+    if(!out.empty()) {
+        ofstream file(out);
+        file << "{\"volume\": \"" << path << "\", \"cuts\": " << (native ? 0 : cuts) << ", \"level\": " << level
+             << ", \"triangles\": " << surface.triangleCount() << ", \"width\": " << width << ", \"height\": " << height
+             << ", \"frames\": " << times.size() << ", \"mean_ms\": " << mean << ", \"p50_ms\": " << percentile(sorted, 50)
+             << ", \"p90_ms\": " << percentile(sorted, 90) << ", \"p99_ms\": " << percentile(sorted, 99)
+             << ", \"max_ms\": " << sorted.back() << ", \"frame_ms\": [";
+        for(size_t i = 0; i < times.size(); i++) {
+            file << (i ? ", " : "") << times[i];
+        }
+        file << "]}" << endl;
+        if(!file) {
+            cout << "Error: could not write " << out << endl;
+            return 1;
+        }
+    }
+    // The mesh and shader are deleted while the context is still current,
+    // the context goes with the process
+    return 0;
+}
@@ -1,6 +1,9 @@
 #ifndef MESH_H
 #define MESH_H
 
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -16,6 +19,9 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include "marchingcubes.h"
+#include "meshcache.h"
+#include "vertex.h"
+#include "shader.h"
 
 using namespace std;
 
@@ -24,78 +30,492 @@ using namespace std;
 /*     GLfloat bx, by, bz; */
 /* }; */
 
-struct Vertex {
-    glm::vec3 p;
-    glm::vec3 n;
-};
-
 class Mesh {
 public:
-    size_t size;
-    GLuint VAO;
-    GLuint VBO;
+    size_t size = 0;
+
+    // How the vertices in a buffer are stored
+    enum Format {
+        // Vertex, the position and normal of each vertex together
+        Interleaved,
+        // All positions, then all normals
+        Split,
+        // PackedVertex, positions inside box
+        Packed
+    };
+
+    struct Layout {
+        Format format = Split;
+        PackedBox box;
+    };
 
 private:
+    // Buffers a mesh is uploaded into. Uploads take the slots of the ring in
+    // turn and the drawn one is never written, so a slot is written at the
+    // earliest two uploads after it was last drawn
+    struct Slot {
+        GLuint VAO = 0, VBO = 0, EBO = 0;
+        // Bytes of storage, see capacityFor
+        size_t vertexCapacity = 0, indexCapacity = 0;
+        // Persistent mappings of the storage, or the mappings of an upload
+        void *vertexMap = nullptr, *indexMap = nullptr;
+        // Passed once the GPU is done with the last draw from the slot
+        GLsync fence = 0;
+        Layout layout;
+        size_t vertices = 0, count = 0;
+        bool indexed = false;
+        // Triangles by block for culling, empty to always draw them all
+        vector<SurfaceChunk> chunks;
+    };
+    static const int RING = 3;
+    static const size_t MIN_CAPACITY = 64 << 10;
+    Slot ring[RING];
+    int front = -1;
+    int writing = -1;
     bool loaded = false;
+    // Buffers have immutable storage mapped once for good (ARB_buffer_storage),
+    // otherwise every upload orphans the storage and maps it again
+    bool persistent = false;
+
+    // Decimated levels of detail of the indexed mesh, coarser with each one
+    struct Lod {
+        GLuint VAO, VBO, EBO;
+        size_t size;
+        Layout layout;
+    };
+    vector<Lod> lods;
+
+    // Ranges of the chunks that survived culling, for glMultiDrawElements
+    vector<GLsizei> drawCounts;
+    vector<const void*> drawOffsets;
+    size_t chunksDrawn = 0;
 
 public:
+    // Store the vertices of indexed meshes created from now on as
+    // PackedVertex, half the memory of two floating point vectors
+    bool packVertices = false;
+
+    // Distance at which the first level of detail takes over from the mesh,
+    // every further one takes over at twice the distance of the one before
+    float lodDistance = 3.0f;
+
+    // Draw only the chunks of the mesh inside the view frustum
+    bool cullChunks = true;
+
     void createMesh(vector<Face*> &faces) {
-        const GLuint stride = 6;
+        cout<<faces.size()<< " triangles" <<endl;
 
-        vector<Vertex> vertices;
+        Layout layout;
+        layout.format = Interleaved;
+        void *vertices;
+        uint32_t *indices;
+        if(!beginUpload(layout, faces.size() * 3, 0, vertices, indices)) {
+            return;
+        }
+        clearLods();
+        Vertex *out = (Vertex*)vertices;
         for(size_t i = 0; i < faces.size(); i++) {
-            /* cout<<points[i].x<<" "<<points[i].y<<" " <<points[i].z<<endl; */
             for(size_t j = 0; j < 3; j++) {
-                vertices.push_back({
-                    faces[i]->iList[j]->position,
-                    faces[i]->iList[j]->normal
-                });
+                *out++ = { faces[i]->iList[j]->position, faces[i]->iList[j]->normal };
+            }
+        }
+        finishUpload();
+    }
+
+    // Upload an indexed mesh, positions and normals are stored one after the
+    // other. This is one copy into the mapping: the mesh is chunked, cached
+    // and decimated from memory on the extractor's thread before it gets here
+    void createMesh(const IndexedMesh &mesh) {
+        cout<<mesh.triangleCount()<< " triangles, " << mesh.positions.size() << " vertices" << (packVertices ? " (packed)" : "") <<endl;
+        upload(mesh.positions.data(), mesh.normals.data(), mesh.positions.size(), mesh.indices.data(), mesh.indices.size(),
+               mesh.chunks.data(), mesh.chunks.size());
+    }
+
+    // Upload a mesh mapped from the mesh cache, straight from the mapping
+    void createMesh(const MappedMesh &mesh) {
+        cout<<mesh.triangleCount()<< " triangles, " << mesh.vertexCount() << " vertices (cached" << (packVertices ? ", packed)" : ")") <<endl;
+        upload(mesh.vertexData(), mesh.vertexData() + mesh.vertexCount(), mesh.vertexCount(), mesh.indexData(), mesh.indexCount(),
+               mesh.chunkData(), mesh.chunkCount());
+    }
+
+    // Map room in the next slot of the ring for vertexCount vertices stored
+    // as layout and indexCount indices, 0 to draw the vertices as triangles in
+    // order, for the caller to write the mesh straight into. finishUpload
+    // makes it the mesh that is drawn. Pointers are null for empty meshes
+    bool beginUpload(const Layout &layout, size_t vertexCount, size_t indexCount, void *&vertices, uint32_t *&indices) {
+        init();
+        writing = (front + 1) % RING;
+        Slot &slot = ring[writing];
+        size_t vertexBytes = vertexCount * vertexSize(layout.format);
+        size_t indexBytes = indexCount * sizeof(uint32_t);
+        glBindVertexArray(slot.VAO);
+        if(persistent) {
+            // Written in place, so the GPU has to be done with it. Drawn two
+            // uploads ago at the latest, this has passed unless meshes are
+            // uploaded faster than frames are drawn
+            if(slot.fence) {
+                while(glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+                }
+                glDeleteSync(slot.fence);
+                slot.fence = 0;
+            }
+            reserve(GL_ARRAY_BUFFER, slot.VBO, slot.vertexCapacity, slot.vertexMap, vertexBytes);
+            reserve(GL_ELEMENT_ARRAY_BUFFER, slot.EBO, slot.indexCapacity, slot.indexMap, indexBytes);
+        } else {
+            // Invalidating the whole buffer lets the driver hand out fresh
+            // storage while the GPU still reads the old one
+            reserve(GL_ARRAY_BUFFER, slot.VBO, slot.vertexCapacity, slot.vertexMap, vertexBytes);
+            reserve(GL_ELEMENT_ARRAY_BUFFER, slot.EBO, slot.indexCapacity, slot.indexMap, indexBytes);
+            const GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT;
+            slot.vertexMap = vertexBytes ? glMapBufferRange(GL_ARRAY_BUFFER, 0, vertexBytes, access) : nullptr;
+            slot.indexMap = indexBytes ? glMapBufferRange(GL_ELEMENT_ARRAY_BUFFER, 0, indexBytes, access) : nullptr;
+        }
+        if((vertexBytes && !slot.vertexMap) || (indexBytes && !slot.indexMap)) {
+            cout << "Error: could not map " << vertexBytes + indexBytes << " bytes of mesh buffers" << endl;
+            unmap(slot);
+            glBindVertexArray(0);
+            writing = -1;
+            return false;
+        }
+        glBindVertexArray(0);
+        slot.layout = layout;
+        slot.vertices = vertexCount;
+        slot.indexed = indexCount > 0;
+        slot.count = slot.indexed ? indexCount : vertexCount;
+        vertices = vertexBytes ? slot.vertexMap : nullptr;
+        indices = indexBytes ? (uint32_t*)slot.indexMap : nullptr;
+        return true;
+    }
+
+    // Point the vertex array at the mesh written since beginUpload and draw
+    // it from now on. chunks are its triangles by block as made by chunkMesh,
+    // for culling
+    void finishUpload(const SurfaceChunk *chunks = nullptr, size_t chunkCount = 0) {
+        if(writing < 0) {
+            return;
+        }
+        int written = writing;
+        Slot &slot = ring[written];
+        writing = -1;
+        glBindVertexArray(slot.VAO);
+        bool ok = unmap(slot);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, slot.EBO);
+        glBindBuffer(GL_ARRAY_BUFFER, slot.VBO);
+        attributes(slot.layout, slot.vertices);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        if(!ok) {
+            // The storage was lost while mapped, keep drawing the last mesh
+            cout << "Error: mesh buffers were lost during the upload" << endl;
+            return;
+        }
+        front = written;
+        size = slot.count;
+        slot.chunks.assign(chunks, chunks + chunkCount);
+    }
+
+    // Replace the levels of detail, finest first. They belong to the mesh
+    // created last and are dropped with it
+    void setLods(const vector<IndexedMesh> &meshes) {
+        clearLods();
+        for(const IndexedMesh &mesh : meshes) {
+            Lod lod;
+            glGenVertexArrays(1, &lod.VAO);
+            glGenBuffers(1, &lod.VBO);
+            glGenBuffers(1, &lod.EBO);
+            lod.layout = layoutFor(mesh.positions.data(), mesh.positions.size());
+            lod.size = mesh.indices.size();
+
+            // Written once and drawn until the mesh changes
+            size_t vertexBytes = mesh.positions.size() * vertexSize(lod.layout.format);
+            glBindVertexArray(lod.VAO);
+            glBindBuffer(GL_ARRAY_BUFFER, lod.VBO);
+            glBufferData(GL_ARRAY_BUFFER, vertexBytes, NULL, GL_STATIC_DRAW);
+            void *vertices = vertexBytes ? glMapBufferRange(GL_ARRAY_BUFFER, 0, vertexBytes, GL_MAP_WRITE_BIT) : nullptr;
+            if(vertices) {
+                writeVertices(vertices, lod.layout, mesh.positions.data(), mesh.normals.data(), mesh.positions.size());
+                glUnmapBuffer(GL_ARRAY_BUFFER);
+            }
+            attributes(lod.layout, mesh.positions.size());
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, lod.EBO);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, lod.size * sizeof(uint32_t), mesh.indices.data(), GL_STATIC_DRAW);
+            glBindVertexArray(0);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            lods.push_back(lod);
+        }
+    }
+
+    // Number of levels of detail below the mesh itself
+    size_t lodCount() const {
+        return lods.size();
+    }
+
+    // Level drawn at distance from the camera, 0 for the mesh itself
+    size_t lodFor(float distance) const {
+        size_t level = 0;
+        for(float reach = lodDistance; distance > reach && level < lods.size(); reach *= 2.0f) {
+            level++;
+        }
+        return level;
+    }
+
+    // Chunks of the mesh drawn by the last draw, of chunkCount
+    size_t drawnChunks() const {
+        return chunksDrawn;
+    }
+
+    size_t chunkCount() const {
+        return front < 0 ? 0 : ring[front].chunks.size();
+    }
+
+    // Draw the level of detail for a camera at distance from the mesh, with
+    // the uniforms shader/basic.vert decodes packed vertices by. Chunks of
+    // the mesh outside the frustum of viewProjection (projection * view *
+    // model) are skipped
+    void draw(Shader &shader, float distance, const glm::mat4 &viewProjection) {
+        if(front < 0) {
+            return;
+        }
+        size_t level = lodFor(distance);
+        Slot &slot = ring[front];
+        const Layout &drawn = level == 0 ? slot.layout : lods[level - 1].layout;
+        shader.setBool("packedVertices", drawn.format == Packed);
+        shader.setVec3("positionOrigin", drawn.box.origin);
+        shader.setVec3("positionScale", drawn.box.scale);
+        if(level == 0) {
+            if(slot.count == 0) {
+                return;
             }
+            glBindVertexArray(slot.VAO);
+            chunksDrawn = slot.chunks.size();
+            if(slot.indexed && cullChunks && !slot.chunks.empty()) {
+                cull(slot.chunks, viewProjection);
+                if(!drawCounts.empty()) {
+                    glMultiDrawElements(GL_TRIANGLES, drawCounts.data(), GL_UNSIGNED_INT, drawOffsets.data(), drawCounts.size());
+                }
+            } else if(slot.indexed) {
+                glDrawElements(GL_TRIANGLES, slot.count, GL_UNSIGNED_INT, (void*)0);
+            } else {
+                glDrawArrays(GL_TRIANGLES, 0, slot.count);
+            }
+            if(persistent) {
+                if(slot.fence) {
+                    glDeleteSync(slot.fence);
+                }
+                slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            }
+        } else {
+            // Coarse levels are drawn from far away, where most of the mesh
+            // is in view anyway
+            chunksDrawn = 0;
+            glBindVertexArray(lods[level - 1].VAO);
+            glDrawElements(GL_TRIANGLES, lods[level - 1].size, GL_UNSIGNED_INT, (void*)0);
         }
-        // Clean up
-        /* for(size_t i = 0; i < faces.size(); i++) { */
-        /*     for(size_t j = 0; j < 3; j++) { */
-        /*         delete faces[i]->iList[j]; */
-        /*     } */
-        /*     delete faces[i]; */
-        /* } */
+        glBindVertexArray(0);
+    }
 
-        size = vertices.size();
-        cout<<size/3<< " triangles" <<endl;
+private:
+    void upload(const glm::vec3 *positions, const glm::vec3 *normals, size_t vertices, const uint32_t *indices, size_t indexCount,
+                const SurfaceChunk *chunks, size_t chunkCount) {
+        Layout layout = layoutFor(positions, vertices);
+        void *vertexData;
+        uint32_t *indexData;
+        if(!beginUpload(layout, vertices, indexCount, vertexData, indexData)) {
+            return;
+        }
+        clearLods();
+        writeVertices(vertexData, layout, positions, normals, vertices);
+        if(indexCount) {
+            memcpy(indexData, indices, indexCount * sizeof(uint32_t));
+        }
+        finishUpload(chunks, chunkCount);
+    }
 
-        if(!loaded) {
-            loaded = true;
+    // Fill drawCounts and drawOffsets with the index ranges of the chunks
+    // whose boxes touch the frustum of viewProjection, merging neighbours
+    void cull(const vector<SurfaceChunk> &chunks, const glm::mat4 &viewProjection) {
+        // Planes from the rows of the matrix, a point is inside all six when
+        // dot(plane, (p, 1)) >= 0
+        glm::vec4 row[4], planes[6];
+        for(int r = 0; r < 4; r++) {
+            row[r] = glm::vec4(viewProjection[0][r], viewProjection[1][r], viewProjection[2][r], viewProjection[3][r]);
+        }
+        for(int i = 0; i < 3; i++) {
+            planes[2 * i] = row[3] + row[i];
+            planes[2 * i + 1] = row[3] - row[i];
+        }
 
-            // create vertex array object
-            glGenVertexArrays(1, &VAO);
-            glBindVertexArray(VAO);
+        drawCounts.clear();
+        drawOffsets.clear();
+        chunksDrawn = 0;
+        uint32_t end = 0;
+        for(const SurfaceChunk &chunk : chunks) {
+            bool inside = true;
+            for(int i = 0; i < 6 && inside; i++) {
+                // The corner of the box furthest along the plane's normal
+                const glm::vec4 &plane = planes[i];
+                glm::vec3 corner(plane.x > 0.0f ? chunk.high.x : chunk.low.x,
+                                 plane.y > 0.0f ? chunk.high.y : chunk.low.y,
+                                 plane.z > 0.0f ? chunk.high.z : chunk.low.z);
+                inside = plane.x * corner.x + plane.y * corner.y + plane.z * corner.z + plane.w >= 0.0f;
+            }
+            if(!inside) {
+                continue;
+            }
+            chunksDrawn++;
+            if(!drawCounts.empty() && chunk.first == end) {
+                drawCounts.back() += chunk.count;
+            } else {
+                drawCounts.push_back(chunk.count);
+                drawOffsets.push_back((const void*)(chunk.first * sizeof(uint32_t)));
+            }
+            end = chunk.first + chunk.count;
+        }
+    }
 
-            // create vertex buffer object
-            glGenBuffers(1, &VBO);
-            glBindBuffer(GL_ARRAY_BUFFER, VBO);
-            glBufferData(GL_ARRAY_BUFFER, vertices.size() * stride * sizeof(GLfloat), &vertices[0], GL_STATIC_DRAW);
+    Layout layoutFor(const glm::vec3 *positions, size_t vertices) const {
+        Layout layout;
+        if(packVertices) {
+            layout.format = Packed;
+            layout.box = packedBox(positions, vertices);
+        }
+        return layout;
+    }
+
+    static size_t vertexSize(Format format) {
+        return format == Packed ? sizeof(PackedVertex) : sizeof(Vertex);
+    }
+
+    // Write an indexed mesh's vertices to mapped memory as layout. Memory
+    // mapped for writing may be uncached, so it is only ever written in order
+    static void writeVertices(void *out, const Layout &layout, const glm::vec3 *positions, const glm::vec3 *normals, size_t vertices) {
+        if(layout.format == Packed) {
+            PackedVertex *packed = (PackedVertex*)out;
+            for(size_t i = 0; i < vertices; i++) {
+                PackedVertex vertex;
+                packVertex(positions[i], normals[i], layout.box, vertex);
+                packed[i] = vertex;
+            }
+        } else if(vertices) {
+            size_t bytes = vertices * sizeof(glm::vec3);
+            if(normals == positions + vertices) {
+                // Already in buffer order, one copy
+                memcpy(out, positions, 2 * bytes);
+            } else {
+                memcpy(out, positions, bytes);
+                memcpy((uint8_t*)out + bytes, normals, bytes);
+            }
+        }
+    }
 
+    // Attribute pointers of the bound vertex array into the bound buffer,
+    // vertices is the count Split layouts are laid out for
+    static void attributes(const Layout &layout, size_t vertices) {
+        if(layout.format == Packed) {
+            // Positions, normalized to [0, 1] inside the box
+            glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, position));
+            glEnableVertexAttribArray(0);
+            // Octahedral normals
+            glDisableVertexAttribArray(1);
+            glVertexAttribPointer(2, 2, GL_SHORT, GL_TRUE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, normal));
+            glEnableVertexAttribArray(2);
+        } else {
+            bool split = layout.format == Split;
+            GLsizei stride = split ? sizeof(glm::vec3) : sizeof(Vertex);
             // Positions
-            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride * sizeof(GLfloat), (void*)(0 * sizeof(GLfloat)));
-            glEnableVertexAttribArray(0); 
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+            glEnableVertexAttribArray(0);
             // Normals
-            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride * sizeof(GLfloat), (void*)(3 * sizeof(GLfloat)));
-            glEnableVertexAttribArray(1); 
+            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(split ? vertices * sizeof(glm::vec3) : offsetof(Vertex, n)));
+            glEnableVertexAttribArray(1);
+            glDisableVertexAttribArray(2);
+        }
+    }
+
+    // Capacity of a buffer holding bytes that held capacity before. Grows by
+    // half at least so a mesh growing with the level does not reallocate on
+    // every upload, and gives memory back once a mesh needs less than a
+    // quarter of it
+    static size_t capacityFor(size_t capacity, size_t bytes) {
+        if(bytes <= capacity && bytes >= capacity / 4) {
+            return capacity;
+        }
+        size_t wanted = bytes > capacity ? max(bytes, capacity + capacity / 2) : bytes + bytes / 2;
+        wanted = max(wanted, (size_t)MIN_CAPACITY);
+        return (wanted + MIN_CAPACITY - 1) / MIN_CAPACITY * MIN_CAPACITY;
+    }
+
+    // Make buffer, bound to target, hold at least bytes
+    void reserve(GLenum target, GLuint &buffer, size_t &capacity, void *&map, size_t bytes) {
+        size_t wanted = capacityFor(capacity, bytes);
+        if(wanted == capacity) {
+            glBindBuffer(target, buffer);
+            return;
+        }
+        capacity = wanted;
+        if(persistent) {
+            // Immutable storage can not be resized, the buffer is replaced
+            glDeleteBuffers(1, &buffer);
+            glGenBuffers(1, &buffer);
+            glBindBuffer(target, buffer);
+            const GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(target, capacity, NULL, access);
+            map = glMapBufferRange(target, 0, capacity, access);
+            if(!map) {
+                // Allocated again on the next upload
+                capacity = 0;
+            }
         } else {
-            glBindVertexArray(VAO);
-            glBindBuffer(GL_ARRAY_BUFFER, VBO);
-            glBufferData(GL_ARRAY_BUFFER, vertices.size() * stride * sizeof(GLfloat), &vertices[0], GL_STATIC_DRAW);
+            glBindBuffer(target, buffer);
+            glBufferData(target, capacity, NULL, GL_STREAM_DRAW);
         }
+    }
 
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
-        glBindVertexArray(0);
+    // End the mappings of an upload into slot, whose vertex array is bound.
+    // False when the contents were lost. Persistent mappings stay, coherent
+    // writes are seen by the draws issued after them
+    bool unmap(Slot &slot) {
+        if(persistent) {
+            return true;
+        }
+        bool ok = true;
+        if(slot.vertexMap) {
+            glBindBuffer(GL_ARRAY_BUFFER, slot.VBO);
+            ok = glUnmapBuffer(GL_ARRAY_BUFFER) == GL_TRUE;
+        }
+        if(slot.indexMap) {
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, slot.EBO);
+            ok = glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER) == GL_TRUE && ok;
+        }
+        slot.vertexMap = nullptr;
+        slot.indexMap = nullptr;
+        return ok;
     }
 
-    // Draw the currently loaded mesh
-    void draw() {
-        glBindVertexArray(VAO);
-        glDrawArrays(GL_TRIANGLES, 0, size);
-        glBindVertexArray(0);
+    void clearLods() {
+        for(Lod &lod : lods) {
+            glDeleteVertexArrays(1, &lod.VAO);
+            glDeleteBuffers(1, &lod.VBO);
+            glDeleteBuffers(1, &lod.EBO);
+        }
+        lods.clear();
+    }
+
+    // Create the vertex arrays and buffers of the ring on first use.
+    // MC_BUFFER_STORAGE=off orphans buffers even where they could be mapped
+    // persistently
+    void init() {
+        if(loaded) {
+            return;
+        }
+        loaded = true;
+        const char *force = getenv("MC_BUFFER_STORAGE");
+        persistent = (GLEW_ARB_buffer_storage || GLEW_VERSION_4_4) && !(force && string(force) == "off");
+        for(Slot &slot : ring) {
+            glGenVertexArrays(1, &slot.VAO);
+            glGenBuffers(1, &slot.VBO);
+            glGenBuffers(1, &slot.EBO);
+        }
     }
 };
 
@@ -0,0 +1,297 @@
+#ifndef MESHCACHE_H
+#define MESHCACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <iostream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MC_HAVE_MESH_CACHE
+#include <dirent.h>
+#include <sys/stat.h>
+#include <utime.h>
+#endif
+
+#include "marchingcubes.h"
+#include "volume.h"
+
+using namespace std;
+
+/**
+ * An extracted mesh read from a mesh cache file, mapped where the platform
+ * allows it. Positions and normals follow each other in the file, the layout
+ * Mesh uploads them in, so they go to the GPU without being copied first
+ */
+class MappedMesh {
+    unique_ptr<VolumeSource> file;
+    size_t vertices = 0, indices = 0, chunks = 0;
+
+public:
+    static const size_t HEADER_BYTES = 64;
+
+    bool valid() const {
+        return file != nullptr;
+    }
+
+    void release() {
+        file.reset();
+        vertices = 0;
+        indices = 0;
+        chunks = 0;
+    }
+
+    size_t vertexCount() const {
+        return vertices;
+    }
+
+    size_t indexCount() const {
+        return indices;
+    }
+
+    size_t triangleCount() const {
+        return indices / 3;
+    }
+
+    size_t chunkCount() const {
+        return chunks;
+    }
+
+    // Positions followed by the normals
+    const glm::vec3 *vertexData() const {
+        return (const glm::vec3*)(file->data() + HEADER_BYTES);
+    }
+
+    const uint32_t *indexData() const {
+        return (const uint32_t*)(vertexData() + 2 * vertices);
+    }
+
+    const SurfaceChunk *chunkData() const {
+        return (const SurfaceChunk*)(indexData() + indices);
+    }
+
+private:
+    friend class MeshCache;
+
+    void take(unique_ptr<VolumeSource> &source, size_t vertexCount, size_t indexCount, size_t chunkCount) {
+        file.swap(source);
+        vertices = vertexCount;
+        indices = indexCount;
+        chunks = chunkCount;
+    }
+};
+
+/**
+ * Extracted meshes kept on disk between runs, one file per volume, cuts and
+ * level. Volumes are identified by the hash of their voxels rather than their
+ * path, so a changed file never hits and a copy of one does. Files are
+ * checked against their size and a hash of their contents before use, and the
+ * least recently used ones are deleted once the cache outgrows its budget.
+ * A file holds a 64 byte header:
+ *
+ *     "MCMESH1", uint32 version, uint32 0, uint64 key, uint64 vertices,
+ *     uint64 indices, uint64 hash of the rest, uint64 chunks, zeros
+ *
+ * then the positions, the normals, the indices and the chunks as in
+ * IndexedMesh. Only
+ * available where files can be listed, elsewhere nothing is ever found
+ */
+class MeshCache {
+    static const uint32_t VERSION = 2;
+
+    string dir;
+    size_t budget;
+
+public:
+    MeshCache(const string &directory, size_t budgetBytes) : dir(directory), budget(budgetBytes) {
+#ifdef MC_HAVE_MESH_CACHE
+        mkdir(dir.c_str(), 0755);
+#endif
+    }
+
+    // Key of the mesh of a volume extracted with cuts at level, cuts 0 for the
+    // native resolution. Face normals keep the keys they had before normals
+    // could be chosen
+    static uint64_t key(uint64_t volumeHash, size_t cuts, float level, NormalSource normals = FaceNormals) {
+        uint64_t fields[3] = { (uint64_t)cuts, 0, VERSION };
+        memcpy(&fields[1], &level, sizeof(level));
+        fields[1] |= (uint64_t)normals << 32;
+        return hashBytes(fields, sizeof(fields), volumeHash);
+    }
+
+    // Map the mesh stored under key, false when there is none or it is damaged
+    bool find(uint64_t key, MappedMesh &mesh) {
+        mesh.release();
+#ifdef MC_HAVE_MESH_CACHE
+        string path = pathOf(key);
+        struct stat info;
+        if(stat(path.c_str(), &info) != 0 || (size_t)info.st_size < MappedMesh::HEADER_BYTES) {
+            return false;
+        }
+        unique_ptr<VolumeSource> file(new VolumeSource());
+        if(!file->load(path, info.st_size)) {
+            return false;
+        }
+        uint64_t storedKey, vertices, indices, chunks, hash;
+        if(!readHeader(file->data(), storedKey, vertices, indices, chunks, hash) || storedKey != key ||
+           vertices > (uint64_t)info.st_size || indices > (uint64_t)info.st_size || chunks > (uint64_t)info.st_size ||
+           (uint64_t)info.st_size != MappedMesh::HEADER_BYTES + vertices * 2 * sizeof(glm::vec3) + indices * sizeof(uint32_t) +
+                                     chunks * sizeof(SurfaceChunk) ||
+           payloadHash(file->data() + MappedMesh::HEADER_BYTES, vertices, indices, chunks) != hash) {
+            cout << "Error: dropping damaged mesh cache file " << path << endl;
+            file.reset();
+            remove(path.c_str());
+            return false;
+        }
+        // The modification time orders the files for eviction
+        utime(path.c_str(), nullptr);
+        mesh.take(file, vertices, indices, chunks);
+        return true;
+#else
+        (void)key;
+        return false;
+#endif
+    }
+
+    // Store mesh under key, then evict the least recently used files until
+    // the cache fits its budget
+    bool store(uint64_t key, const IndexedMesh &mesh) {
+#ifdef MC_HAVE_MESH_CACHE
+        size_t vertexBytes = mesh.positions.size() * sizeof(glm::vec3);
+        size_t indexBytes = mesh.indices.size() * sizeof(uint32_t);
+        size_t chunkBytes = mesh.chunks.size() * sizeof(SurfaceChunk);
+        if(MappedMesh::HEADER_BYTES + 2 * vertexBytes + indexBytes + chunkBytes > budget) {
+            return false;
+        }
+        uint64_t hash = hashBytes(mesh.positions.data(), vertexBytes);
+        hash = hashBytes(mesh.normals.data(), vertexBytes, hash);
+        hash = hashBytes(mesh.indices.data(), indexBytes, hash);
+        hash = hashBytes(mesh.chunks.data(), chunkBytes, hash);
+
+        uint8_t header[MappedMesh::HEADER_BYTES] = {};
+        uint32_t version = VERSION;
+        uint64_t vertices = mesh.positions.size(), indices = mesh.indices.size(), chunks = mesh.chunks.size();
+        memcpy(header, "MCMESH1", 8);
+        memcpy(header + 8, &version, 4);
+        memcpy(header + 16, &key, 8);
+        memcpy(header + 24, &vertices, 8);
+        memcpy(header + 32, &indices, 8);
+        memcpy(header + 40, &hash, 8);
+        memcpy(header + 48, &chunks, 8);
+
+        // Written under another name first so a crash never leaves a torn file
+        string path = pathOf(key);
+        string temporary = path + ".tmp";
+        FILE *fp = fopen(temporary.c_str(), "wb");
+        if(!fp) {
+            cout << "Error: writing " << temporary << " failed" << endl;
+            return false;
+        }
+        bool ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header) &&
+            fwrite(mesh.positions.data(), 1, vertexBytes, fp) == vertexBytes &&
+            fwrite(mesh.normals.data(), 1, vertexBytes, fp) == vertexBytes &&
+            fwrite(mesh.indices.data(), 1, indexBytes, fp) == indexBytes &&
+            fwrite(mesh.chunks.data(), 1, chunkBytes, fp) == chunkBytes;
+        ok = fclose(fp) == 0 && ok;
+        if(!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+            cout << "Error: writing " << path << " failed" << endl;
+            remove(temporary.c_str());
+            return false;
+        }
+        evict(path);
+        return true;
+#else
+        (void)key;
+        (void)mesh;
+        return false;
+#endif
+    }
+
+    // Delete the least recently used files other than keep until the rest fit
+    // the budget
+    void evict(const string &keep = "") {
+#ifdef MC_HAVE_MESH_CACHE
+        DIR *d = opendir(dir.c_str());
+        if(!d) {
+            return;
+        }
+        struct Entry {
+            string path;
+            size_t bytes;
+            time_t used;
+        };
+        vector<Entry> entries;
+        size_t total = 0;
+        while(dirent *entry = readdir(d)) {
+            string name = entry->d_name;
+            struct stat info;
+            string path = dir + "/" + name;
+            if(name.size() > 5 && name.compare(name.size() - 5, 5, ".mesh") == 0 && stat(path.c_str(), &info) == 0) {
+                entries.push_back({ path, (size_t)info.st_size, info.st_mtime });
+                total += info.st_size;
+            }
+        }
+        closedir(d);
+        sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.used < b.used; });
+        for(size_t i = 0; i < entries.size() && total > budget; i++) {
+            if(entries[i].path == keep) {
+                continue;
+            }
+            remove(entries[i].path.c_str());
+            total -= entries[i].bytes;
+        }
+#endif
+    }
+
+    // Modification time and size of a file, to notice when it changes
+    static string fileStamp(const string &path) {
+#ifdef MC_HAVE_MESH_CACHE
+        struct stat info;
+        if(stat(path.c_str(), &info) == 0) {
+            return to_string((long long)info.st_size) + ":" + to_string((long long)info.st_mtime);
+        }
+#else
+        (void)path;
+#endif
+        return "";
+    }
+
+private:
+    string pathOf(uint64_t key) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.mesh", (unsigned long long)key);
+        return dir + "/" + name;
+    }
+
+    // The hash stored in the header, chained over the positions, normals,
+    // indices and chunks following it
+    static uint64_t payloadHash(const uint8_t *payload, uint64_t vertices, uint64_t indices, uint64_t chunks) {
+        size_t vertexBytes = vertices * sizeof(glm::vec3);
+        size_t indexBytes = indices * sizeof(uint32_t);
+        uint64_t hash = hashBytes(payload, vertexBytes);
+        hash = hashBytes(payload + vertexBytes, vertexBytes, hash);
+        hash = hashBytes(payload + 2 * vertexBytes, indexBytes, hash);
+        return hashBytes(payload + 2 * vertexBytes + indexBytes, chunks * sizeof(SurfaceChunk), hash);
+    }
+
+    static bool readHeader(const uint8_t *header, uint64_t &key, uint64_t &vertices, uint64_t &indices, uint64_t &chunks,
+                           uint64_t &hash) {
+        uint32_t version;
+        memcpy(&version, header + 8, 4);
+        if(memcmp(header, "MCMESH1", 8) != 0 || version != VERSION) {
+            return false;
+        }
+        memcpy(&key, header + 16, 8);
+        memcpy(&vertices, header + 24, 8);
+        memcpy(&indices, header + 32, 8);
+        memcpy(&hash, header + 40, 8);
+        memcpy(&chunks, header + 48, 8);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef MESHEXPORT_H
+#define MESHEXPORT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <iostream>
+
+#include <glm/glm.hpp>
+
+#include "volume.h"
+
+using namespace std;
+
+// File formats meshes are exported to
+enum MeshFormat {
+    Ply,
+    Stl,
+    Obj
+};
+
+inline const char *meshFormatName(MeshFormat format) {
+    switch(format) {
+        case Ply: return "ply";
+        case Stl: return "stl";
+        default: return "obj";
+    }
+}
+
+// Format from the extension of path, false when it is none of them
+inline bool meshFormatOf(const string &path, MeshFormat &format) {
+    size_t dot = path.find_last_of('.');
+    string ext = dot == string::npos ? "" : path.substr(dot + 1);
+    transform(ext.begin(), ext.end(), ext.begin(), [](char c) { return (char)tolower(c); });
+    if(ext == "ply") {
+        format = Ply;
+    } else if(ext == "stl") {
+        format = Stl;
+    } else if(ext == "obj") {
+        format = Obj;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Header of a binary PLY file with positions and normals per vertex and
+// triangles as lists of 3 indices. Written in the byte order of the
+// machine, little endian on every target we build
+inline string plyHeader(size_t vertices, size_t triangles) {
+    ostringstream out;
+    out << "ply\nformat binary_little_endian 1.0\ncomment marching cubes surface\n"
+        << "element vertex " << vertices << "\n"
+        << "property float x\nproperty float y\nproperty float z\n"
+        << "property float nx\nproperty float ny\nproperty float nz\n"
+        << "element face " << triangles << "\n"
+        << "property list uchar uint vertex_indices\nend_header\n";
+    return out.str();
+}
+
+/**
+ * A finished range of an indexed mesh: vertices [vertexBase, vertexBase +
+ * vertexCount) and the triangles starting at index indexBase. Triangles may
+ * refer to vertices of the chunk before it
+ */
+struct MeshChunk {
+    size_t vertexBase;
+    const glm::vec3 *positions, *normals;
+    size_t vertexCount;
+    size_t indexBase;
+    const uint32_t *indices;
+    size_t indexCount;
+
+    const glm::vec3 &position(uint32_t id, const MeshChunk *before) const {
+        return id >= vertexBase ? positions[id - vertexBase] : before->positions[id - before->vertexBase];
+    }
+};
+
+/**
+ * Writes an indexed mesh to a binary PLY, binary STL or OBJ file chunk by
+ * chunk, in the order the chunks are finished, so the mesh never has to be
+ * in memory as a whole. Every chunk is formatted into one buffer and written
+ * with a single call. PLY places vertices and faces at their offsets in the
+ * file, so begin() has to know the totals; STL has no shared vertices and
+ * repeats them for every triangle
+ */
+class MeshWriter {
+    FILE *fp = nullptr;
+    string path;
+    MeshFormat format = Ply;
+    size_t vertexTotal = 0, triangleTotal = 0;
+    size_t headerBytes = 0;
+    vector<char> buffer;
+    bool ok = true;
+
+    static const size_t PLY_VERTEX_BYTES = 6 * sizeof(float);
+    static const size_t PLY_FACE_BYTES = 1 + 3 * sizeof(uint32_t);
+    static const size_t STL_TRIANGLE_BYTES = 12 * sizeof(float) + 2;
+
+public:
+    ~MeshWriter() {
+        if(fp) {
+            fclose(fp);
+        }
+    }
+
+    // Create the file at outPath, the format follows its extension
+    bool open(const string &outPath) {
+        path = outPath;
+        if(!meshFormatOf(path, format)) {
+            cout << "Error: " << path << " is not a .ply, .stl or .obj file" << endl;
+            return false;
+        }
+        fp = fopen(path.c_str(), "wb");
+        if(!fp) {
+            cout << "Error: could not write " << path << endl;
+            return false;
+        }
+        setvbuf(fp, nullptr, _IOFBF, 1 << 20);
+        ok = true;
+        return true;
+    }
+
+    // Write the header of a mesh of the given size
+    bool begin(size_t vertices, size_t triangles) {
+        vertexTotal = vertices;
+        triangleTotal = triangles;
+        if(format == Ply) {
+            string header = plyHeader(vertices, triangles);
+            headerBytes = header.size();
+            put(header.data(), header.size());
+        } else if(format == Stl) {
+            char header[80] = {};
+            snprintf(header, sizeof(header), "marching cubes surface");
+            uint32_t count = (uint32_t)triangles;
+            put(header, sizeof(header));
+            put(&count, sizeof(count));
+        } else {
+            string header = "# marching cubes surface\n";
+            put(header.data(), header.size());
+        }
+        return ok;
+    }
+
+    // Write a chunk whose vertices are final. before is the chunk written
+    // last, for the vertices of the triangles that lie in it
+    bool write(const MeshChunk &chunk, const MeshChunk *before) {
+        buffer.clear();
+        switch(format) {
+            case Ply: writePly(chunk); break;
+            case Stl: writeStl(chunk, before); break;
+            case Obj: writeObj(chunk); break;
+        }
+        return ok;
+    }
+
+    bool close() {
+        if(fp) {
+            ok = fclose(fp) == 0 && ok;
+            fp = nullptr;
+        }
+        if(!ok) {
+            cout << "Error: writing " << path << " failed" << endl;
+        }
+        return ok;
+    }
+
+private:
+    void put(const void *data, size_t bytes) {
+        ok = ok && fwrite(data, 1, bytes, fp) == bytes;
+    }
+
+    void putAt(uint64_t offset, const void *data, size_t bytes) {
+        ok = ok && seekFile(fp, offset);
+        put(data, bytes);
+    }
+
+    template <typename T>
+    void append(const T &value) {
+        const char *bytes = (const char*)&value;
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    void writePly(const MeshChunk &chunk) {
+        buffer.reserve(chunk.vertexCount * PLY_VERTEX_BYTES);
+        for(size_t i = 0; i < chunk.vertexCount; i++) {
+            append(chunk.positions[i]);
+            append(chunk.normals[i]);
+        }
+        putAt(headerBytes + chunk.vertexBase * PLY_VERTEX_BYTES, buffer.data(), buffer.size());
+
+        buffer.clear();
+        buffer.reserve(chunk.indexCount / 3 * PLY_FACE_BYTES);
+        for(size_t i = 0; i + 3 <= chunk.indexCount; i += 3) {
+            buffer.push_back(3);
+            append(chunk.indices[i]);
+            append(chunk.indices[i + 1]);
+            append(chunk.indices[i + 2]);
+        }
+        putAt(headerBytes + vertexTotal * PLY_VERTEX_BYTES + chunk.indexBase / 3 * PLY_FACE_BYTES, buffer.data(), buffer.size());
+    }
+
+    void writeStl(const MeshChunk &chunk, const MeshChunk *before) {
+        buffer.reserve(chunk.indexCount / 3 * STL_TRIANGLE_BYTES);
+        for(size_t i = 0; i + 3 <= chunk.indexCount; i += 3) {
+            const glm::vec3 &a = chunk.position(chunk.indices[i], before);
+            const glm::vec3 &b = chunk.position(chunk.indices[i + 1], before);
+            const glm::vec3 &c = chunk.position(chunk.indices[i + 2], before);
+            glm::vec3 normal = glm::cross(b - a, c - a);
+            float length = glm::length(normal);
+            if(length > 0.0f) {
+                normal /= length;
+            }
+            append(normal);
+            append(a);
+            append(b);
+            append(c);
+            uint16_t attributes = 0;
+            append(attributes);
+        }
+        put(buffer.data(), buffer.size());
+    }
+
+    void writeObj(const MeshChunk &chunk) {
+        char line[128];
+        for(size_t i = 0; i < chunk.vertexCount; i++) {
+            const glm::vec3 &p = chunk.positions[i];
+            const glm::vec3 &n = chunk.normals[i];
+            int length = snprintf(line, sizeof(line), "v %.9g %.9g %.9g\nvn %.9g %.9g %.9g\n", p.x, p.y, p.z, n.x, n.y, n.z);
+            buffer.insert(buffer.end(), line, line + length);
+        }
+        // Indices are 1 based, every vertex has the normal of the same number
+        for(size_t i = 0; i + 3 <= chunk.indexCount; i += 3) {
+            unsigned long long a = chunk.indices[i] + 1ull, b = chunk.indices[i + 1] + 1ull, c = chunk.indices[i + 2] + 1ull;
+            int length = snprintf(line, sizeof(line), "f %llu//%llu %llu//%llu %llu//%llu\n", a, a, b, b, c, c);
+            buffer.insert(buffer.end(), line, line + length);
+        }
+        put(buffer.data(), buffer.size());
+    }
+};
+
+// Write a mesh that is in memory as a whole, positions and normals have
+// vertexCount entries
+inline bool exportMesh(const string &path, const glm::vec3 *positions, const glm::vec3 *normals, size_t vertexCount,
+                       const uint32_t *indices, size_t indexCount) {
+    MeshWriter writer;
+    if(!writer.open(path) || !writer.begin(vertexCount, indexCount / 3)) {
+        return false;
+    }
+    MeshChunk all = { 0, positions, normals, vertexCount, 0, indices, indexCount };
+    writer.write(all, nullptr);
+    return writer.close();
+}
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef MINMAXPYRAMID_H
+#define MINMAXPYRAMID_H
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+/**
+ * Min/max pyramid over a scalar grid for skipping empty space. Level 0 holds
+ * the value range of every block of BLOCK^3 cells, including the grid points
+ * on the far faces of the block, and each level above merges 2x2x2 blocks of
+ * the one below until a single block is left
+ */
+class MinMaxPyramid {
+public:
+    static const int BLOCK = 8;
+
+private:
+    struct Level {
+        int dimension[3];
+        vector<float> min, max;
+
+        size_t index(int x, int y, int z) const {
+            return ((size_t)z * dimension[1] + y) * dimension[0] + x;
+        }
+    };
+    vector<Level> levels;
+
+public:
+    // Build the pyramid over a grid with the given number of points per axis
+    void build(const vector<float> &grid, const int gridDimension[3]) {
+        size_t planeSize = (size_t)gridDimension[0] * gridDimension[1];
+        build(gridDimension, [&](int z) { return &grid[z * planeSize]; });
+    }
+
+    // Build the pyramid from planes of the grid, plane(z) returns the points
+    // of plane z, x fastest, valid until the next call
+    template <typename Plane>
+    void build(const int gridDimension[3], Plane plane) {
+        levels.clear();
+        Level base;
+        for(int i = 0; i < 3; i++) {
+            base.dimension[i] = max(1, (gridDimension[i] - 1 + BLOCK - 1) / BLOCK);
+        }
+        size_t blocks = (size_t)base.dimension[0] * base.dimension[1] * base.dimension[2];
+        base.min.assign(blocks, numeric_limits<float>::infinity());
+        base.max.assign(blocks, -numeric_limits<float>::infinity());
+
+        int dx = gridDimension[0];
+        int dy = gridDimension[1];
+        int bz[2], by[2];
+        for(int z = 0; z < gridDimension[2]; z++) {
+            const float *points = plane(z);
+            int nz = blocksOf(z, base.dimension[2], bz);
+            for(int y = 0; y < dy; y++) {
+                const float *row = points + (size_t)y * dx;
+                int ny = blocksOf(y, base.dimension[1], by);
+                for(int bx = 0; bx < base.dimension[0]; bx++) {
+                    int x1 = min(bx * BLOCK + BLOCK, dx - 1);
+                    float lo = row[bx * BLOCK], hi = lo;
+                    for(int x = bx * BLOCK + 1; x <= x1; x++) {
+                        lo = min(lo, row[x]);
+                        hi = max(hi, row[x]);
+                    }
+                    for(int j = 0; j < nz; j++) {
+                        for(int k = 0; k < ny; k++) {
+                            size_t i = base.index(bx, by[k], bz[j]);
+                            base.min[i] = min(base.min[i], lo);
+                            base.max[i] = max(base.max[i], hi);
+                        }
+                    }
+                }
+            }
+        }
+        levels.push_back(base);
+
+        while(levels.back().min.size() > 1) {
+            const Level &below = levels.back();
+            Level above;
+            for(int i = 0; i < 3; i++) {
+                above.dimension[i] = (below.dimension[i] + 1) / 2;
+            }
+            above.min.resize((size_t)above.dimension[0] * above.dimension[1] * above.dimension[2]);
+            above.max.resize(above.min.size());
+            for(int z = 0; z < above.dimension[2]; z++) {
+                for(int y = 0; y < above.dimension[1]; y++) {
+                    for(int x = 0; x < above.dimension[0]; x++) {
+                        size_t first = below.index(2 * x, 2 * y, 2 * z);
+                        float lo = below.min[first], hi = below.max[first];
+                        for(int cz = 2 * z; cz < min(2 * z + 2, below.dimension[2]); cz++) {
+                            for(int cy = 2 * y; cy < min(2 * y + 2, below.dimension[1]); cy++) {
+                                for(int cx = 2 * x; cx < min(2 * x + 2, below.dimension[0]); cx++) {
+                                    size_t i = below.index(cx, cy, cz);
+                                    lo = min(lo, below.min[i]);
+                                    hi = max(hi, below.max[i]);
+                                }
+                            }
+                        }
+                        size_t i = above.index(x, y, z);
+                        above.min[i] = lo;
+                        above.max[i] = hi;
+                    }
+                }
+            }
+            levels.push_back(above);
+        }
+    }
+
+    // Number of level 0 blocks along each axis
+    const int *blocks() const {
+        return levels[0].dimension;
+    }
+
+    // Flag the level 0 blocks that can hold cells crossing level, that is
+    // blocks with a value below level and a value at or above it
+    void activeBlocks(float level, vector<uint8_t> &live) const {
+        if(levels.empty()) {
+            live.clear();
+            return;
+        }
+        live.assign(levels[0].min.size(), 0);
+        const Level &top = levels.back();
+        for(int z = 0; z < top.dimension[2]; z++) {
+            for(int y = 0; y < top.dimension[1]; y++) {
+                for(int x = 0; x < top.dimension[0]; x++) {
+                    visit(levels.size() - 1, x, y, z, level, live);
+                }
+            }
+        }
+    }
+
+private:
+    // Blocks that point c lies in along an axis with count blocks, points on a
+    // block boundary belong to the blocks on both sides
+    static int blocksOf(int c, int count, int b[2]) {
+        int n = 0;
+        if(c % BLOCK == 0 && c > 0 && c / BLOCK - 1 < count) {
+            b[n++] = c / BLOCK - 1;
+        }
+        if(c / BLOCK < count) {
+            b[n++] = c / BLOCK;
+        }
+        return n;
+    }
+
+    void visit(size_t l, int x, int y, int z, float level, vector<uint8_t> &live) const {
+        const Level &node = levels[l];
+        size_t i = node.index(x, y, z);
+        if(!(node.min[i] < level && node.max[i] >= level)) {
+            return;
+        }
+        if(l == 0) {
+            live[i] = 1;
+            return;
+        }
+        const Level &below = levels[l - 1];
+        for(int cz = 2 * z; cz < min(2 * z + 2, below.dimension[2]); cz++) {
+            for(int cy = 2 * y; cy < min(2 * y + 2, below.dimension[1]); cy++) {
+                for(int cx = 2 * x; cx < min(2 * x + 2, below.dimension[0]); cx++) {
+                    visit(l - 1, cx, cy, cz, level, live);
+                }
+            }
+        }
+    }
+};
+
+#endif
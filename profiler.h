@@ -0,0 +1,245 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+/**
+ * Durations of named stages from scoped timers on any thread. Every stage
+ * keeps its last SAMPLES durations on the CPU and, for scopes GpuTimers
+ * (gputimers.h) also times, on the GPU, for a rolling breakdown. Between
+ * startTrace and writeTrace every scope is also kept as an event of a Chrome
+ * trace (chrome://tracing or ui.perfetto.dev), one track per thread and one
+ * for the GPU. Disabled, a scope costs a single atomic load
+ */
+class Profiler {
+public:
+    static const size_t SAMPLES = 120;
+    // Events kept for a trace, about 32 MB
+    static const size_t MAX_EVENTS = 1 << 20;
+
+    // Mean and longest of the samples a stage has, in milliseconds
+    struct Stats {
+        string name;
+        size_t cpuSamples, gpuSamples;
+        double cpuMean, cpuMax, gpuMean, gpuMax;
+    };
+
+    // Times the CPU from here to the end of the scope as stage. stage has to
+    // outlive the profiler, a string literal. profiler may be null
+    class Scope {
+        Profiler *profiler;
+        const char *stage;
+        double start = 0.0;
+
+    public:
+        Scope(Profiler *p, const char *stageName) : profiler(p && p->enabled() ? p : nullptr), stage(stageName) {
+            if(profiler) {
+                start = profiler->now();
+            }
+        }
+
+        ~Scope() {
+            if(profiler) {
+                profiler->addCpu(stage, start, profiler->now() - start);
+            }
+        }
+    };
+
+private:
+    struct Stage {
+        string name;
+        double cpu[SAMPLES], gpu[SAMPLES];
+        size_t cpuCount = 0, gpuCount = 0;
+    };
+
+    // A scope in a trace, times in seconds since the profiler was made
+    struct Event {
+        size_t stage;
+        int track;
+        double start, length;
+    };
+
+    atomic<bool> on;
+    mutable mutex lock;
+    chrono::steady_clock::time_point epoch;
+    vector<Stage> stages;
+    map<string, size_t> stageIndex;
+    // Stages by the address of their name, scopes pass the same literal
+    unordered_map<const char*, size_t> stageAt;
+    // Track 0 is the GPU, threads get the next ones as they first record
+    map<thread::id, int> tracks;
+    vector<string> trackNames;
+    vector<Event> events;
+    bool tracing = false;
+    size_t dropped = 0;
+
+public:
+    Profiler() : on(false), epoch(chrono::steady_clock::now()), trackNames(1, "GPU") {
+    }
+
+    void setEnabled(bool enabled) {
+        on.store(enabled, memory_order_relaxed);
+    }
+
+    bool enabled() const {
+        return on.load(memory_order_relaxed);
+    }
+
+    // Seconds since the profiler was made
+    double now() const {
+        return chrono::duration<double>(chrono::steady_clock::now() - epoch).count();
+    }
+
+    // Name of the calling thread's track in traces
+    void nameThread(const string &name) {
+        unique_lock<mutex> guard(lock);
+        trackNames[trackOf(this_thread::get_id())] = name;
+    }
+
+    void addCpu(const char *stage, double start, double seconds) {
+        unique_lock<mutex> guard(lock);
+        size_t index = stageOf(stage);
+        Stage &s = stages[index];
+        s.cpu[s.cpuCount++ % SAMPLES] = seconds;
+        record(index, trackOf(this_thread::get_id()), start, seconds);
+    }
+
+    // GPU time of a scope that started on the CPU at start. Traces show it
+    // from there, GPU work usually starts a little later
+    void addGpu(const char *stage, double start, double seconds) {
+        unique_lock<mutex> guard(lock);
+        size_t index = stageOf(stage);
+        Stage &s = stages[index];
+        s.gpu[s.gpuCount++ % SAMPLES] = seconds;
+        record(index, 0, start, seconds);
+    }
+
+    // Stats of every stage over its last SAMPLES scopes, in the order they
+    // were first seen
+    vector<Stats> breakdown() const {
+        unique_lock<mutex> guard(lock);
+        vector<Stats> all;
+        for(const Stage &s : stages) {
+            Stats stats;
+            stats.name = s.name;
+            stats.cpuSamples = min(s.cpuCount, (size_t)SAMPLES);
+            stats.gpuSamples = min(s.gpuCount, (size_t)SAMPLES);
+            summarize(s.cpu, stats.cpuSamples, stats.cpuMean, stats.cpuMax);
+            summarize(s.gpu, stats.gpuSamples, stats.gpuMean, stats.gpuMax);
+            all.push_back(stats);
+        }
+        return all;
+    }
+
+    // Keep the scopes from now on for writeTrace, dropping any kept before
+    void startTrace() {
+        unique_lock<mutex> guard(lock);
+        events.clear();
+        dropped = 0;
+        tracing = true;
+    }
+
+    // Write the scopes kept since startTrace as Chrome trace event JSON
+    bool writeTrace(const string &path) const {
+        unique_lock<mutex> guard(lock);
+        FILE *fp = fopen(path.c_str(), "w");
+        if(!fp) {
+            cout << "Error: could not write " << path << endl;
+            return false;
+        }
+        fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        for(size_t t = 0; t < trackNames.size(); t++) {
+            fprintf(fp, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}},\n",
+                    t, escape(trackNames[t]).c_str());
+        }
+        for(const Event &e : events) {
+            fprintf(fp, "{\"ph\":\"X\",\"name\":\"%s\",\"cat\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f},\n",
+                    escape(stages[e.stage].name).c_str(), e.track == 0 ? "gpu" : "cpu", e.track, e.start * 1e6, e.length * 1e6);
+        }
+        // Keeps the list free of a trailing comma
+        fprintf(fp, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,\"args\":{\"name\":\"marching cubes\"}}\n]}\n");
+        bool ok = !ferror(fp);
+        ok = fclose(fp) == 0 && ok;
+        if(!ok) {
+            cout << "Error: writing " << path << " failed" << endl;
+        } else if(dropped > 0) {
+            cout << "Trace " << path << " is missing the last " << dropped << " scopes" << endl;
+        }
+        return ok;
+    }
+
+private:
+    size_t stageOf(const char *name) {
+        auto at = stageAt.find(name);
+        if(at != stageAt.end()) {
+            return at->second;
+        }
+        // The same name from another translation unit is the same stage
+        auto found = stageIndex.find(name);
+        if(found == stageIndex.end()) {
+            found = stageIndex.insert(make_pair(string(name), stages.size())).first;
+            stages.push_back(Stage());
+            stages.back().name = name;
+        }
+        stageAt[name] = found->second;
+        return found->second;
+    }
+
+    int trackOf(thread::id id) {
+        auto found = tracks.find(id);
+        if(found != tracks.end()) {
+            return found->second;
+        }
+        int track = (int)trackNames.size();
+        tracks[id] = track;
+        trackNames.push_back("thread " + to_string(track));
+        return track;
+    }
+
+    void record(size_t stage, int track, double start, double seconds) {
+        if(!tracing) {
+            return;
+        }
+        if(events.size() >= MAX_EVENTS) {
+            dropped++;
+            return;
+        }
+        events.push_back({ stage, track, start, seconds });
+    }
+
+    static void summarize(const double *samples, size_t count, double &mean, double &longest) {
+        mean = 0.0;
+        longest = 0.0;
+        for(size_t i = 0; i < count; i++) {
+            mean += samples[i];
+            longest = max(longest, samples[i]);
+        }
+        mean = count ? mean / count * 1e3 : 0.0;
+        longest *= 1e3;
+    }
+
+    static string escape(const string &text) {
+        string out;
+        for(char c : text) {
+            if(c == '"' || c == '\\') {
+                out += '\\';
+            }
+            out += c;
+        }
+        return out;
+    }
+};
+
+#endif
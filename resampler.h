@@ -0,0 +1,381 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+#include "classify.h"
+
+using namespace std;
+
+// How voxels are filtered onto the grid. Box and Lanczos only apply along
+// axes with fewer grid points than voxels, trilinear is used elsewhere
+enum ResampleFilter {
+    Trilinear,
+    Box,
+    Lanczos
+};
+
+/**
+ * Weights of a separable filter along one axis. Output sample i is the sum of
+ * weight(i)[t] * input[first[i] + t] for t < taps, with every tap inside the
+ * input so no bounds are checked while filtering
+ */
+struct AxisWeights {
+    int taps = 0;
+    vector<int> first;
+    vector<float> weights;
+
+    // Weights for count samples spacing voxels apart, sample i at voxel
+    // coordinate spacing * i
+    void build(ResampleFilter filter, int inputSize, int count, float spacing) {
+        first.resize(count);
+        if(filter == Trilinear || spacing <= 1.0f) {
+            // Samples past the last voxel use the last cell
+            taps = 2;
+            weights.resize((size_t)count * taps);
+            for(int i = 0; i < count; i++) {
+                float x = spacing * i;
+                int v0 = floor(x);
+                if(v0 >= inputSize - 1) {
+                    v0 = inputSize - 2;
+                }
+                float l = x - v0;
+                first[i] = v0;
+                weights[(size_t)i * 2] = 1 - l;
+                weights[(size_t)i * 2 + 1] = l;
+            }
+            return;
+        }
+
+        // Box covers spacing voxels around the sample, Lanczos-2 two
+        // samples to either side
+        int ideal = filter == Box ? (int)ceil(spacing) + 2 : (int)ceil(4.0f * spacing) + 1;
+        taps = min(ideal, inputSize);
+        weights.assign((size_t)count * taps, 0.0f);
+        for(int i = 0; i < count; i++) {
+            float x = spacing * i;
+            int j0 = filter == Box ? (int)floor(x - spacing / 2 + 0.5f) : (int)ceil(x - 2.0f * spacing);
+            int start = max(0, min(j0, inputSize - taps));
+            first[i] = start;
+            float *w = &weights[(size_t)i * taps];
+            float sum = 0.0f;
+            // Taps past either end of the input fold onto the end voxel
+            for(int j = j0; j < j0 + ideal; j++) {
+                float weight = filter == Box ? boxWeight(j, x, spacing) : lanczosWeight((j - x) / spacing);
+                int clamped = max(0, min(j, inputSize - 1));
+                w[clamped - start] += weight;
+                sum += weight;
+            }
+            for(int t = 0; t < taps; t++) {
+                w[t] = sum != 0.0f ? w[t] / sum : (t == 0 ? 1.0f : 0.0f);
+            }
+        }
+    }
+
+    const float *weightsOf(int i) const {
+        return &weights[(size_t)i * taps];
+    }
+
+private:
+    // Length of voxel j's extent covered by the box around x
+    static float boxWeight(int j, float x, float spacing) {
+        float lo = max(j - 0.5f, x - spacing / 2);
+        float hi = min(j + 0.5f, x + spacing / 2);
+        return max(0.0f, hi - lo);
+    }
+
+    static float lanczosWeight(float t) {
+        const float pi = 3.14159265358979f;
+        t = fabs(t);
+        if(t < 1e-6f) {
+            return 1.0f;
+        }
+        if(t >= 2.0f) {
+            return 0.0f;
+        }
+        return 2.0f * sin(pi * t) * sin(pi * t / 2) / (pi * pi * t * t);
+    }
+};
+
+// Whether rows are filtered along y before x. Going first, the y pass runs
+// over whole voxel rows with the row kernels and leaves x only the grid rows
+// to filter, but every voxel row read has to be converted to floats. Picks
+// the order with less scalar work per plane
+inline bool filterYFirst(const AxisWeights axes[3], const int dims[3]) {
+    size_t nx = axes[0].first.size(), ny = axes[1].first.size();
+    size_t rows = min((size_t)dims[1], ny * axes[1].taps);
+    size_t xFirst = rows * nx * axes[0].taps;
+    size_t yFirst = rows * dims[0] + ny * nx * axes[0].taps;
+    return yFirst < xFirst;
+}
+
+// Filter one sample from raw(x, y, z) with voxel values low and high mapped to
+// 0 and 1. Sums in the same order as SlabResampler, so a grid point has the
+// same value whichever of the two computes it
+template <typename Raw>
+inline float sampleSeparable(const AxisWeights axes[3], bool yFirst, int x, int y, int z, Raw raw, float low, float high) {
+    const float *wx = axes[0].weightsOf(x);
+    const float *wy = axes[1].weightsOf(y);
+    const float *wz = axes[2].weightsOf(z);
+    int fx = axes[0].first[x], fy = axes[1].first[y], fz = axes[2].first[z];
+    float sumZ = 0.0f;
+    for(int tz = 0; tz < axes[2].taps; tz++) {
+        float sumPlane = 0.0f;
+        if(yFirst) {
+            for(int tx = 0; tx < axes[0].taps; tx++) {
+                float sumY = 0.0f;
+                for(int ty = 0; ty < axes[1].taps; ty++) {
+                    sumY += raw(fx + tx, fy + ty, fz + tz) * wy[ty];
+                }
+                sumPlane += sumY * wx[tx];
+            }
+        } else {
+            for(int ty = 0; ty < axes[1].taps; ty++) {
+                float sumX = 0.0f;
+                for(int tx = 0; tx < axes[0].taps; tx++) {
+                    sumX += raw(fx + tx, fy + ty, fz + tz) * wx[tx];
+                }
+                sumPlane += sumX * wy[ty];
+            }
+        }
+        sumZ += sumPlane * wz[tz];
+    }
+    return (sumZ - low) / (high - low);
+}
+
+// Row kernels of the y and z passes. Products and sums are rounded one at a
+// time in every kernel, so the vector kernels match the scalar one and
+// sampleSeparable bit for bit
+inline void addScaledScalar(const float *src, float w, float *dst, size_t n) {
+    for(size_t i = 0; i < n; i++) {
+        dst[i] += src[i] * w;
+    }
+}
+
+inline void normalizeScalar(const float *src, float low, float range, float *dst, size_t n) {
+    for(size_t i = 0; i < n; i++) {
+        dst[i] = (src[i] - low) / range;
+    }
+}
+
+#ifdef MC_X86_SIMD
+__attribute__((target("sse4.1")))
+inline void addScaledSSE4(const float *src, float w, float *dst, size_t n) {
+    __m128 s = _mm_set1_ps(w);
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), s)));
+    }
+    addScaledScalar(src + i, w, dst + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+inline void normalizeSSE4(const float *src, float low, float range, float *dst, size_t n) {
+    __m128 l = _mm_set1_ps(low), r = _mm_set1_ps(range);
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(dst + i, _mm_div_ps(_mm_sub_ps(_mm_loadu_ps(src + i), l), r));
+    }
+    normalizeScalar(src + i, low, range, dst + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void addScaledAVX2(const float *src, float w, float *dst, size_t n) {
+    __m256 s = _mm256_set1_ps(w);
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_mul_ps(_mm256_loadu_ps(src + i), s)));
+    }
+    addScaledScalar(src + i, w, dst + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void normalizeAVX2(const float *src, float low, float range, float *dst, size_t n) {
+    __m256 l = _mm256_set1_ps(low), r = _mm256_set1_ps(range);
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_div_ps(_mm256_sub_ps(_mm256_loadu_ps(src + i), l), r));
+    }
+    normalizeScalar(src + i, low, range, dst + i, n - i);
+}
+#endif
+
+struct RowKernels {
+    const char *name;
+    // dst += src * w
+    void (*addScaled)(const float *src, float w, float *dst, size_t n);
+    // dst = (src - low) / range
+    void (*normalize)(const float *src, float low, float range, float *dst, size_t n);
+};
+
+// Picked like the classify kernels, MC_SIMD overrides it
+inline RowKernels selectRowKernels() {
+    const char *force = getenv("MC_SIMD");
+#ifdef MC_X86_SIMD
+    __builtin_cpu_init();
+    if((!force || !strcmp(force, "avx2")) && __builtin_cpu_supports("avx2")) {
+        return { "avx2", addScaledAVX2, normalizeAVX2 };
+    }
+    if((!force || !strcmp(force, "avx2") || !strcmp(force, "sse4")) && __builtin_cpu_supports("sse4.1")) {
+        return { "sse4", addScaledSSE4, normalizeSSE4 };
+    }
+#endif
+    (void)force;
+    return { "scalar", addScaledScalar, normalizeScalar };
+}
+
+inline const RowKernels &rowKernels() {
+    static const RowKernels chosen = selectRowKernels();
+    return chosen;
+}
+
+/**
+ * Resamples the voxels of a volume of type T onto output planes [z0, z1) of a
+ * grid. Every voxel plane is filtered along x and y once into a reduced plane
+ * of grid rows, and each grid plane is a weighted sum of the reduced planes
+ * under it. The reduced planes live in a window of taps planes that slides
+ * along z, so memory does not grow with the volume. The y and z passes are
+ * multiply-adds over whole rows with the row kernels
+ */
+template <typename T>
+class SlabResampler {
+    const T *voxels;
+    const int *dims;
+    const AxisWeights *axes;
+    int nx, ny;
+    bool yFirst;
+
+    // Voxel rows of one plane, as floats when y goes first and filtered
+    // along x otherwise, valid where rowPlane matches
+    vector<float> rows;
+    vector<int> rowPlane;
+    size_t rowLength;
+    // Window of reduced planes, plane z is at z % taps
+    vector<vector<float>> planes;
+    vector<int> planeOf;
+    vector<const float*> window;
+    vector<float> line, sum;
+
+public:
+    SlabResampler(const T *voxels, const int dims[3], const AxisWeights axes[3]) :
+        voxels(voxels), dims(dims), axes(axes) {
+        nx = axes[0].first.size();
+        ny = axes[1].first.size();
+        yFirst = filterYFirst(axes, dims);
+        rowLength = yFirst ? dims[0] : nx;
+        rows.resize((size_t)dims[1] * rowLength);
+        rowPlane.assign(dims[1], -1);
+        planes.resize(axes[2].taps);
+        planeOf.assign(axes[2].taps, -1);
+        window.resize(axes[2].taps);
+        line.resize(dims[0]);
+        sum.resize(nx);
+    }
+
+    // Fill grid planes [z0, z1), grid point (x, y, z) is at
+    // out[z * planeStride + y * rowStride + x]. Stops early once cancel is set
+    void run(int z0, int z1, float *out, size_t rowStride, size_t planeStride, float low, float high, const atomic<bool> *cancel) {
+        float range = high - low;
+        const RowKernels &k = rowKernels();
+        for(int z = z0; z < z1; z++) {
+            if(cancel && *cancel) {
+                return;
+            }
+            const float *wz = axes[2].weightsOf(z);
+            int fz = axes[2].first[z];
+            for(int t = 0; t < axes[2].taps; t++) {
+                window[t] = reducedPlane(fz + t);
+            }
+            for(int y = 0; y < ny; y++) {
+                fill(sum.begin(), sum.end(), 0.0f);
+                for(int t = 0; t < axes[2].taps; t++) {
+                    k.addScaled(window[t] + (size_t)y * nx, wz[t], sum.data(), nx);
+                }
+                k.normalize(sum.data(), low, range, out + (size_t)z * planeStride + (size_t)y * rowStride, nx);
+            }
+        }
+    }
+
+private:
+    // Voxel plane vz filtered along x and y, computed once per window
+    const float *reducedPlane(int vz) {
+        int slot = vz % axes[2].taps;
+        vector<float> &plane = planes[slot];
+        if(planeOf[slot] == vz) {
+            return plane.data();
+        }
+        planeOf[slot] = vz;
+        plane.assign((size_t)ny * nx, 0.0f);
+        const RowKernels &k = rowKernels();
+        for(int y = 0; y < ny; y++) {
+            const float *wy = axes[1].weightsOf(y);
+            int fy = axes[1].first[y];
+            if(yFirst) {
+                fill(line.begin(), line.end(), 0.0f);
+                for(int t = 0; t < axes[1].taps; t++) {
+                    k.addScaled(row(fy + t, vz), wy[t], line.data(), dims[0]);
+                }
+                filterX(line.data(), &plane[(size_t)y * nx]);
+            } else {
+                for(int t = 0; t < axes[1].taps; t++) {
+                    k.addScaled(row(fy + t, vz), wy[t], &plane[(size_t)y * nx], nx);
+                }
+            }
+        }
+        return plane.data();
+    }
+
+    // Voxel row (vy, vz), converted to floats when y goes first and filtered
+    // along x otherwise
+    const float *row(int vy, int vz) {
+        float *r = &rows[(size_t)vy * rowLength];
+        if(rowPlane[vy] == vz) {
+            return r;
+        }
+        rowPlane[vy] = vz;
+        const T *src = voxels + ((size_t)vz * dims[1] + vy) * dims[0];
+        if(yFirst) {
+            for(int x = 0; x < dims[0]; x++) {
+                r[x] = src[x];
+            }
+        } else {
+            filterX(src, r);
+        }
+        return r;
+    }
+
+    // Filter a row of dims[0] values along x into nx samples
+    template <typename S>
+    void filterX(const S *src, float *dst) const {
+        const int *first = axes[0].first.data();
+        const float *w = axes[0].weights.data();
+        int taps = axes[0].taps;
+        if(taps == 2) {
+            for(int x = 0; x < nx; x++) {
+                const S *v = src + first[x];
+                float s = 0.0f;
+                s += v[0] * w[2 * x];
+                s += v[1] * w[2 * x + 1];
+                dst[x] = s;
+            }
+            return;
+        }
+        for(int x = 0; x < nx; x++) {
+            const S *v = src + first[x];
+            const float *wx = w + (size_t)x * taps;
+            float s = 0.0f;
+            for(int t = 0; t < taps; t++) {
+                s += v[t] * wx[t];
+            }
+            dst[x] = s;
+        }
+    }
+};
+
+#endif
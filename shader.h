@@ -2,9 +2,13 @@
 #define SHADER_H
 
 #include <string>
+#include <cstring>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
 
 // GLEW
 #include <GL/glew.h>
@@ -19,6 +23,11 @@ class Shader {
 public:
     GLuint program;
 
+private:
+    // Location of every active uniform outside a block, found once linked
+    unordered_map<string, GLint> locations;
+
+public:
     // read and build the shader
     Shader(const char* vertexPath, const char* fragmentPath) {
         // read files
@@ -69,6 +78,8 @@ public:
         // clean up shaders
         glDeleteShader(vertex);
         glDeleteShader(fragment);
+
+        reflect();
     }
 
     // activate the shader
@@ -76,31 +87,73 @@ public:
         glUseProgram(program);
     }
 
+    // Cached location of a uniform, -1 (ignored by glUniform) when the
+    // program has no such active uniform
+    GLint location(const GLchar *name) const {
+        auto found = locations.find(name);
+        return found == locations.end() ? -1 : found->second;
+    }
+
     void setVec3(const GLchar *name, const glm::vec3 &vec) {
-		glUniform3fv(glGetUniformLocation(program, name), 1, glm::value_ptr(vec));
+		glUniform3fv(location(name), 1, glm::value_ptr(vec));
     }
 
     void setVec4(const GLchar *name, const glm::vec4 &vec) {
-		glUniform4fv(glGetUniformLocation(program, name), 1, glm::value_ptr(vec));
+		glUniform4fv(location(name), 1, glm::value_ptr(vec));
     }
 
     void setMat4(const GLchar *name, const glm::mat4 &mat) {
-		glUniformMatrix4fv(glGetUniformLocation(program, name), 1, GL_FALSE, glm::value_ptr(mat));
+		glUniformMatrix4fv(location(name), 1, GL_FALSE, glm::value_ptr(mat));
     }
 
     void setBool(const GLchar *name, const bool var) {
-		glUniform1i(glGetUniformLocation(program, name), var);
+		glUniform1i(location(name), var);
     }
 
     void setInt(const GLchar *name, const GLint var) {
-		glUniform1i(glGetUniformLocation(program, name), var);
+		glUniform1i(location(name), var);
     }
 
     void setFloat(const GLchar *name, const GLfloat var) {
-		glUniform1f(glGetUniformLocation(program, name), var);
+		glUniform1f(location(name), var);
+    }
+
+    // Bind the uniform block called name to binding point, false when the
+    // program has no such block
+    bool bindBlock(const GLchar *name, GLuint binding) {
+        GLuint index = glGetUniformBlockIndex(program, name);
+        if(index == GL_INVALID_INDEX) {
+            return false;
+        }
+        glUniformBlockBinding(program, index, binding);
+        return true;
     }
 
 private:
+    // Look up the locations of the active uniforms once, arrays under both
+    // "name" and "name[0]"
+    void reflect() {
+        GLint count = 0, longest = 0;
+        glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &longest);
+        vector<GLchar> name(max(longest, 1));
+        for(GLint i = 0; i < count; i++) {
+            GLint size;
+            GLenum type;
+            glGetActiveUniform(program, i, name.size(), NULL, &size, &type, name.data());
+            GLint at = glGetUniformLocation(program, name.data());
+            if(at < 0) {
+                // In a uniform block, set through its buffer
+                continue;
+            }
+            string key = name.data();
+            locations[key] = at;
+            if(key.size() > 3 && key.compare(key.size() - 3, 3, "[0]") == 0) {
+                locations[key.substr(0, key.size() - 3)] = at;
+            }
+        }
+    }
+
     // Compile a shader or program
     void compile_shader(GLuint shader, string type) {
         GLint success = false;
@@ -129,4 +182,102 @@ private:
 
 };
 
+/**
+ * A buffer backing a std140 uniform block, shared by every program bound to
+ * its binding point. T mirrors the block byte for byte. Change data freely;
+ * update() uploads only the bytes that changed since the last update, and
+ * nothing when none did
+ */
+template <typename T>
+class UniformBuffer {
+    GLuint buffer = 0;
+    GLuint binding;
+    T sent;
+    bool uploaded = false;
+
+public:
+    T data;
+
+    // data starts out zeroed
+    explicit UniformBuffer(GLuint bindingPoint) : binding(bindingPoint), sent(), data() {
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(T), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        glBindBufferBase(GL_UNIFORM_BUFFER, binding, buffer);
+    }
+
+    ~UniformBuffer() {
+        glDeleteBuffers(1, &buffer);
+    }
+
+    // Read the block called name of shader from this buffer
+    void attach(Shader &shader, const GLchar *name) {
+        if(!shader.bindBlock(name, binding)) {
+            cout << "Error: shader has no uniform block " << name << endl;
+        }
+    }
+
+    void update() {
+        const uint8_t *now = (const uint8_t*)&data, *before = (const uint8_t*)&sent;
+        size_t first = 0, last = sizeof(T);
+        if(uploaded) {
+            while(first < last && now[first] == before[first]) {
+                first++;
+            }
+            while(last > first && now[last - 1] == before[last - 1]) {
+                last--;
+            }
+            if(first == last) {
+                return;
+            }
+        }
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+        glBufferSubData(GL_UNIFORM_BUFFER, first, last - first, now + first);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        sent = data;
+        uploaded = true;
+    }
+};
+
+// A Light of shader/basic.frag in std140 layout
+struct LightUniforms {
+    glm::vec3 ambient;
+    float pad0;
+    glm::vec3 diffuse;
+    float pad1;
+    glm::vec3 specular;
+    float pad2;
+    glm::vec4 position;
+    GLint enabled;
+    GLint pad3[3];
+};
+
+// Copy a light into its place in the frame uniforms
+inline void setLight(LightUniforms &out, const glm::vec3 &ambient, const glm::vec3 &diffuse, const glm::vec3 &specular,
+                     const glm::vec4 &position, bool enabled) {
+    out.ambient = ambient;
+    out.diffuse = diffuse;
+    out.specular = specular;
+    out.position = position;
+    out.enabled = enabled;
+}
+
+// The Frame block of shader/basic.vert and shader/basic.frag, state that is
+// the same for everything drawn in a frame
+struct FrameUniforms {
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::vec3 cameraPos;
+    float shininess;
+    glm::vec3 colorIn;
+    GLint shadeFlat;
+    LightUniforms point;
+    LightUniforms point2;
+    LightUniforms directional;
+};
+
+// std140 offsets: lights at 160, 240 and 320
+static_assert(sizeof(FrameUniforms) == 400, "FrameUniforms must match the std140 layout of Frame");
+
 #endif
@@ -7,13 +7,19 @@ struct Light {
     bool enabled;
 };
 
-uniform vec3 cameraPos;
-uniform vec3 colorIn;
-uniform float shininess;
-uniform Light point;
-uniform Light point2;
-uniform Light directional;
-uniform bool shadeFlat;
+// Per frame state, FrameUniforms in shader.h. The same in basic.vert and
+// basic.frag
+layout (std140) uniform Frame {
+    mat4 view;
+    mat4 projection;
+    vec3 cameraPos;
+    float shininess;
+    vec3 colorIn;
+    bool shadeFlat;
+    Light point;
+    Light point2;
+    Light directional;
+};
 
 in vec3 FragNormal;
 flat in vec3 FragNormalFlat;
@@ -2,21 +2,62 @@
 
 layout (location = 0) in vec3 position;
 layout (location = 1) in vec3 normal;
+// Octahedral normal of packed vertices, see PackedVertex in vertex.h
+layout (location = 2) in vec2 packedNormal;
+
+struct Light {
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+    vec4 position;
+    bool enabled;
+};
+
+// Per frame state, FrameUniforms in shader.h. The same in basic.vert and
+// basic.frag
+layout (std140) uniform Frame {
+    mat4 view;
+    mat4 projection;
+    vec3 cameraPos;
+    float shininess;
+    vec3 colorIn;
+    bool shadeFlat;
+    Light point;
+    Light point2;
+    Light directional;
+};
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+// Packed positions are in [0, 1] inside this box
+uniform bool packedVertices;
+uniform vec3 positionOrigin;
+uniform vec3 positionScale;
 
 out vec3 FragPosition;
 out vec3 FragNormal;
 flat out vec3 FragNormalFlat;
 
+vec3 decodeNormal(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if(n.z < 0.0) {
+        n.xy = (1.0 - abs(e.yx)) * vec2(e.x >= 0.0 ? 1.0 : -1.0, e.y >= 0.0 ? 1.0 : -1.0);
+    }
+    return normalize(n);
+}
+
 void main() {
+    vec3 p = position;
+    vec3 n = normal;
+    if(packedVertices) {
+        p = positionOrigin + positionScale * position;
+        n = decodeNormal(packedNormal);
+    }
+
     gl_PointSize = 4.0;
     // Fine as long as we don't scale
-    FragNormal = vec3(model * vec4(normal, 1.0f));
+    FragNormal = vec3(model * vec4(n, 1.0f));
     FragNormalFlat = FragNormal;
 
-    FragPosition = vec3(model * vec4(position, 1.0f));
-    gl_Position = projection * view * model * vec4(position, 1.0f);
+    FragPosition = vec3(model * vec4(p, 1.0f));
+    gl_Position = projection * view * model * vec4(p, 1.0f);
 }
@@ -0,0 +1,519 @@
+#ifndef STREAMING_H
+#define STREAMING_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <algorithm>
+
+#include "marchingcubes.h"
+
+using namespace std;
+
+/**
+ * Extracts the surface of a volume too large to keep in memory. The grid
+ * of setCuts is split into bricks of cells; each brick reads only the voxels
+ * under it plus a one voxel halo, resamples its grid points and emits its own
+ * triangles. Vertices on the seams between bricks are welded through the grid
+ * edge they lie on and are written once the last brick sharing them is done,
+ * so the mesh matches the in-core one. Bricks are sized to fit half the
+ * memory budget. The open vertices of a layer of bricks grow with the surface
+ * crossing the volume's XY cross-section, so the extraction fails once they
+ * no longer fit the other half. The result is written to a binary PLY file
+ */
+class StreamingExtractor {
+public:
+    struct Stats {
+        size_t bricks = 0;
+        int brickCells = 0;
+        size_t vertices = 0;
+        size_t triangles = 0;
+        // Largest brick buffers plus open vertices held at once, never more
+        // than the memory budget
+        size_t peakBytes = 0;
+    };
+
+private:
+    // A vertex still referenced by bricks that are not done yet
+    struct OpenVertex {
+        uint32_t id;
+        glm::vec3 position;
+        glm::vec3 normal;
+    };
+
+    VolumeInfo info;
+    string path;
+    size_t width;
+    int raw_dimension[3];
+    int grid_dimension[3];
+    int cells[3];
+    float spacing[3];
+    ResampleFilter filter = Trilinear;
+    AxisWeights axes[3];
+    bool yFirst = false;
+    size_t memoryBudget = (size_t)256 << 20;
+    int brickCells = 0;
+    int bricks[3];
+
+    ifstream input;
+    // Voxels under the current brick, as bytes of info.type, and its
+    // resampled grid points
+    vector<uint8_t> voxels;
+    int voxelOrigin[3], voxelSize[3];
+    vector<float> values;
+    int pointOrigin[3], pointSize[3];
+
+    // Open vertices by grid edge, and the edges each brick is the last user of
+    unordered_map<uint64_t, OpenVertex> open;
+    unordered_map<size_t, vector<uint64_t>> retire;
+    uint32_t nextVertex = 0;
+    Stats stats;
+
+public:
+    // An 8 bit volume without a header
+    StreamingExtractor(const string &path, int x, int y, int z) {
+        VolumeInfo raw;
+        raw.dataPath = path;
+        raw.dimension[0] = x;
+        raw.dimension[1] = y;
+        raw.dimension[2] = z;
+        raw.hasRange = true;
+        setVolume(raw);
+    }
+
+    // A volume described by readVolumeInfo
+    explicit StreamingExtractor(const VolumeInfo &volume) {
+        setVolume(volume);
+    }
+
+    // Memory for brick buffers and open vertices, the brick size follows
+    // from it. The open vertices grow with the surface crossing a brick
+    // plane, not with the volume, and extract fails when they exceed it
+    void setMemoryBudget(size_t bytes) {
+        memoryBudget = bytes;
+    }
+
+    // Same as MarchingCubes::setResampleFilter, call before setCuts
+    void setResampleFilter(ResampleFilter f) {
+        filter = f;
+    }
+
+    // Same grid as MarchingCubes::setCuts
+    void setCuts(size_t cuts) {
+        for(int i = 0; i < 3; i++) {
+            grid_dimension[i] = cuts + 2;
+            cells[i] = grid_dimension[i] - 1;
+            spacing[i] = 1.0f * (raw_dimension[i]) / (cuts-1);
+            axes[i].build(filter, raw_dimension[i], cuts, spacing[i]);
+        }
+        yFirst = filterYFirst(axes, raw_dimension);
+
+        // Half the budget goes to the brick buffers, the rest is left for
+        // the open vertices and the output
+        brickCells = 256;
+        while(brickCells > 8 && brickBytes(brickCells) > memoryBudget / 2) {
+            brickCells -= 8;
+        }
+        for(int i = 0; i < 3; i++) {
+            bricks[i] = (cells[i] + brickCells - 1) / brickCells;
+        }
+    }
+
+    const Stats &statistics() const {
+        return stats;
+    }
+
+    // Extract the surface at level into a binary PLY file at outPath
+    bool extract(float level, const string &outPath) {
+        level = MarchingCubes::clampLevel(level);
+        stats = Stats();
+        stats.brickCells = brickCells;
+        open.clear();
+        retire.clear();
+        nextVertex = 0;
+
+        if(info.bricked) {
+            cout << "Error: " << path << " is bricked, only raw volumes are streamed" << endl;
+            return false;
+        }
+        input.close();
+        input.clear();
+        input.open(path, ios::binary);
+        if(!input) {
+            cout << "Error: opening " << path << " failed" << endl;
+            return false;
+        }
+        input.seekg(0, ios::end);
+        if((size_t)input.tellg() < info.offset + info.byteCount()) {
+            cout << "Error: " << path << " is smaller than " << raw_dimension[0] << "x" << raw_dimension[1]
+                 << "x" << raw_dimension[2] << " " << voxelTypeName(info.type) << " voxels" << endl;
+            return false;
+        }
+        if(brickBytes(brickCells) > memoryBudget / 2) {
+            cout << "Error: bricks of " << brickCells << "^3 cells need " << (brickBytes(brickCells) >> 20)
+                 << " MB, more than half the memory budget of " << (memoryBudget >> 20) << " MB" << endl;
+            return false;
+        }
+        if(!info.hasRange && !scanRange()) {
+            return false;
+        }
+
+        string vertexPath = outPath + ".vertices.tmp";
+        string facePath = outPath + ".faces.tmp";
+        fstream vertexFile(vertexPath, ios::in | ios::out | ios::binary | ios::trunc);
+        ofstream faceFile(facePath, ios::binary | ios::trunc);
+        if(!vertexFile || !faceFile) {
+            cout << "Error: could not write next to " << outPath << endl;
+            return false;
+        }
+
+        bool ok = true;
+        for(int bz = 0; bz < bricks[2] && ok; bz++) {
+            for(int by = 0; by < bricks[1] && ok; by++) {
+                for(int bx = 0; bx < bricks[0] && ok; bx++) {
+                    ok = extractBrick(bx, by, bz, level, faceFile) && retireBrick(brickIndex(bx, by, bz), vertexFile);
+                }
+            }
+        }
+        ok = ok && open.empty();
+
+        vertexFile.close();
+        faceFile.close();
+        if(ok) {
+            ok = writePly(outPath, vertexPath, facePath);
+        }
+        remove(vertexPath.c_str());
+        remove(facePath.c_str());
+        input.close();
+        return ok;
+    }
+
+private:
+    void setVolume(const VolumeInfo &volume) {
+        info = volume;
+        path = info.dataPath;
+        width = voxelBytes(info.type);
+        for(int i = 0; i < 3; i++) {
+            raw_dimension[i] = info.dimension[i];
+        }
+    }
+
+    // Voxels and grid values held for a brick of n cells per side
+    size_t brickBytes(int n) const {
+        size_t bytes = (size_t)(n + 1) * (n + 1) * (n + 1) * sizeof(float);
+        size_t voxelCount = 1;
+        for(int i = 0; i < 3; i++) {
+            voxelCount *= min((size_t)raw_dimension[i], (size_t)ceil(n * spacing[i]) + axes[i].taps + 1);
+        }
+        return bytes + voxelCount * width;
+    }
+
+    // Swap the byte order of the voxels in [begin, end) when the file was
+    // written on a machine with the other one
+    void fixByteOrder(uint8_t *begin, uint8_t *end) const {
+        if(volumeNeedsSwap(info)) {
+            for(uint8_t *v = begin; v + width <= end; v += width) {
+                reverse(v, v + width);
+            }
+        }
+    }
+
+    // Find the smallest and largest voxel with one pass over the file, the
+    // same range MarchingCubes maps to [0, 1] for volumes without one
+    bool scanRange() {
+        switch(info.type) {
+            case Uint8: scanRange<uint8_t>(); break;
+            case Uint16: scanRange<uint16_t>(); break;
+            case Int16: scanRange<int16_t>(); break;
+            case Float32: scanRange<float>(); break;
+        }
+        if(!input) {
+            cout << "Error: reading " << path << " failed" << endl;
+            return false;
+        }
+        if(!(info.high > info.low)) {
+            info.high = info.low + 1.0f;
+        }
+        info.hasRange = true;
+        return true;
+    }
+
+    template <typename T>
+    void scanRange() {
+        vector<uint8_t> chunk((size_t)1 << 20);
+        size_t left = info.byteCount();
+        T lo = 0, hi = 0;
+        bool first = true;
+        input.seekg(info.offset);
+        while(left > 0 && input) {
+            size_t n = min(left, chunk.size());
+            input.read((char*)chunk.data(), n);
+            fixByteOrder(chunk.data(), chunk.data() + n);
+            const T *v = (const T*)chunk.data();
+            for(size_t i = 0; i < n / sizeof(T); i++) {
+                if(first) {
+                    lo = hi = v[i];
+                    first = false;
+                }
+                lo = min(lo, v[i]);
+                hi = max(hi, v[i]);
+            }
+            left -= n;
+        }
+        info.low = (float)lo;
+        info.high = (float)hi;
+    }
+
+    size_t brickIndex(int bx, int by, int bz) const {
+        return ((size_t)bz * bricks[1] + by) * bricks[0] + bx;
+    }
+
+    // Last brick in scan order with a cell that has the edge starting at
+    // grid point p along axis, after it the vertex can be written
+    size_t lastBrick(const int p[3], int axis) const {
+        int b[3];
+        for(int i = 0; i < 3; i++) {
+            int cell = i == axis ? p[i] : min(p[i], cells[i] - 1);
+            b[i] = cell / brickCells;
+        }
+        return brickIndex(b[0], b[1], b[2]);
+    }
+
+    // Lowest voxel the filter reads for grid point g along axis
+    int voxelFor(int g, int axis) const {
+        return axes[axis].first[g - 1];
+    }
+
+    // Read the voxels under grid points [p0, p1] and resample them
+    bool loadBrick(const int p0[3], const int p1[3]) {
+        for(int i = 0; i < 3; i++) {
+            int first = max(p0[i], 1);
+            int last = min(p1[i], grid_dimension[i] - 2);
+            voxelOrigin[i] = voxelFor(first, i);
+            voxelSize[i] = voxelFor(last, i) + axes[i].taps - voxelOrigin[i];
+            pointOrigin[i] = p0[i];
+            pointSize[i] = p1[i] - p0[i] + 1;
+        }
+        voxels.resize((size_t)voxelSize[0] * voxelSize[1] * voxelSize[2] * width);
+        size_t rowBytes = (size_t)raw_dimension[0] * width;
+        size_t planeBytes = rowBytes * raw_dimension[1];
+        size_t brickRow = (size_t)voxelSize[0] * width;
+        bool wholeRows = voxelSize[0] == raw_dimension[0];
+        for(int z = 0; z < voxelSize[2]; z++) {
+            size_t planeOffset = info.offset + (size_t)(voxelOrigin[2] + z) * planeBytes;
+            if(wholeRows) {
+                input.seekg(planeOffset + voxelOrigin[1] * rowBytes);
+                input.read((char*)&voxels[(size_t)z * voxelSize[1] * brickRow], (size_t)voxelSize[1] * brickRow);
+            } else {
+                for(int y = 0; y < voxelSize[1]; y++) {
+                    input.seekg(planeOffset + (voxelOrigin[1] + y) * rowBytes + voxelOrigin[0] * width);
+                    input.read((char*)&voxels[((size_t)z * voxelSize[1] + y) * brickRow], brickRow);
+                }
+            }
+        }
+        if(!input) {
+            cout << "Error: reading " << path << " failed" << endl;
+            return false;
+        }
+        fixByteOrder(voxels.data(), voxels.data() + voxels.size());
+
+        values.resize((size_t)pointSize[0] * pointSize[1] * pointSize[2]);
+        switch(info.type) {
+            case Uint8: resampleBrick<uint8_t>(); break;
+            case Uint16: resampleBrick<uint16_t>(); break;
+            case Int16: resampleBrick<int16_t>(); break;
+            case Float32: resampleBrick<float>(); break;
+        }
+        return true;
+    }
+
+    // Sample the grid points of the brick from its voxels of type T
+    template <typename T>
+    void resampleBrick() {
+        const T *typed = (const T*)voxels.data();
+        auto voxel = [=](int x, int y, int z) {
+            return (float)typed[((size_t)(z - voxelOrigin[2]) * voxelSize[1] + (y - voxelOrigin[1])) * voxelSize[0] + (x - voxelOrigin[0])];
+        };
+        for(int z = 0; z < pointSize[2]; z++) {
+            for(int y = 0; y < pointSize[1]; y++) {
+                for(int x = 0; x < pointSize[0]; x++) {
+                    int g[3] = { pointOrigin[0] + x, pointOrigin[1] + y, pointOrigin[2] + z };
+                    bool border = false;
+                    for(int i = 0; i < 3; i++) {
+                        border = border || g[i] == 0 || g[i] == grid_dimension[i] - 1;
+                    }
+                    // The grid has a border of zeros like the in-core one
+                    values[((size_t)z * pointSize[1] + y) * pointSize[0] + x] = border ? 0.0f :
+                        sampleSeparable(axes, yFirst, g[0] - 1, g[1] - 1, g[2] - 1, voxel, info.low, info.high);
+                }
+            }
+        }
+    }
+
+    float value(int x, int y, int z) const {
+        return values[((size_t)(z - pointOrigin[2]) * pointSize[1] + (y - pointOrigin[1])) * pointSize[0] + (x - pointOrigin[0])];
+    }
+
+    // The open vertex on the edge starting at grid point p along axis
+    OpenVertex &edgeVertex(float level, const int p[3], int axis) {
+        uint64_t key = (((uint64_t)p[2] * grid_dimension[1] + p[1]) * grid_dimension[0] + p[0]) * 3 + axis;
+        auto found = open.find(key);
+        if(found != open.end()) {
+            return found->second;
+        }
+        int q[3] = { p[0], p[1], p[2] };
+        q[axis]++;
+        float v0 = value(p[0], p[1], p[2]);
+        float t = (level - v0) / (value(q[0], q[1], q[2]) - v0);
+        glm::vec3 position(spacing[0]*p[0], spacing[1]*p[1], spacing[2]*p[2]);
+        position[axis] += t * spacing[axis];
+
+        retire[lastBrick(p, axis)].push_back(key);
+        OpenVertex &v = open[key];
+        v.id = nextVertex++;
+        v.position = position;
+        v.normal = glm::vec3(0.0f);
+        return v;
+    }
+
+    bool extractBrick(int bx, int by, int bz, float level, ofstream &faceFile) {
+        int c0[3] = { bx * brickCells, by * brickCells, bz * brickCells };
+        int c1[3];
+        for(int i = 0; i < 3; i++) {
+            c1[i] = min(c0[i] + brickCells, cells[i]);
+        }
+        if(!loadBrick(c0, c1)) {
+            return false;
+        }
+        stats.bricks++;
+
+        vector<char> faces;
+        for(int z = c0[2]; z < c1[2]; z++) {
+            for(int y = c0[1]; y < c1[1]; y++) {
+                for(int x = c0[0]; x < c1[0]; x++) {
+                    // Corners in lookup table order, as in cellIndex
+                    float val[8] = {
+                        value(x, y, z), value(x+1, y, z), value(x+1, y+1, z), value(x, y+1, z),
+                        value(x, y, z+1), value(x+1, y, z+1), value(x+1, y+1, z+1), value(x, y+1, z+1)
+                    };
+                    int cubeIndex = 0;
+                    for(int i = 0; i < 8; i++) {
+                        if(val[i] < level) cubeIndex |= 1 << i;
+                    }
+                    if(cubeIndex == 0 || cubeIndex == 255) {
+                        continue;
+                    }
+
+                    for(size_t k = 0; MCTriTable[cubeIndex][k] != -1; k += 3) {
+                        OpenVertex *v[3];
+                        for(size_t j = 0; j < 3; j++) {
+                            const int *e = MCEdgeOrigin[MCTriTable[cubeIndex][k+j]];
+                            int p[3] = { x + e[0], y + e[1], z + e[2] };
+                            v[j] = &edgeVertex(level, p, e[3]);
+                        }
+                        glm::vec3 cross = glm::cross(v[1]->position - v[0]->position, v[2]->position - v[0]->position);
+                        float length = glm::length(cross);
+                        uint8_t count = 3;
+                        faces.push_back((char)count);
+                        for(size_t j = 0; j < 3; j++) {
+                            if(length > 0.0f) {
+                                v[j]->normal += cross / length;
+                            }
+                            const char *id = (const char*)&v[j]->id;
+                            faces.insert(faces.end(), id, id + sizeof(uint32_t));
+                        }
+                        stats.triangles++;
+                    }
+                }
+            }
+        }
+        faceFile.write(faces.data(), faces.size());
+
+        size_t bytes = workingBytes(faces.capacity());
+        if(bytes > memoryBudget) {
+            cout << "Error: the open vertices of brick layer " << bz << " bring the working set to " << (bytes >> 20)
+                 << " MB, more than the memory budget of " << (memoryBudget >> 20) << " MB" << endl;
+            return false;
+        }
+        stats.peakBytes = max(stats.peakBytes, bytes);
+        return (bool)faceFile;
+    }
+
+    // Brick buffers, the faces of the current brick and the open vertices
+    // with their hash nodes, buckets and retire entries
+    size_t workingBytes(size_t faceBytes) const {
+        size_t node = sizeof(OpenVertex) + sizeof(uint64_t) + 2 * sizeof(void*);
+        return voxels.capacity() + values.capacity() * sizeof(float) + faceBytes +
+            open.size() * (node + sizeof(uint64_t)) + (open.bucket_count() + retire.bucket_count()) * sizeof(void*) +
+            retire.size() * (sizeof(size_t) + sizeof(vector<uint64_t>) + 2 * sizeof(void*));
+    }
+
+    // Write the vertices no later brick uses, in runs of consecutive ids
+    bool retireBrick(size_t brick, fstream &vertexFile) {
+        auto found = retire.find(brick);
+        if(found == retire.end()) {
+            return true;
+        }
+        glm::vec3 mu(1.0f / raw_dimension[0], 1.0f / raw_dimension[1], 1.0f / raw_dimension[2]);
+        vector<pair<uint32_t, OpenVertex*>> done;
+        done.reserve(found->second.size());
+        for(uint64_t key : found->second) {
+            OpenVertex &v = open[key];
+            float length = glm::length(v.normal);
+            if(length > 0.0f) {
+                v.normal /= length;
+            }
+            v.position *= mu;
+            done.push_back(make_pair(v.id, &v));
+        }
+        sort(done.begin(), done.end());
+
+        vector<float> run;
+        size_t first = 0;
+        for(size_t i = 0; i <= done.size(); i++) {
+            if(i == done.size() || (i > 0 && done[i].first != done[i - 1].first + 1)) {
+                vertexFile.seekp((streamoff)done[first].first * 6 * sizeof(float));
+                vertexFile.write((const char*)run.data(), run.size() * sizeof(float));
+                run.clear();
+                first = i;
+            }
+            if(i < done.size()) {
+                const OpenVertex &v = *done[i].second;
+                float data[6] = { v.position.x, v.position.y, v.position.z, v.normal.x, v.normal.y, v.normal.z };
+                run.insert(run.end(), data, data + 6);
+            }
+        }
+        for(uint64_t key : found->second) {
+            open.erase(key);
+        }
+        retire.erase(found);
+        stats.vertices += done.size();
+        return (bool)vertexFile;
+    }
+
+    // Header followed by the vertex and face files. Binary PLY is written in
+    // the byte order of the machine, little endian on every target we build
+    bool writePly(const string &outPath, const string &vertexPath, const string &facePath) {
+        ofstream out(outPath, ios::binary | ios::trunc);
+        if(!out) {
+            cout << "Error: could not write " << outPath << endl;
+            return false;
+        }
+        out << plyHeader(stats.vertices, stats.triangles);
+        vector<char> chunk(1 << 20);
+        for(const string &part : { vertexPath, facePath }) {
+            ifstream in(part, ios::binary);
+            while(in.read(chunk.data(), chunk.size()) || in.gcount() > 0) {
+                out.write(chunk.data(), in.gcount());
+            }
+        }
+        return (bool)out;
+    }
+};
+
+#endif
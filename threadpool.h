@@ -0,0 +1,103 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+using namespace std;
+
+/**
+ * Fixed set of worker threads that run the iterations of a parallel loop.
+ * The calling thread takes part too, so a pool of size 1 has no workers
+ */
+class ThreadPool {
+    vector<thread> workers;
+    mutex lock;
+    condition_variable wake, done;
+    const function<void(size_t)> *job = nullptr;
+    size_t next = 0, count = 0, remaining = 0;
+    size_t generation = 0;
+    bool stop = false;
+
+public:
+    explicit ThreadPool(size_t threads) {
+        for(size_t i = 1; i < threads; i++) {
+            workers.push_back(thread([this]() { work(); }));
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            unique_lock<mutex> guard(lock);
+            stop = true;
+        }
+        wake.notify_all();
+        for(thread &worker : workers) {
+            worker.join();
+        }
+    }
+
+    size_t size() const {
+        return workers.size() + 1;
+    }
+
+    // Run fn(i) for every i in [0, n) and wait until all of them finished
+    void parallelFor(size_t n, const function<void(size_t)> &fn) {
+        if(workers.empty() || n <= 1) {
+            for(size_t i = 0; i < n; i++) {
+                fn(i);
+            }
+            return;
+        }
+        {
+            unique_lock<mutex> guard(lock);
+            job = &fn;
+            next = 0;
+            count = n;
+            remaining = n;
+            generation++;
+        }
+        wake.notify_all();
+        runJobs();
+
+        unique_lock<mutex> guard(lock);
+        done.wait(guard, [this]() { return remaining == 0; });
+        job = nullptr;
+    }
+
+private:
+    void work() {
+        size_t seen = 0;
+        while(true) {
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [&]() { return stop || generation != seen; });
+                if(stop) {
+                    return;
+                }
+                seen = generation;
+            }
+            runJobs();
+        }
+    }
+
+    // Take iterations until none are left
+    void runJobs() {
+        unique_lock<mutex> guard(lock);
+        while(job && next < count) {
+            size_t i = next++;
+            const function<void(size_t)> &fn = *job;
+            guard.unlock();
+            fn(i);
+            guard.lock();
+            if(--remaining == 0) {
+                done.notify_all();
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef VERTEX_H
+#define VERTEX_H
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "marchingcubes.h"
+
+using namespace std;
+
+struct Vertex {
+    glm::vec3 p;
+    glm::vec3 n;
+};
+
+/**
+ * Vertex of 12 bytes instead of 24: the position quantized to 16 bits per
+ * axis inside the bounding box of its mesh (w is padding so the normal
+ * stays 4 byte aligned), and the normal octahedral encoded into two 16 bit
+ * signed normalized values. Decoded in shader/basic.vert
+ */
+struct PackedVertex {
+    uint16_t position[4];
+    int16_t normal[2];
+};
+
+// Box the quantized positions of a mesh span, position = origin + scale * q
+struct PackedBox {
+    glm::vec3 origin = glm::vec3(0.0f);
+    glm::vec3 scale = glm::vec3(1.0f);
+};
+
+inline PackedBox packedBox(const glm::vec3 *positions, size_t count) {
+    PackedBox box;
+    if(count == 0) {
+        return box;
+    }
+    glm::vec3 low = positions[0], high = positions[0];
+    for(size_t i = 1; i < count; i++) {
+        low = glm::min(low, positions[i]);
+        high = glm::max(high, positions[i]);
+    }
+    box.origin = low;
+    for(int i = 0; i < 3; i++) {
+        box.scale[i] = high[i] > low[i] ? high[i] - low[i] : 1.0f;
+    }
+    return box;
+}
+
+// Fold a unit vector onto the octahedron and unfold it into [-1, 1]^2
+inline void octEncode(const glm::vec3 &n, int16_t out[2]) {
+    float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+    float x = l1 > 0.0f ? n.x / l1 : 0.0f;
+    float y = l1 > 0.0f ? n.y / l1 : 0.0f;
+    if(n.z < 0.0f) {
+        float fx = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float fy = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = fx;
+        y = fy;
+    }
+    out[0] = (int16_t)lround(min(max(x, -1.0f), 1.0f) * 32767.0f);
+    out[1] = (int16_t)lround(min(max(y, -1.0f), 1.0f) * 32767.0f);
+}
+
+// Inverse of octEncode, the same as decodeNormal in shader/basic.vert
+inline glm::vec3 octDecode(const int16_t in[2]) {
+    float x = max(in[0] / 32767.0f, -1.0f);
+    float y = max(in[1] / 32767.0f, -1.0f);
+    glm::vec3 n(x, y, 1.0f - fabs(x) - fabs(y));
+    if(n.z < 0.0f) {
+        n.x = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        n.y = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+    }
+    return glm::normalize(n);
+}
+
+inline void packVertex(const glm::vec3 &position, const glm::vec3 &normal, const PackedBox &box, PackedVertex &out) {
+    glm::vec3 q = (position - box.origin) / box.scale;
+    for(int j = 0; j < 3; j++) {
+        out.position[j] = (uint16_t)lround(min(max(q[j], 0.0f), 1.0f) * 65535.0f);
+    }
+    out.position[3] = 0;
+    octEncode(normal, out.normal);
+}
+
+// Expand the extracted faces into 3 vertices per triangle
+inline vector<Vertex> flattenFaces(const vector<Face*> &faces) {
+    vector<Vertex> vertices;
+    for(size_t i = 0; i < faces.size(); i++) {
+        for(size_t j = 0; j < 3; j++) {
+            vertices.push_back({
+                faces[i]->iList[j]->position,
+                faces[i]->iList[j]->normal
+            });
+        }
+    }
+    return vertices;
+}
+
+#endif
@@ -0,0 +1,302 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MC_HAVE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+// Scalar types a volume can be stored as
+enum VoxelType {
+    Uint8,
+    Uint16,
+    Int16,
+    Float32
+};
+
+inline size_t voxelBytes(VoxelType type) {
+    switch(type) {
+        case Uint8: return 1;
+        case Uint16: return 2;
+        case Int16: return 2;
+        default: return 4;
+    }
+}
+
+inline const char *voxelTypeName(VoxelType type) {
+    switch(type) {
+        case Uint8: return "uint8";
+        case Uint16: return "uint16";
+        case Int16: return "int16";
+        default: return "float";
+    }
+}
+
+// Seek to offset from the start of fp, past 2 GB also where long is 32 bit
+inline bool seekFile(FILE *fp, uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(fp, (int64_t)offset, SEEK_SET) == 0;
+#else
+    return fseeko(fp, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+inline uint64_t rotl64(uint64_t v, int bits) {
+    return (v << bits) | (v >> (64 - bits));
+}
+
+// 64 bit hash of n bytes, four independent lanes in the style of xxHash so
+// large volumes hash at memory speed
+inline uint64_t hashBytes(const void *data, size_t n, uint64_t seed = 0) {
+    const uint64_t P1 = 0x9e3779b185ebca87ull, P2 = 0xc2b2ae3d27d4eb4full, P3 = 0x165667b19e3779f9ull;
+    const uint8_t *p = (const uint8_t*)data;
+    uint64_t lane[4] = { seed + P1 + P2, seed + P2, seed, seed - P1 };
+    size_t i = 0;
+    for(; i + 32 <= n; i += 32) {
+        for(int l = 0; l < 4; l++) {
+            uint64_t v;
+            memcpy(&v, p + i + l * 8, 8);
+            lane[l] = rotl64(lane[l] + v * P2, 31) * P1;
+        }
+    }
+    uint64_t h = n >= 32 ? rotl64(lane[0], 1) + rotl64(lane[1], 7) + rotl64(lane[2], 12) + rotl64(lane[3], 18) : seed + P3;
+    h += n;
+    for(; i < n; i++) {
+        h ^= p[i] * P3;
+        h = rotl64(h, 11) * P1;
+    }
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    return h ^ (h >> 32);
+}
+
+// Compile time mapping from a C++ type to its VoxelType
+template <typename T> struct VoxelTraits;
+template <> struct VoxelTraits<uint8_t> { static const VoxelType type = Uint8; };
+template <> struct VoxelTraits<uint16_t> { static const VoxelType type = Uint16; };
+template <> struct VoxelTraits<int16_t> { static const VoxelType type = Int16; };
+template <> struct VoxelTraits<float> { static const VoxelType type = Float32; };
+
+/**
+ * The voxels of a volume, owned by one object and released when it is
+ * destroyed or another volume is loaded. Files are memory mapped where the
+ * platform allows it, so nothing is read until a voxel is touched, and read
+ * into memory otherwise or when the bytes have to be swapped. Voxel values
+ * [low, high] map to [0, 1] when the volume is sampled
+ */
+class VolumeSource {
+public:
+    // How the voxels are about to be read, passed on to the kernel as a hint
+    enum Access {
+        Normal,
+        Sequential,
+        Random
+    };
+
+private:
+    const uint8_t *bytes = nullptr;
+    size_t length = 0;
+    vector<uint8_t> buffer;
+    void *mapping = nullptr;
+    size_t mappingLength = 0;
+    VoxelType voxelType = Uint8;
+    float low = 0.0f, high = 255.0f;
+
+public:
+    VolumeSource() {}
+
+    ~VolumeSource() {
+        release();
+    }
+
+    VolumeSource(const VolumeSource&) = delete;
+    VolumeSource &operator=(const VolumeSource&) = delete;
+
+    // Open size bytes of voxels of the given type starting at offset in the
+    // file at path, mapped when possible. Returns false when the file can not
+    // be opened or is too short
+    bool load(const string &path, size_t size, VoxelType type = Uint8, size_t offset = 0, bool swapBytes = false) {
+        release();
+        voxelType = type;
+#ifdef MC_HAVE_MMAP
+        // An offset that is not a multiple of the voxel size would leave
+        // wider voxels misaligned in the mapping, those are read instead
+        if(!swapBytes && offset % voxelBytes(type) == 0 && map(path, size, offset)) {
+            return true;
+        }
+#endif
+        if(!read(path, size, offset)) {
+            return false;
+        }
+        if(swapBytes) {
+            size_t width = voxelBytes(type);
+            for(size_t i = 0; i + width <= size; i += width) {
+                reverse(&buffer[i], &buffer[i + width]);
+            }
+        }
+        return true;
+    }
+
+    // Take a copy of a volume that is already in memory
+    void copy(const uint8_t *data, size_t size, VoxelType type = Uint8) {
+        release();
+        voxelType = type;
+        buffer.assign(data, data + size);
+        bytes = buffer.data();
+        length = size;
+    }
+
+    // Take over voxels decoded into a buffer, data is left empty
+    void adopt(vector<uint8_t> &data, VoxelType type = Uint8) {
+        release();
+        voxelType = type;
+        buffer.swap(data);
+        bytes = buffer.data();
+        length = buffer.size();
+    }
+
+    // Drop the voxels, unmapping or freeing them
+    void release() {
+#ifdef MC_HAVE_MMAP
+        if(mapping) {
+            munmap(mapping, mappingLength);
+        }
+#endif
+        mapping = nullptr;
+        mappingLength = 0;
+        vector<uint8_t>().swap(buffer);
+        bytes = nullptr;
+        length = 0;
+    }
+
+    void advise(Access access) {
+#ifdef MC_HAVE_MMAP
+        if(mapping) {
+            int advice = access == Sequential ? MADV_SEQUENTIAL : access == Random ? MADV_RANDOM : MADV_NORMAL;
+            madvise(mapping, mappingLength, advice);
+        }
+#else
+        (void)access;
+#endif
+    }
+
+    const uint8_t *data() const {
+        return bytes;
+    }
+
+    // The voxels as their type, T has to match type()
+    template <typename T>
+    const T *voxels() const {
+        return (const T*)bytes;
+    }
+
+    VoxelType type() const {
+        return voxelType;
+    }
+
+    // Voxel values that map to 0 and 1
+    void setRange(float lowValue, float highValue) {
+        low = lowValue;
+        high = highValue;
+    }
+
+    float rangeLow() const {
+        return low;
+    }
+
+    float rangeHigh() const {
+        return high;
+    }
+
+    // Smallest and largest voxel, touches the whole volume
+    template <typename T>
+    void valueRange(float &lowValue, float &highValue) const {
+        size_t count = length / sizeof(T);
+        const T *v = voxels<T>();
+        T lo = count ? v[0] : T(0), hi = lo;
+        for(size_t i = 1; i < count; i++) {
+            lo = min(lo, v[i]);
+            hi = max(hi, v[i]);
+        }
+        lowValue = (float)lo;
+        highValue = (float)hi;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    // Hash of the voxels and their type, reads the whole volume
+    uint64_t contentHash() const {
+        return hashBytes(bytes, length, voxelType);
+    }
+
+    bool mapped() const {
+        return mapping != nullptr;
+    }
+
+private:
+#ifdef MC_HAVE_MMAP
+    bool map(const string &path, size_t size, size_t offset) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if(fstat(fd, &info) != 0 || (size_t)info.st_size < offset + size || size == 0) {
+            close(fd);
+            return false;
+        }
+        // Mappings start on a page, headers in front of the voxels are skipped
+        size_t skip = offset % (size_t)sysconf(_SC_PAGESIZE);
+        void *p = mmap(nullptr, size + skip, PROT_READ, MAP_PRIVATE, fd, offset - skip);
+        // The mapping keeps the file alive
+        close(fd);
+        if(p == MAP_FAILED) {
+            return false;
+        }
+        mapping = p;
+        mappingLength = size + skip;
+        bytes = (const uint8_t*)p + skip;
+        length = size;
+        return true;
+    }
+#endif
+
+    bool read(const string &path, size_t size, size_t offset) {
+        FILE *fp = fopen(path.c_str(), "rb");
+        if(!fp) {
+            cout << "Error: opening " << path << " failed" << endl;
+            return false;
+        }
+        buffer.resize(size);
+        bool seeked = seekFile(fp, offset);
+        size_t got = seeked ? fread(buffer.data(), 1, size, fp) : 0;
+        fclose(fp);
+        if(got != size) {
+            cout << "Error: " << path << " is shorter than " << size << " bytes" << endl;
+            vector<uint8_t>().swap(buffer);
+            return false;
+        }
+        bytes = buffer.data();
+        length = size;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,437 @@
+#ifndef VOLUMEHEADER_H
+#define VOLUMEHEADER_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+#include "volume.h"
+#include "brickedvolume.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#endif
+
+using namespace std;
+
+/**
+ * Where the voxels of a volume are and how they are stored, read from a
+ * NRRD (.nrrd, .nhdr) or MetaImage (.mhd, .mha) header, a bricked volume
+ * (.bvol, see brickedvolume.h), or from the name of a headerless
+ * Name_X_Y_Z.raw file of 8 bit voxels
+ */
+struct VolumeInfo {
+    string dataPath;
+    int dimension[3] = { 0, 0, 0 };
+    VoxelType type = Uint8;
+    // Bytes before the first voxel
+    size_t offset = 0;
+    bool bigEndian = false;
+    // Voxel values that map to 0 and 1, scanned from the data when absent
+    bool hasRange = false;
+    float low = 0.0f, high = 255.0f;
+    // The voxels are compressed bricks in dataPath rather than raw
+    bool bricked = false;
+
+    size_t voxelCount() const {
+        return (size_t)dimension[0] * dimension[1] * dimension[2];
+    }
+
+    size_t byteCount() const {
+        return voxelCount() * voxelBytes(type);
+    }
+};
+
+namespace volumeheader {
+
+inline string trim(const string &s) {
+    size_t begin = s.find_first_not_of(" \t\r\n");
+    if(begin == string::npos) {
+        return "";
+    }
+    size_t end = s.find_last_not_of(" \t\r\n");
+    return s.substr(begin, end - begin + 1);
+}
+
+inline string lower(string s) {
+    transform(s.begin(), s.end(), s.begin(), [](char c) { return (char)tolower(c); });
+    return s;
+}
+
+inline string extension(const string &path) {
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of("/\\");
+    if(dot == string::npos || (slash != string::npos && dot < slash)) {
+        return "";
+    }
+    return lower(path.substr(dot + 1));
+}
+
+// Detached data files are relative to the header
+inline string relativeTo(const string &header, const string &file) {
+    if(file.empty() || file[0] == '/') {
+        return file;
+    }
+    size_t slash = header.find_last_of("/\\");
+    return slash == string::npos ? file : header.substr(0, slash + 1) + file;
+}
+
+inline bool littleEndianHost() {
+    uint16_t probe = 1;
+    return *(uint8_t*)&probe == 1;
+}
+
+inline bool nrrdType(const string &name, VoxelType &type) {
+    string t = lower(name);
+    if(t == "uchar" || t == "unsigned char" || t == "uint8" || t == "uint8_t") {
+        type = Uint8;
+    } else if(t == "ushort" || t == "unsigned short" || t == "unsigned short int" || t == "uint16" || t == "uint16_t") {
+        type = Uint16;
+    } else if(t == "short" || t == "short int" || t == "signed short" || t == "signed short int" || t == "int16" || t == "int16_t") {
+        type = Int16;
+    } else if(t == "float") {
+        type = Float32;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline bool metaType(const string &name, VoxelType &type) {
+    if(name == "MET_UCHAR") {
+        type = Uint8;
+    } else if(name == "MET_USHORT") {
+        type = Uint16;
+    } else if(name == "MET_SHORT") {
+        type = Int16;
+    } else if(name == "MET_FLOAT") {
+        type = Float32;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Place the voxels at the end of info.dataPath, for headers that give their
+// size as -1
+inline bool dataAtEnd(VolumeInfo &info, ostream &log) {
+    ifstream data(info.dataPath.c_str(), ios::binary | ios::ate);
+    size_t fileSize = (size_t)data.tellg();
+    if(!data || fileSize < info.byteCount()) {
+        log << "Error: " << info.dataPath << " is shorter than " << info.byteCount() << " bytes" << endl;
+        return false;
+    }
+    info.offset = fileSize - info.byteCount();
+    return true;
+}
+
+inline bool readNrrd(const string &path, VolumeInfo &info, ostream &log) {
+    ifstream in(path.c_str(), ios::binary);
+    string line;
+    if(!getline(in, line) || line.compare(0, 4, "NRRD") != 0) {
+        log << "Error: " << path << " is not a NRRD file" << endl;
+        return false;
+    }
+    bool typed = false, sized = false, hasMin = false, hasMax = false;
+    long long skip = 0;
+    string dataFile;
+    while(getline(in, line)) {
+        line = trim(line);
+        // A blank line ends the header, the voxels follow in attached files
+        if(line.empty()) {
+            break;
+        }
+        if(line[0] == '#') {
+            continue;
+        }
+        size_t colon = line.find(':');
+        if(colon == string::npos) {
+            continue;
+        }
+        string key = lower(trim(line.substr(0, colon)));
+        // Key/value pairs use := and are ignored
+        if(colon + 1 < line.size() && line[colon + 1] == '=') {
+            continue;
+        }
+        string value = trim(line.substr(colon + 1));
+        if(key == "type") {
+            typed = nrrdType(value, info.type);
+            if(!typed) {
+                log << "Error: " << path << " has unsupported type " << value << endl;
+                return false;
+            }
+        } else if(key == "dimension") {
+            if(atoi(value.c_str()) != 3) {
+                log << "Error: " << path << " is not a 3D volume" << endl;
+                return false;
+            }
+        } else if(key == "sizes") {
+            istringstream sizes(value);
+            sized = (bool)(sizes >> info.dimension[0] >> info.dimension[1] >> info.dimension[2]);
+        } else if(key == "encoding") {
+            if(lower(value) != "raw") {
+                log << "Error: " << path << " uses " << value << " encoding, only raw is supported" << endl;
+                return false;
+            }
+        } else if(key == "endian") {
+            info.bigEndian = lower(value) == "big";
+        } else if(key == "byte skip") {
+            skip = atoll(value.c_str());
+            if(skip < -1) {
+                log << "Error: " << path << " has a byte skip of " << value << endl;
+                return false;
+            }
+        } else if(key == "data file" || key == "datafile") {
+            dataFile = value;
+        } else if(key == "min") {
+            info.low = (float)atof(value.c_str());
+            hasMin = true;
+        } else if(key == "max") {
+            info.high = (float)atof(value.c_str());
+            hasMax = true;
+        }
+    }
+    if(!typed || !sized) {
+        log << "Error: " << path << " is missing its type or sizes" << endl;
+        return false;
+    }
+    if(hasMin != hasMax) {
+        log << "Error: " << path << " gives " << (hasMin ? "min without max" : "max without min") << endl;
+        return false;
+    }
+    info.hasRange = hasMin;
+    if(dataFile.empty()) {
+        info.dataPath = path;
+    } else {
+        info.dataPath = relativeTo(path, dataFile);
+    }
+    // A byte skip of -1 means the voxels are at the end of the file
+    if(skip == -1) {
+        return dataAtEnd(info, log);
+    }
+    info.offset = (size_t)skip;
+    if(dataFile.empty()) {
+        info.offset += (size_t)in.tellg();
+    }
+    return true;
+}
+
+inline bool readMeta(const string &path, VolumeInfo &info, ostream &log) {
+    ifstream in(path.c_str(), ios::binary);
+    bool typed = false, sized = false, hasMin = false, hasMax = false;
+    float low = 0.0f, high = 0.0f;
+    long headerSize = 0;
+    string dataFile, line;
+    while(getline(in, line)) {
+        size_t equals = line.find('=');
+        if(equals == string::npos) {
+            continue;
+        }
+        string key = trim(line.substr(0, equals));
+        string value = trim(line.substr(equals + 1));
+        if(key == "NDims") {
+            if(atoi(value.c_str()) != 3) {
+                log << "Error: " << path << " is not a 3D volume" << endl;
+                return false;
+            }
+        } else if(key == "DimSize") {
+            istringstream sizes(value);
+            sized = (bool)(sizes >> info.dimension[0] >> info.dimension[1] >> info.dimension[2]);
+        } else if(key == "ElementType") {
+            typed = metaType(value, info.type);
+            if(!typed) {
+                log << "Error: " << path << " has unsupported type " << value << endl;
+                return false;
+            }
+        } else if(key == "ElementNumberOfChannels") {
+            if(atoi(value.c_str()) != 1) {
+                log << "Error: " << path << " has more than one channel" << endl;
+                return false;
+            }
+        } else if(key == "BinaryDataByteOrderMSB" || key == "ElementByteOrderMSB") {
+            info.bigEndian = lower(value) == "true";
+        } else if(key == "CompressedData") {
+            if(lower(value) == "true") {
+                log << "Error: " << path << " is compressed, only raw data is supported" << endl;
+                return false;
+            }
+        } else if(key == "HeaderSize") {
+            headerSize = atol(value.c_str());
+        } else if(key == "ElementMin") {
+            low = (float)atof(value.c_str());
+            hasMin = true;
+        } else if(key == "ElementMax") {
+            high = (float)atof(value.c_str());
+            hasMax = true;
+        } else if(key == "ElementDataFile") {
+            // Always the last field, the voxels follow in .mha files
+            dataFile = value;
+            break;
+        }
+    }
+    if(!typed || !sized || dataFile.empty()) {
+        log << "Error: " << path << " is missing its type, size or data file" << endl;
+        return false;
+    }
+    if(dataFile == "LOCAL") {
+        info.dataPath = path;
+        info.offset = (size_t)in.tellg();
+    } else if(dataFile == "LIST" || dataFile.find('%') != string::npos) {
+        log << "Error: " << path << " splits its data over several files" << endl;
+        return false;
+    } else {
+        info.dataPath = relativeTo(path, dataFile);
+        if(headerSize > 0) {
+            info.offset = (size_t)headerSize;
+        }
+    }
+    // A header size of -1 means the voxels are at the end of the file
+    if(headerSize == -1 && !dataAtEnd(info, log)) {
+        return false;
+    }
+    if(hasMin != hasMax) {
+        log << "Error: " << path << " gives " << (hasMin ? "ElementMin without ElementMax" : "ElementMax without ElementMin") << endl;
+        return false;
+    }
+    if(hasMin) {
+        info.hasRange = true;
+        info.low = low;
+        info.high = high;
+    }
+    return true;
+}
+
+inline bool readBricked(const string &path, VolumeInfo &info, ostream &log) {
+    BrickedVolume volume;
+    if(!volume.open(path, log)) {
+        return false;
+    }
+    info.dataPath = path;
+    for(int i = 0; i < 3; i++) {
+        info.dimension[i] = volume.dimension()[i];
+    }
+    info.type = volume.type();
+    info.hasRange = true;
+    info.low = volume.rangeLow();
+    info.high = volume.rangeHigh();
+    info.bricked = true;
+    return true;
+}
+
+// Name_X_Y_Z.raw, as the volumes in models/ are named
+inline bool readRawName(const string &path, VolumeInfo &info, ostream &log) {
+    size_t slash = path.find_last_of("/\\");
+    string name = path.substr(slash == string::npos ? 0 : slash + 1);
+    name = name.substr(0, name.find_last_of('.'));
+    int dims[3];
+    for(int axis = 2; axis >= 0; axis--) {
+        size_t underscore = name.find_last_of('_');
+        string digits = name.substr(underscore == string::npos ? 0 : underscore + 1);
+        if(underscore == string::npos || digits.empty() || digits.find_first_not_of("0123456789") != string::npos) {
+            log << "Error: the dimensions of " << path << " are unknown, name it Name_X_Y_Z.raw or add a header" << endl;
+            return false;
+        }
+        dims[axis] = atoi(digits.c_str());
+        name = name.substr(0, underscore);
+    }
+    info.dataPath = path;
+    info.dimension[0] = dims[0];
+    info.dimension[1] = dims[1];
+    info.dimension[2] = dims[2];
+    info.type = Uint8;
+    return true;
+}
+
+}
+
+// Fill info from the header at path. Returns false when the file is not a
+// volume this program can read, saying why unless quiet
+inline bool readVolumeInfo(const string &path, VolumeInfo &info, bool quiet = false) {
+    ostream discard(nullptr);
+    ostream &log = quiet ? discard : cout;
+    info = VolumeInfo();
+    string ext = volumeheader::extension(path);
+    bool ok;
+    if(ext == "nrrd" || ext == "nhdr") {
+        ok = volumeheader::readNrrd(path, info, log);
+    } else if(ext == "mhd" || ext == "mha") {
+        ok = volumeheader::readMeta(path, info, log);
+    } else if(ext == "bvol") {
+        ok = volumeheader::readBricked(path, info, log);
+    } else {
+        ok = volumeheader::readRawName(path, info, log);
+    }
+    if(!ok) {
+        return false;
+    }
+    if(info.dimension[0] < 2 || info.dimension[1] < 2 || info.dimension[2] < 2) {
+        log << "Error: " << path << " needs at least 2 voxels along every axis" << endl;
+        return false;
+    }
+    if(info.hasRange && !(info.high > info.low)) {
+        info.hasRange = false;
+    }
+    // 8 bit volumes always map [0, 255] to [0, 1], as before headers were read
+    if(info.type == Uint8 && !info.hasRange) {
+        info.low = 0.0f;
+        info.high = 255.0f;
+        info.hasRange = true;
+    }
+    return true;
+}
+
+// Whether the bytes of a volume have to be swapped on this machine
+inline bool volumeNeedsSwap(const VolumeInfo &info) {
+    return voxelBytes(info.type) > 1 && info.bigEndian == volumeheader::littleEndianHost();
+}
+
+// Volumes in dir that readVolumeInfo understands, sorted by path. A .raw
+// file is left out when a header next to it describes it
+inline vector<string> listVolumes(const string &dir) {
+    vector<string> found;
+#if defined(__unix__) || defined(__APPLE__)
+    DIR *d = opendir(dir.c_str());
+    if(!d) {
+        return found;
+    }
+    vector<string> headers, raws;
+    while(dirent *entry = readdir(d)) {
+        string name = entry->d_name;
+        string ext = volumeheader::extension(name);
+        string path = dir + "/" + name;
+        if(ext == "nrrd" || ext == "nhdr" || ext == "mhd" || ext == "mha" || ext == "bvol") {
+            headers.push_back(path);
+        } else if(ext == "raw") {
+            raws.push_back(path);
+        }
+    }
+    closedir(d);
+    vector<string> described;
+    for(const string &header : headers) {
+        VolumeInfo info;
+        bool ok = readVolumeInfo(header, info, true);
+        if(ok) {
+            found.push_back(header);
+            described.push_back(info.dataPath);
+        }
+    }
+    for(const string &raw : raws) {
+        VolumeInfo info;
+        bool ok = readVolumeInfo(raw, info, true);
+        if(ok && find(described.begin(), described.end(), raw) == described.end()) {
+            found.push_back(raw);
+        }
+    }
+    sort(found.begin(), found.end());
+#else
+    (void)dir;
+#endif
+    return found;
+}
+
+#endif